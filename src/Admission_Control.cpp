@@ -0,0 +1,140 @@
+#include "Admission_Control.h"
+#include "Metrics.h"
+
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+
+/* --------------------------------------- AdmissionControl Implementation ---------------------------------------*/
+
+namespace {
+
+constexpr uint64_t TOKEN = 256;                         // One frame in bucket units
+constexpr uint64_t TIME_MASK = (1ULL << 40) - 1;        // Microseconds, wraps after 12 days
+constexpr uint64_t TOKEN_MASK = (1ULL << 24) - 1;
+constexpr size_t PROBES = 4;
+
+struct alignas(16) Bucket {
+    std::atomic<uint64_t> source;       // Source MAC with bit 48 set, 0 if free
+    std::atomic<uint64_t> state;        // Refill time << 24 | tokens, 0 for a full bucket
+};
+
+std::unique_ptr<Bucket[]> buckets;
+size_t mask = 0;
+uint64_t rate_per_s = 0;                // Bucket units per second
+uint64_t burst = 0;                     // Bucket units
+uint64_t fill_us = 0;                   // Time to fill an empty bucket
+
+
+uint64_t now_us() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count() & TIME_MASK;
+}
+
+
+uint64_t mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+
+// Refills the bucket up to now. Only the time the added tokens account for is consumed, so frequent
+// lookups never lose the fractions of a token accumulated in between.
+void refill(uint64_t state, uint64_t now, uint64_t& tokens, uint64_t& last) {
+    last = state >> 24;
+    tokens = state & TOKEN_MASK;
+
+    // Another thread may have refilled with a later clock reading than ours
+    uint64_t elapsed = (now - last) & TIME_MASK;
+    if(state != 0 && elapsed > TIME_MASK / 2) {
+        elapsed = 0;
+        now = last;
+    }
+    uint64_t added = elapsed * rate_per_s / 1000000;
+    if(state == 0 || elapsed >= fill_us || tokens + added >= burst) {
+        tokens = burst;
+        last = now;
+    } else {
+        tokens += added;
+        last = (last + added * 1000000 / rate_per_s) & TIME_MASK;
+    }
+}
+
+
+Bucket& bucket_of(uint64_t source, uint64_t now) {
+    size_t home = mix(source) & mask;
+
+    for(size_t i=0; i<PROBES; ++i) {
+        Bucket &bucket = buckets[(home + i) & mask];
+        uint64_t current = bucket.source.load(std::memory_order_acquire);
+        if(current == source) return bucket;
+
+        // A free slot, or one whose source has been quiet long enough to have refilled completely
+        uint64_t tokens, last;
+        refill(bucket.state.load(std::memory_order_relaxed), now, tokens, last);
+        if( current == 0 || tokens == burst ) {
+            if( bucket.source.compare_exchange_strong(current, source) ) {
+                bucket.state.store(0, std::memory_order_relaxed);
+                return bucket;
+            }
+            if(current == source) return bucket;
+        }
+    }
+    return buckets[home];
+}
+
+}
+
+
+void AdmissionControl::configure(double rate, int burst_frames, size_t sources) {
+    if(rate <= 0) {
+        buckets.reset();
+        return;
+    }
+
+    size_t count = PROBES;
+    while(count < sources) count <<= 1;
+    buckets = std::make_unique<Bucket[]>(count);
+    for(size_t i=0; i<count; ++i) {
+        buckets[i].source.store(0, std::memory_order_relaxed);
+        buckets[i].state.store(0, std::memory_order_relaxed);
+    }
+    mask = count - 1;
+
+    rate_per_s = std::max<uint64_t>(1, static_cast<uint64_t>(rate * TOKEN));
+    burst = static_cast<uint64_t>(std::max(1, std::min(burst_frames, MAX_BURST))) * TOKEN;
+    fill_us = burst * 1000000 / rate_per_s + 1;
+}
+
+
+bool AdmissionControl::enabled() {
+    return buckets != nullptr;
+}
+
+
+bool AdmissionControl::admit(const uint8_t *frame, size_t len) {
+    if(!buckets || len < 12) return true;
+
+    uint64_t source = 1ULL << 48;
+    for(int i=6; i<12; ++i) source |= static_cast<uint64_t>(frame[i]) << (8 * (11 - i));
+
+    uint64_t now = now_us();
+    Bucket &bucket = bucket_of(source, now);
+    uint64_t state = bucket.state.load(std::memory_order_relaxed);
+
+    while(true) {
+        uint64_t tokens, last;
+        refill(state, now, tokens, last);
+        if(tokens < TOKEN) {
+            Metrics::count(Metrics::ADMISSION_DROP);
+            return false;
+        }
+        if( bucket.state.compare_exchange_weak(state, last << 24 | (tokens - TOKEN), std::memory_order_relaxed) ) {
+            return true;
+        }
+    }
+}
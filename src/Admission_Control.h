@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+/* Per source MAC token buckets deciding which frames are worth validating, so a single flooding supplicant
+ * cannot monopolise the authenticator.
+ *
+ * The buckets live in a fixed table allocated by configure(), a source claims a slot near its hash and keeps
+ * it while active. Each bucket is one 64 bit word, 40 bits of refill time in microseconds and 24 bits of
+ * tokens in 1/256 frames, updated with compare and swap, so every thread can admit frames without locks.
+ * Sources that find no free slot share the bucket of their home slot. */
+class AdmissionControl {
+public:
+    static constexpr int MAX_BURST = 65535;
+
+    /* Allows rate frames per second and bursts of burst frames per source, tracking up to sources sources
+     * (rounded up to a power of two). A rate of 0 admits everything. Call before any frame is received. */
+    static void configure(double rate, int burst, size_t sources);
+    static bool enabled();
+
+    /* Takes a token from the bucket of the frame's source MAC, false if the source is over its budget */
+    static bool admit(const uint8_t *frame, size_t len);
+};
@@ -1,52 +1,106 @@
 #include "Authentication_Server.h"
+#include "Supplicant_Database.h"
+#include "Csv_Loader.h"
+#include "Metrics.h"
+#include "Shared_Store.h"
 
 #include <vector>
 #include <sstream>
 #include <fstream>
 #include <iostream>
-#include <map>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
 
-
-constexpr char DELIM = ';';
+#include <sys/stat.h>
 
 
-/* --------------------------------------------- SupplicantEntry Implementation -----------------------------------*/
+constexpr char DELIM = ';';
+constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+constexpr int SHARED_SNAPSHOT_MS = 1000;    // Snapshot and owner check interval of shared stores
 
-SupplicantEntry::SupplicantEntry(std::string csv_row) {
-    std::istringstream iss(csv_row);
-    std::vector<std::string> values;
-    std::string to_insert;
-    char delim_void = '\0';
-    int idx = 0;
 
-    // Split into separate strings
-    while( std::getline(iss, to_insert, DELIM) ) {
-        values.push_back(to_insert);
-    }
+static std::string format_row(int ctr, const uint8_t *base_mac, const std::string& point, const uint8_t *hashed_mac) {
+    std::ostringstream oss;
 
     // Counter
-    ctr = std::stoi(values.at(idx++));
+    oss << ctr << DELIM;
 
     // Base MAC
-    std::istringstream base_mac_stream(values.at(idx++));
-    for(auto i=0; i<sizeof(base_mac.bytes); ++i) {
-        int test;
-        base_mac_stream >> std::hex >> test;
-        base_mac_stream >> delim_void;
-        base_mac.bytes[i] = static_cast<uint8_t>(test);
+    for(auto i=0; i<6; ++i) {
+        char delim = (i==5) ? DELIM : ':'; 
+        oss << std::hex << static_cast<int>(base_mac[i]);
+        oss << delim;
     }
 
     // A
-    A.from_base64( reinterpret_cast<const uint8_t*>( values.at(idx++).c_str() ) );
+    oss << point << DELIM;
 
     // Hashed MAC
-    std::istringstream hashed_mac_stream(values.at(idx++));
-    for(auto i=0; i<sizeof(hashed_mac.bytes); ++i) {
-        int test;
-        hashed_mac_stream >> std::hex >> test;
-        hashed_mac_stream >> delim_void;
-        hashed_mac.bytes[i] = static_cast<uint8_t>(test);
+    for(auto i=0; i<6; ++i) {
+        char delim = (i==5) ? DELIM : ':'; 
+        oss << std::hex << static_cast<int>(hashed_mac[i]);
+        oss << delim;
+    }
+
+    oss << std::endl;
+    return oss.str();
+}
+
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    auto *p = static_cast<const uint8_t*>(data);
+    for(size_t i=0; i<len; ++i) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+
+// Identifies a row independent of its counter, which changes on every authentication
+static uint64_t fingerprint(const CompactEntry& entry) {
+    uint64_t retval = fnv1a(FNV_OFFSET, entry.base_mac, sizeof(entry.base_mac));
+    retval = fnv1a(retval, entry.hashed_mac, sizeof(entry.hashed_mac));
+    return fnv1a(retval, entry.point, entry.point_len);
+}
+
+
+// Continues hash over the bytes [begin, end) of path, false if the file is shorter
+static bool hash_file(const std::string& path, size_t begin, size_t end, uint64_t& hash) {
+    std::ifstream ifs(path, std::ios::binary);
+    std::vector<char> buf(1 << 16);
+
+    ifs.seekg(begin);
+    while(begin < end) {
+        size_t n = std::min(buf.size(), end - begin);
+        if( !ifs.read(buf.data(), n) ) return false;
+        hash = fnv1a(hash, buf.data(), n);
+        begin += n;
+    }
+    return true;
+}
+
+
+std::string CompactEntry::to_string() const {
+    return format_row(ctr, base_mac, std::string(point, point_len), hashed_mac);
+}
+
+
+/* --------------------------------------------- SupplicantEntry Implementation -----------------------------------*/
+
+SupplicantEntry::SupplicantEntry(std::string csv_row) {
+    CompactEntry entry;
+
+    if( !parse_csv_row(csv_row.data(), csv_row.data() + csv_row.size(), entry) ) {
+        throw std::invalid_argument("Malformed row");
     }
+
+    ctr = entry.ctr;
+    memcpy(base_mac.bytes, entry.base_mac, sizeof(entry.base_mac));
+    A.from_base64( reinterpret_cast<const uint8_t*>(entry.point) );
+    memcpy(hashed_mac.bytes, entry.hashed_mac, sizeof(entry.hashed_mac));
 }
 
 
@@ -59,30 +113,30 @@ SupplicantEntry::SupplicantEntry(int ctr_, const puf::MAC& base_mac_, const puf:
 
 
 std::string SupplicantEntry::to_string() const {
-    std::ostringstream oss;
+    return format_row(ctr, base_mac.bytes, A.base64(), hashed_mac.bytes);
+}
 
-    // Counter
-    oss << ctr << DELIM;
 
-    // Base MAC
-    for(auto i=0; i<sizeof(base_mac.bytes); ++i) {
-        char delim = (i==sizeof(base_mac.bytes)-1) ? DELIM : ':'; 
-        oss << std::hex << static_cast<int>(base_mac.bytes[i]);
-        oss << delim;
+// Zeroed first, the entry is written to files and sockets as a whole including padding and unused point bytes
+static CompactEntry make_compact(int ctr, const uint8_t *base_mac, const uint8_t *hashed_mac, const puf::ECP_Point& A) {
+    CompactEntry retval{};
+    std::string point = A.base64();
+
+    if(point.size() >= POINT_CAPACITY) {
+        throw std::length_error("Point does not fit into a compact entry");
     }
 
-    // A
-    oss << A.base64() << DELIM;
+    retval.ctr = ctr;
+    memcpy(retval.base_mac, base_mac, sizeof(retval.base_mac));
+    memcpy(retval.hashed_mac, hashed_mac, sizeof(retval.hashed_mac));
+    retval.point_len = static_cast<uint8_t>(point.size());
+    memcpy(retval.point, point.c_str(), point.size()+1);
+    return retval;
+}
 
-    // Hashed MAC
-    for(auto i=0; i<sizeof(hashed_mac.bytes); ++i) {
-        char delim = (i==sizeof(hashed_mac.bytes)-1) ? DELIM : ':'; 
-        oss << std::hex << static_cast<int>(hashed_mac.bytes[i]);
-        oss << delim;
-    }
 
-    oss << std::endl;
-    return oss.str();
+CompactEntry SupplicantEntry::compact() const {
+    return make_compact(ctr, base_mac.bytes, hashed_mac.bytes, A);
 }
 
 
@@ -97,51 +151,798 @@ void SupplicantEntry::hash_mac() {
 
 
 
+/* ----------------------------------- FlatSupplicantMap Implementation -----------------------------------*/
+
+FlatSupplicantMap::FlatSupplicantMap() : count(0), mask(0) {}
+
+
+size_t FlatSupplicantMap::home_of(uint64_t key) const {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key & mask;
+}
+
+
+void FlatSupplicantMap::rehash(size_t capacity) {
+    std::vector<uint64_t> old_keys(capacity, EMPTY);
+    std::vector<CompactEntry> old_values(capacity);
+
+    old_keys.swap(keys);
+    old_values.swap(values);
+    mask = capacity - 1;
+    count = 0;
+
+    for(size_t i=0; i<old_keys.size(); ++i) {
+        if(old_keys[i] != EMPTY) insert(old_keys[i], old_values[i]);
+    }
+}
+
+
+void FlatSupplicantMap::reserve(size_t n) {
+    // Keep the load factor at or below 3/4
+    size_t capacity = 16;
+    while(capacity * 3 < n * 4) capacity <<= 1;
+    if(capacity > keys.size()) rehash(capacity);
+}
+
+
+CompactEntry* FlatSupplicantMap::find(uint64_t key) {
+    if(count == 0 || key == EMPTY) return nullptr;
+
+    for(size_t i=home_of(key); keys[i] != EMPTY; i = (i+1) & mask) {
+        if(keys[i] == key) return &values[i];
+    }
+    return nullptr;
+}
+
+
+bool FlatSupplicantMap::insert(uint64_t key, const CompactEntry& value) {
+    if(key == EMPTY) {
+        throw std::invalid_argument("Invalid hashed MAC");
+    }
+    if( (count+1) * 4 > keys.size() * 3 ) {
+        rehash( keys.empty() ? 16 : keys.size() * 2 );
+    }
+
+    size_t i = home_of(key);
+    for(; keys[i] != EMPTY; i = (i+1) & mask) {
+        if(keys[i] == key) return false;
+    }
+
+    keys[i] = key;
+    values[i] = value;
+    count++;
+    return true;
+}
+
+
+void FlatSupplicantMap::erase(uint64_t key) {
+    if(count == 0 || key == EMPTY) return;
+
+    size_t i = home_of(key);
+    for(; keys[i] != key; i = (i+1) & mask) {
+        if(keys[i] == EMPTY) return;
+    }
+
+    /* Backward shift deletion: move following entries of the cluster into the hole
+     * if their home slot is not between the hole and their current position. */
+    size_t hole = i;
+    for(size_t j = (i+1) & mask; keys[j] != EMPTY; j = (j+1) & mask) {
+        size_t home = home_of(keys[j]);
+        bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+        if(!stays) {
+            keys[hole] = keys[j];
+            values[hole] = values[j];
+            hole = j;
+        }
+    }
+
+    keys[hole] = EMPTY;
+    count--;
+}
+
+
+
+/* ------------------------------------- SupplicantTable Implementation -----------------------------------*/
+
+size_t SupplicantTable::shard_index(uint64_t key) {
+    // Hashed MACs are well distributed, mix anyway so the shard does not depend on a few bits only
+    key ^= key >> 29;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 32;
+    return key % SHARD_COUNT;
+}
+
+
+SupplicantTable::Shard& SupplicantTable::shard_of(uint64_t key) {
+    return shards[shard_index(key)];
+}
+
+
+void SupplicantTable::reserve(size_t n) {
+    for(auto &shard : shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.entries.reserve( n / SHARD_COUNT + 1 );
+    }
+}
+
+
+bool SupplicantTable::insert(const SupplicantEntry& entry) {
+    return insert( entry.hashed_mac.to_u64(), entry.compact() );
+}
+
+
+bool SupplicantTable::insert(uint64_t key, const CompactEntry& compact) {
+    auto &shard = shard_of(key);
+    bool full;
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if( !shard.entries.insert(key, compact) ) {
+            return false;
+        }
+        full = filter_add(key);
+
+        if(shard.tracking) shard.changes[key] = Change{false, true, 0, compact};
+        if(journal) journal->insert( compact.to_string() );
+    }
+
+    // Growing takes all shard locks
+    if(full) grow_filter();
+    return true;
+}
+
+
+int SupplicantTable::take(uint64_t key, int units, CompactEntry& result) {
+    const BloomFilter *current = filter.load(std::memory_order_acquire);
+    if( current && !current->may_contain(key) ) {
+        Metrics::count(Metrics::FILTER_REJECT);
+        return -1;
+    }
+
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    auto *entry = shard.entries.find(key);
+    if(!entry) {
+        return -1;
+    }
+
+    int taken = 0;
+    if(entry->ctr == 0) {
+        shard.entries.erase(key);
+        if(shard.tracking) shard.changes[key] = Change{true};
+        if(journal) journal->erase(key);
+        result.point_len = 0;
+    } else {
+        taken = std::min(units, entry->ctr);
+        if(taken > 0) {
+            entry->ctr -= taken;
+            if(shard.tracking) {
+                auto &change = shard.changes[key];
+                if(change.absolute) change.entry.ctr = entry->ctr; else change.decrements += taken;
+            }
+            if(journal) journal->counter(key, entry->ctr);
+        }
+
+        result = *entry;
+    }
+    return taken;
+}
+
+
+void SupplicantTable::set_counter(uint64_t key, int ctr) {
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if( auto *entry = shard.entries.find(key) ) {
+        entry->ctr = ctr;
+        if(shard.tracking) shard.changes[key] = Change{false, true, 0, *entry};
+        if(journal) journal->counter(key, ctr);
+    }
+}
+
+
+void SupplicantTable::erase(uint64_t key) {
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.entries.erase(key);
+    if(shard.tracking) shard.changes[key] = Change{true};
+    if(journal) journal->erase(key);
+}
+
+
+bool SupplicantTable::contains(uint64_t key) {
+    const BloomFilter *current = filter.load(std::memory_order_acquire);
+    if( current && !current->may_contain(key) ) return false;
+
+    auto &shard = shard_of(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.entries.find(key) != nullptr;
+}
+
+
+size_t SupplicantTable::size() {
+    size_t retval = 0;
+    for(auto &shard : shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        retval += shard.entries.size();
+    }
+    return retval;
+}
+
+
+void SupplicantTable::clone_into(SupplicantTable& other) {
+    for(size_t i=0; i<SHARD_COUNT; ++i) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        std::lock_guard<std::mutex> other_guard(other.shards[i].lock);
+        other.shards[i].entries = shards[i].entries;
+        shards[i].tracking = true;
+        shards[i].changes.clear();
+    }
+    other.build_filter();
+}
+
+
+void SupplicantTable::carry_over(SupplicantTable& other, const std::unordered_set<uint64_t>& skip, bool stop) {
+    bool full = false;
+
+    for(size_t i=0; i<SHARD_COUNT; ++i) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        std::lock_guard<std::mutex> other_guard(other.shards[i].lock);
+        auto &target = other.shards[i].entries;
+
+        for(const auto &[key, change] : shards[i].changes) {
+            if(skip.count(key)) continue;
+
+            if(change.erased) {
+                target.erase(key);
+            } else if(change.absolute) {
+                target.erase(key);
+                target.insert(key, change.entry);
+                full |= other.filter_add(key);
+            } else if( auto *entry = target.find(key) ) {
+                entry->ctr = std::max(0, entry->ctr - change.decrements);
+            }
+        }
+        shards[i].changes.clear();
+        shards[i].tracking = !stop;
+    }
+    if(full) other.grow_filter();
+}
+
+
+bool SupplicantTable::filter_add(uint64_t key) {
+    BloomFilter *current = filter.load(std::memory_order_acquire);
+    if(!current) return false;
+
+    current->add(key);
+    return filtered.fetch_add(1) + 1 > current->capacity();
+}
+
+
+void SupplicantTable::build_filter() {
+    std::lock_guard<std::mutex> guard(filter_lock);
+    rebuild_filter();
+}
+
+
+void SupplicantTable::grow_filter() {
+    std::lock_guard<std::mutex> guard(filter_lock);
+    BloomFilter *current = filter.load();
+    if( current && filtered.load() > current->capacity() ) rebuild_filter();
+}
+
+
+void SupplicantTable::rebuild_filter() {
+    std::vector<std::unique_lock<std::mutex>> guards;
+    size_t count = 0;
+    for(auto &shard : shards) {
+        guards.emplace_back(shard.lock);
+        count += shard.entries.size();
+    }
+
+    // Room to double before the next rebuild, which also drops the keys erased meanwhile
+    auto next = std::make_unique<BloomFilter>( std::max<size_t>(2 * count, 1024) );
+    for(auto &shard : shards) {
+        shard.entries.for_each([&next](uint64_t key, const CompactEntry&) { next->add(key); });
+    }
+    filtered = count;
+    filter.store(next.get(), std::memory_order_release);
+    filters.push_back( std::move(next) );
+}
+
+
+
+/* --------------------------------------- SessionCache Implementation -----------------------------------*/
+
+void SessionCache::resize(size_t capacity) {
+    // Rounded up, so a small capacity still caches something in every shard
+    size_t per_shard = (capacity + SHARD_COUNT - 1) / SHARD_COUNT;
+    for(auto &shard : shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.cache.resize(per_shard);
+    }
+    enabled.store(capacity > 0, std::memory_order_relaxed);
+}
+
+
+void SessionCache::decode(uint64_t key, const CompactEntry& entry, puf::ECP_Point& ecp) {
+    if( !enabled.load(std::memory_order_relaxed) ) {
+        ecp.from_base64( reinterpret_cast<const uint8_t*>(entry.point) );
+        return;
+    }
+
+    Shard &shard = shard_of(key);
+    std::shared_ptr<const puf::ECP_Point> cached;
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Session *session = shard.cache.find(key, [&entry](const Session& session) {
+            return session.point_len == entry.point_len && memcmp(session.point, entry.point, entry.point_len) == 0;
+        });
+        if(session) cached = session->ecp;
+    }
+    if(cached) {
+        ecp = *cached;
+        return;
+    }
+
+    // Decoded outside the lock, a concurrent miss on the same key only decodes twice
+    auto decoded = std::make_shared<puf::ECP_Point>();
+    decoded->from_base64( reinterpret_cast<const uint8_t*>(entry.point) );
+    ecp = *decoded;
+
+    Session session;
+    session.point_len = entry.point_len;
+    memcpy(session.point, entry.point, sizeof(session.point));
+    session.ecp = std::move(decoded);
+
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.cache.insert(key, session);
+}
+
+
+
 /* ------------------------------- AuthenticationServerImpl Implementation -----------------------------------*/
 
-AuthenticationServerImpl::AuthenticationServerImpl(std::string url_, bool save_on_edit) : 
+AuthenticationServerImpl::AuthenticationServerImpl(std::string url_, bool save_on_edit, const JournalOptions& journal_options_, bool watch) : 
     url(url_), 
-    save_on_edit_(save_on_edit) {}
+    save_on_edit_(save_on_edit),
+    watch_(watch),
+    fetched(false),
+    binary(false),
+    journal_options(journal_options_),
+    persisting(false),
+    file_size(0),
+    file_hash(FNV_OFFSET),
+    file_ino(0),
+    file_mtime_ns(0) {}
+
+
+AuthenticationServerImpl::~AuthenticationServerImpl() {
+    // The watcher and the persister call back into this object, stop them before anything else goes away
+    if(watcher) watcher->stop();
+    if(persister.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(persist_lock);
+            persisting = false;
+        }
+        persist_wakeup.notify_all();
+        persister.join();
+    }
+
+    // The journal only holds the changes of this process, the snapshot those of all processes sharing the store
+    if(shared && journal) journal->compact_now();
+}
+
+
+void AuthenticationServerImpl::apply_record(const std::string& record) {
+    if(record.size() < 2) {
+        throw std::invalid_argument("Empty journal record");
+    }
+
+    auto table = entries.read();
+    switch(record[0]) {
+        case 'C': {
+            size_t pos;
+            uint64_t key = std::stoull(record.substr(2), &pos, 16);
+            int ctr = std::stoi(record.substr(2+pos));
+            if(shared) shared->set_counter(key, ctr); else table->set_counter(key, ctr);
+            break;
+        }
+        case 'E': {
+            uint64_t key = std::stoull(record.substr(2), nullptr, 16);
+            if(shared) shared->erase(key); else table->erase(key);
+            break;
+        }
+        case 'I': {
+            SupplicantEntry entry(record.substr(2));
+            if(shared) shared->insert(entry.hashed_mac.to_u64(), entry.compact()); else table->insert(entry);
+            break;
+        }
+
+        default:
+            throw std::invalid_argument("Unknown journal record");
+    }
+}
 
 
 void AuthenticationServerImpl::fetch() {
-    std::ifstream ifs;
-    std::string csv_row;
-    bool failed = false;
+    std::lock_guard<std::mutex> guard(fetch_lock);
 
-    // Raise exception on error
-    ifs.exceptions(std::ifstream::failbit);
+    // Several authenticators may share this server, only the first one loads the file
+    if(fetched) return;
+    fetched = true;
 
-    try {
-        ifs.open(url);
-        while( !ifs.eof() && std::getline(ifs, csv_row) )  {    // ToDo: Do not raise exception when EOF
+    if( !shared_name.empty() ) {
+        fetch_shared();
+        return;
+    }
+
+    {
+        // Watch before loading, so changes made while loading are picked up by the first reload
+        std::lock_guard<std::mutex> reload_guard(reload_lock);
+        if(watch_) {
+            watcher = std::make_unique<ResourceWatcher>(url, [this]() { reload(); });
             try {
-                SupplicantEntry to_insert(csv_row);
-                entries.insert( std::make_pair(to_insert.hashed_mac.to_u64(), to_insert) );
-            } catch(...) {
-                std::cerr << "Error loading entry: " << csv_row << '\n';
+                watcher->start();
+            } catch(const std::runtime_error &e) {
+                std::cerr << e.what() << '\n';
+                watcher.reset();
             }
         }
-    } catch(const std::ios_base::failure &e) {
+
+        binary = SupplicantDatabase::is_database(url);
+        if(binary) {
+            fetch_database(watcher != nullptr);
+        } else {
+            std::vector<DatabaseRecord> records;
+            fetch_csv(watcher ? &records : nullptr);
+            if(watcher) remember_file(records.data(), records.data() + records.size());
+        }
+    }
+
+    // Edits go to the journal instead of rewriting the whole file on every authentication
+    if(save_on_edit_) {
+        start_journal([this](const std::string& record) { apply_record(record); });
+        entries.read()->set_journal(journal.get());
+    }
+    entries.read()->build_filter();
+}
+
+
+void AuthenticationServerImpl::start_journal(const SupplicantJournal::Apply& apply) {
+    journal = std::make_unique<SupplicantJournal>(url, journal_options, [this](std::ostream& os) {
+        // The snapshot replaces the resource file, edits not applied yet must not get lost
+        if(watcher) reload_file();
+        write_snapshot(os, binary);
+        return !watcher || !file_changed();
+    });
+    journal->start(apply);
+}
+
+
+void AuthenticationServerImpl::fetch_shared() {
+    shared = std::make_unique<SharedSupplicantStore>(shared_name);
+    binary = SupplicantDatabase::is_database(url);
+    if(save_on_edit_) {
+        persisting = true;
+        persister = std::thread(&AuthenticationServerImpl::persist_shared, this);
+    }
+    if( !shared->owner() ) return;
+
+    bool fresh = !shared->ready();
+    if(fresh) {
+        // The segment keeps the entries encoded, so the rows go in without going through the table
+        std::vector<DatabaseRecord> records;
+        SupplicantDatabase db;
+        const DatabaseRecord *begin = nullptr, *end = nullptr;
+        if(binary) {
+            try {
+                db.open(url);
+                begin = db.begin();
+                end = db.end();
+            } catch(const std::runtime_error &e) {
+                std::cerr << e.what() << '\n';
+            }
+        } else {
+            read_csv(url, 0, records);
+            begin = records.data();
+            end = records.data() + records.size();
+        }
+        shared->create(end - begin);
+        for(auto *record = begin; record != end; ++record) shared->insert(record->key, record->entry);
+    }
+
+    if(save_on_edit_) own_shared(fresh);
+    shared->publish();
+}
+
+
+void AuthenticationServerImpl::own_shared(bool replay) {
+    std::lock_guard<std::mutex> guard(persist_lock);
+
+    /* A segment taken over is newer than the journal of its previous owner, which does not hold the changes
+     * of the other processes. Replaying it could raise counters again, a snapshot right away replaces it. */
+    if(replay) {
+        start_journal([this](const std::string& record) { apply_record(record); });
+    } else {
+        start_journal([](const std::string&) {});
+    }
+    shared->set_journal(journal.get());
+    if(!replay) {
+        shared->take_dirty();
+        journal->compact_now();
+    }
+}
+
+
+void AuthenticationServerImpl::persist_shared() {
+    std::unique_lock<std::mutex> lk(persist_lock);
+
+    while(true) {
+        persist_wakeup.wait_for(lk, std::chrono::milliseconds(SHARED_SNAPSHOT_MS), [this]() { return !persisting; });
+        if(!persisting) return;
+
+        if( !shared->owner() ) {
+            if( shared->take_over() ) {
+                lk.unlock();
+                own_shared(false);
+                lk.lock();
+            }
+            continue;
+        }
+        if( journal && shared->take_dirty() ) journal->compact_now();
+    }
+}
+
+
+void AuthenticationServerImpl::fetch_csv(std::vector<DatabaseRecord> *records) {
+    load_csv(url, *entries.read(), 0, records);
+}
+
+
+void AuthenticationServerImpl::fetch_database(bool remember) {
+    SupplicantDatabase db;
+
+    try {
+        db.open(url);
+    } catch(const std::runtime_error &e) {
         std::cerr << e.what() << '\n';
-        failed = true;
+        return;
+    }
+
+    // Records are already in table format, no parsing or decoding needed
+    auto table = entries.read();
+    table->reserve(db.size());
+    for(const auto &record : db) {
+        table->insert(record.key, record.entry);
+    }
+    if(remember) remember_file(db.begin(), db.end());
+}
+
+
+void AuthenticationServerImpl::remember_file(const DatabaseRecord *begin, const DatabaseRecord *end) {
+    struct stat st;
+
+    file_rows.clear();
+    file_rows.reserve(end - begin);
+    for(auto *record = begin; record != end; ++record) {
+        file_rows.emplace( record->key, fingerprint(record->entry) );
     }
 
-    if(ifs.is_open()) ifs.close();
+    file_hash = FNV_OFFSET;
+    if( stat(url.c_str(), &st) < 0 ) return;
+    file_size = st.st_size;
+    file_ino = st.st_ino;
+    file_mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    if( !hash_file(url, 0, file_size, file_hash) ) file_size = 0;
 }
 
 
+bool AuthenticationServerImpl::file_changed() {
+    std::lock_guard<std::mutex> guard(reload_lock);
+    struct stat st;
 
-void AuthenticationServerImpl::sync() {
+    if( stat(url.c_str(), &st) < 0 ) return false;
+    if( st.st_ino == file_ino && static_cast<size_t>(st.st_size) == file_size &&
+        st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec == file_mtime_ns ) return false;
+
+    std::cerr << "Resource file changed while writing a snapshot, compaction postponed" << '\n';
+    return true;
+}
+
+
+void AuthenticationServerImpl::reload() {
+    if(shared) {
+        std::cerr << "Reloading is not supported with a shared store" << std::endl;
+        return;
+    }
+
+    // Compacting waits for the journal thread, which reloads itself before a snapshot, so not under reload_lock
+    if( reload_file() && journal ) journal->compact_now();
+}
+
+
+bool AuthenticationServerImpl::reload_file() {
+    std::lock_guard<std::mutex> guard(reload_lock);
+    std::vector<DatabaseRecord> records;    // Rows of a CSV file, a database is diffed in place
+    SupplicantDatabase db;
+    const DatabaseRecord *begin, *end;
+    struct stat st;
+    bool append = false;
+    size_t size;
+    uint64_t hash = FNV_OFFSET;
+
+    // The file is missing for a moment while some editors replace it, the next event brings it back
+    if( stat(url.c_str(), &st) < 0 ) return false;
+
+    if( SupplicantDatabase::is_database(url) != binary ) {
+        std::cerr << "Resource file changed its format, not reloading" << '\n';
+        return false;
+    }
+
+    if(binary) {
+        try {
+            db.open(url);
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            return false;
+        }
+        begin = db.begin();
+        end = db.end();
+        size = st.st_size;
+    } else {
+        // Provisioning usually appends rows, then only the new tail has to be parsed
+        uint64_t prefix = FNV_OFFSET;
+        append = static_cast<size_t>(st.st_size) > file_size && hash_file(url, 0, file_size, prefix) && prefix == file_hash;
+        if(append) hash = file_hash;
+
+        size = read_csv(url, append ? file_size : 0, records);
+        if(size == 0 && st.st_size > 0) return false;
+        if( !hash_file(url, append ? file_size : 0, size, hash) ) return false;   // Changed again, the next event follows
+        begin = records.data();
+        end = records.data() + records.size();
+    }
+
+    /* Find what changed compared to the file as loaded before. Rows the table already agrees with
+     * are left out, e.g. entries stored by an authenticator or erased once their counter ran out. */
+    std::unordered_map<uint64_t, uint64_t> rows;
+    std::vector<const DatabaseRecord*> added, changed;
+    std::vector<uint64_t> removed;
+
+    auto present = [this](uint64_t key) { return entries.read()->contains(key); };
+
+    rows.reserve(end - begin);
+    for(auto *record = begin; record != end; ++record) {
+        if(append && file_rows.count(record->key)) continue;
+
+        // Later duplicates are ignored, just like on a full load
+        uint64_t row = fingerprint(record->entry);
+        if( !rows.emplace(record->key, row).second ) continue;
+
+        auto old = file_rows.find(record->key);
+        if(old == file_rows.end()) {
+            if( !present(record->key) ) added.push_back(record);
+        } else if(old->second != row) {
+            changed.push_back(record);
+        }
+    }
+    if(!append) {
+        for(const auto &[key, row] : file_rows) {
+            if( !rows.count(key) && present(key) ) removed.push_back(key);
+        }
+    }
+
+    if(append) {
+        file_rows.insert(rows.begin(), rows.end());
+    } else {
+        file_rows.swap(rows);
+    }
+    file_size = size;
+    file_hash = hash;
+    file_ino = st.st_ino;
+    file_mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+    if( added.empty() && changed.empty() && removed.empty() ) return false;
+
+    // Build the new table off to the side, queries keep using the current one meanwhile
+    auto next = std::make_unique<SupplicantTable>();
+    SupplicantTable *next_table = next.get();
+    std::unordered_set<uint64_t> touched;
+
+    entries.read()->clone_into(*next_table);
+    for(const auto *record : added) {
+        // Entries stored by an authenticator are already there with their current counter
+        if( next_table->insert(record->key, record->entry) ) touched.insert(record->key);
+    }
+    for(const auto *record : changed) {
+        next_table->erase(record->key);
+        next_table->insert(record->key, record->entry);
+        touched.insert(record->key);
+    }
+    for(uint64_t key : removed) {
+        next_table->erase(key);
+        touched.insert(key);
+    }
+    next_table->set_journal(journal.get());
+
+    /* Carry over the authentications done while building, publish, then carry over the few that
+     * were still running on the old table. Rows touched by the file take the values of the file. */
+    entries.read()->carry_over(*next_table, touched, false);
+    auto old = entries.exchange( std::move(next) );
+    old->carry_over(*next_table, touched, true);
+
+    std::cout << "Reloaded " << url << ": " << added.size() << " added, " << changed.size() << " changed, "
+              << removed.size() << " removed" << std::endl;
+
+    // Journaled counters of changed rows belong to the old rows, a fresh snapshot makes them obsolete
+    return !changed.empty() || !removed.empty();
+}
+
+
+void AuthenticationServerImpl::write_snapshot(std::ostream& os, bool as_database) {
+    auto table = entries.read();
+    auto for_each = [this, &table](auto fn) {
+        if(shared) shared->for_each(fn); else table->for_each(fn);
+    };
+
+    if(as_database) {
+        std::vector<DatabaseRecord> records;
+        records.reserve( shared ? shared->size() : table->size() );
+        for_each([&records](uint64_t key, const CompactEntry& entry) {
+            DatabaseRecord record{};
+            record.key = key;
+            record.entry = entry;
+            records.push_back(record);
+        });
+        SupplicantDatabase::write(os, records);
+    } else {
+        for_each([&os](uint64_t, const CompactEntry& entry) {
+            os << entry.to_string();
+        });
+    }
+}
+
+
+void AuthenticationServerImpl::export_to(const std::string& path) {
+    bool as_database = path.size() > 3 && path.compare(path.size()-3, 3, ".db") == 0;
     std::ofstream ofs;
-    bool failed = false;
 
     ofs.exceptions(std::ofstream::failbit);
     try {
-        ofs.open(url);
-        for(const auto& [key, entry] : entries) {
-            ofs << entry.to_string();
+        ofs.open(path, std::ios::binary | std::ios::trunc);
+        write_snapshot(ofs, as_database);
+    } catch(const std::ios_base::failure &e) {
+        std::cerr << "Error exporting entries: " << e.what() << '\n';
+    }
+
+    if(ofs.is_open()) ofs.close();
+}
+
+
+void AuthenticationServerImpl::sync() {
+    StageTimer timer(Metrics::SYNC);
+
+    if(shared) {
+        // The owner of a shared store is its only writer
+        std::lock_guard<std::mutex> guard(persist_lock);
+        if(!shared->owner()) return;
+        if(journal) {
+            journal->compact_now();
+            return;
         }
+    } else if(journal) {
+        journal->compact_now();
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(file_lock);
+    std::ofstream ofs;
+
+    ofs.exceptions(std::ofstream::failbit);
+    try {
+        ofs.open(url, std::ios::binary | std::ios::trunc);
+        write_snapshot(ofs, binary);
     } catch(const std::ios_base::failure &e) {
         std::cerr << "Error saving entries: " << e.what() << '\n';
     }
@@ -152,30 +953,44 @@ void AuthenticationServerImpl::sync() {
 
 void AuthenticationServerImpl::store(const puf::MAC& base_mac, const puf::ECP_Point& A, puf::MAC& hashed_mac, int ctr) 
 {
-    if( !entries.count(hashed_mac.to_u64()) ) {
-        entries.insert( std::make_pair(hashed_mac.to_u64(), SupplicantEntry(ctr, base_mac, hashed_mac, A)) );
+    SupplicantEntry entry(ctr, base_mac, hashed_mac, A);
+    bool inserted = shared ? shared->insert(entry.hashed_mac.to_u64(), entry.compact()) : entries.read()->insert(entry);
+
+    if(inserted) {
         std::cout << "Inserted new mac" << std::endl;
-        if(save_on_edit_) sync();
+        // Shared stores are persisted by the journal and the snapshots of their owner
+        if(save_on_edit_ && !shared && !journal) sync();
     }
 }
 
 
 puf::QueryResult AuthenticationServerImpl::query(const puf::MAC& hashed_mac, bool decrease_counter) {
+    int granted;
+    return take(hashed_mac, decrease_counter ? 1 : 0, granted);
+}
+
+
+puf::QueryResult AuthenticationServerImpl::take(const puf::MAC& hashed_mac, int units, int& granted) {
+    StageTimer timer(Metrics::QUERY);
     puf::QueryResult retval;
     retval.valid = false;
 
-    if( auto it=entries.find(hashed_mac.to_u64()); it != entries.end() ) {
-        auto &entry = it->second;
-        if(entry.ctr == 0) {
-            entries.erase(hashed_mac.to_u64());
-        } else {
-            if(decrease_counter) entry.decrease_counter();
-            retval.ecp = entry.A;
-            retval.mac = entry.base_mac;
-            retval.valid = true;
-        } 
-        if(save_on_edit_) sync();
+    uint64_t key = hashed_mac.to_u64();
+    CompactEntry entry;
+    granted = shared ? shared->take(key, units, entry) : entries.read()->take(key, units, entry);
+
+    // One write for all units taken
+    if(granted >= 0) {
+        if(save_on_edit_ && !shared && !journal) sync();
+    }
+
+    // Decoded only now, the table and the shared store hand out a copy of the encoded entry
+    if(granted >= 0 && entry.point_len > 0) {
+        sessions.decode(key, entry, retval.ecp);
+        memcpy(retval.mac.bytes, entry.base_mac, sizeof(entry.base_mac));
+        retval.valid = true;
     }
 
+    granted = std::max(granted, 0);
     return retval;
 }
\ No newline at end of file
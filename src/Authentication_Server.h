@@ -1,8 +1,40 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 #include "authenticator.h"
+#include "Supplicant_Journal.h"
+#include "Rcu_Pointer.h"
+#include "Resource_Watcher.h"
+#include "Bloom_Filter.h"
+#include "Clock_Cache.h"
+
+
+/* Base64 encoded point including its terminator, enough for uncompressed points of curves up to 384 bit */
+constexpr size_t POINT_CAPACITY = 136;
+
+
+/* Fixed size form of a SupplicantEntry as stored in the supplicant table, files, shared memory and on the wire.
+ * The point stays encoded, queries decode it outside of any lock. */
+struct CompactEntry {
+    int32_t ctr;
+    uint8_t base_mac[6];
+    uint8_t hashed_mac[6];
+    uint8_t point_len;
+    char point[POINT_CAPACITY];
+
+    std::string to_string() const;
+};
+
 
 class SupplicantEntry {
 private:
@@ -16,18 +48,220 @@ public:
     std::string to_string() const;
     void decrease_counter();
     void hash_mac();
+    CompactEntry compact() const;
     friend class AuthenticationServerImpl;
+    friend class SupplicantTable;
+};
+
+
+/* Open addressing hash map with linear probing keyed by the hashed MAC. Keys and entries live in separate
+ * arrays, so a probe sequence only touches the key array and only a hit reads the entry. */
+class FlatSupplicantMap {
+private:
+    static constexpr uint64_t EMPTY = 0;    // The all zero MAC is never a valid supplicant
+
+    std::vector<uint64_t> keys;
+    std::vector<CompactEntry> values;
+    size_t count;
+    size_t mask;
+
+    size_t home_of(uint64_t key) const;
+    void rehash(size_t capacity);
+
+public:
+    FlatSupplicantMap();
+    void reserve(size_t n);
+    CompactEntry* find(uint64_t key);
+    bool insert(uint64_t key, const CompactEntry& value);      // False if already present
+    void erase(uint64_t key);
+    size_t size() const { return count; }
+
+    template<typename F> void for_each(F fn) const {
+        for(size_t i=0; i<keys.size(); ++i) {
+            if(keys[i] != EMPTY) fn(keys[i], values[i]);
+        }
+    }
+};
+
+
+/* Supplicant entries split into independently locked shards, so concurrent queries
+ * for different supplicants rarely contend. All counter updates happen under the shard lock.
+ * A Bloom filter in front of the shards turns away unknown MACs without locking or probing a shard. */
+class SupplicantTable {
+public:
+    static constexpr size_t SHARD_COUNT = 64;
+
+private:
+    /* Net effect of the changes made to one entry while a replacement table is being built */
+    struct Change {
+        bool erased = false;
+        bool absolute = false;  // entry holds the new value, otherwise only the decrements apply
+        int decrements = 0;
+        CompactEntry entry;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex lock;
+        FlatSupplicantMap entries;
+        bool tracking = false;
+        std::unordered_map<uint64_t, Change> changes;
+    };
+
+    std::array<Shard, SHARD_COUNT> shards;
+    SupplicantJournal *journal = nullptr;   // Records every change made while the shard lock is held
+    Shard& shard_of(uint64_t key);
+
+    /* Keys are added under their shard lock, a rebuild takes all shard locks. Replaced filters are kept
+     * until the table goes away, so lookups never have to wait for a filter to be freed. */
+    std::atomic<BloomFilter*> filter{nullptr};
+    std::vector<std::unique_ptr<BloomFilter>> filters;
+    std::atomic<size_t> filtered{0};        // Keys added to the current filter
+    std::mutex filter_lock;                 // Serialises rebuilds
+    bool filter_add(uint64_t key);          // True if the filter is full
+    void grow_filter();
+    void rebuild_filter();
+
+public:
+    static size_t shard_index(uint64_t key);
+    void set_journal(SupplicantJournal *journal_) { journal = journal_; }
+
+    /* Builds the negative filter from all entries, until then every lookup goes to its shard */
+    void build_filter();
+    void reserve(size_t n);
+
+    bool insert(const SupplicantEntry& entry);                                 // False if already present
+    bool insert(uint64_t key, const CompactEntry& entry);
+
+    /* Takes up to units counter units at once and copies the entry, the units taken or -1 if not present.
+     * An exhausted entry is erased and leaves entry.point_len 0. */
+    int take(uint64_t key, int units, CompactEntry& entry);
+    void set_counter(uint64_t key, int ctr);
+    void erase(uint64_t key);
+    bool contains(uint64_t key);
+    size_t size();
+
+    /* Copies all entries into other and records the changes made to this table from then on */
+    void clone_into(SupplicantTable& other);
+
+    /* Applies the changes recorded so far to other, except for the keys in skip, and stops recording if stop is set.
+     * Nothing is journaled, the changes were journaled when they were made to this table. */
+    void carry_over(SupplicantTable& other, const std::unordered_set<uint64_t>& skip, bool stop);
+
+    /* Visits all entries as fn(key, entry), locking one shard at a time */
+    template<typename F> void for_each(F fn) {
+        for(auto &shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.entries.for_each(fn);
+        }
+    }
 };
 
 
+struct DatabaseRecord;
+class SharedSupplicantStore;
+
+
+/* Decoded points of recently queried supplicants in front of the table and the shared store, so repeated
+ * authentications skip decoding the point. A cached point is only used while the stored one is still the
+ * same, so entries changed by a reload or by another process on the shared store are never handed out stale.
+ * Split into shards with a lock each, a point is copied out of its shard outside the lock. */
+class SessionCache {
+private:
+    static constexpr size_t SHARD_COUNT = 16;
+
+    struct Session {
+        uint8_t point_len;
+        char point[POINT_CAPACITY];
+        std::shared_ptr<const puf::ECP_Point> ecp;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex lock;
+        ClockCache<Session, Metrics::SESSION_HIT, Metrics::SESSION_MISS, Metrics::SESSION_EVICT> cache;
+    };
+
+    std::array<Shard, SHARD_COUNT> shards;
+    std::atomic<bool> enabled{false};
+    Shard& shard_of(uint64_t key) { return shards[key % SHARD_COUNT]; }
+
+public:
+    /* Drops all entries, 0 disables the cache */
+    void resize(size_t capacity);
+
+    /* Sets ecp to the point of entry, decoded only if it is not cached or changed since */
+    void decode(uint64_t key, const CompactEntry& entry, puf::ECP_Point& ecp);
+};
+
+
+/* The table is published through an RcuPointer, so a reload can build its replacement off to the side
+ * while queries keep running on the current table without ever waiting for the reload. */
 class AuthenticationServerImpl : public puf::AuthenticationServer {
     std::string url;
-    std::map<uint64_t, SupplicantEntry> entries;
+    RcuPointer<SupplicantTable> entries;
     bool save_on_edit_;
+    bool watch_;
+    bool fetched;
+    bool binary;            // Resource file is a binary SupplicantDatabase instead of CSV
+    std::mutex fetch_lock;
+    std::mutex file_lock;   // Serialises writers of the resource file
+    JournalOptions journal_options;
+    std::unique_ptr<SupplicantJournal> journal;
+    std::string shared_name;
+    std::unique_ptr<SharedSupplicantStore> shared;      // Replaces the table if set
+    SessionCache sessions;
+
+    // Shared store with save_on_edit: snapshots the changes of other processes and takes over from a dead owner
+    std::thread persister;
+    std::mutex persist_lock;                            // Guards journal once the persister runs
+    std::condition_variable persist_wakeup;
+    bool persisting;
+
+    // State of the resource file as last loaded, used to find what changed on reload
+    std::mutex reload_lock;
+    std::unique_ptr<ResourceWatcher> watcher;
+    std::unordered_map<uint64_t, uint64_t> file_rows;   // Hashed MAC -> fingerprint of the row
+    size_t file_size;
+    uint64_t file_hash;                                 // FNV-1a of the first file_size bytes
+    uint64_t file_ino;
+    uint64_t file_mtime_ns;
+
+    void apply_record(const std::string& record);
+    void start_journal(const SupplicantJournal::Apply& apply);
+    void fetch_shared();
+    void own_shared(bool replay);
+    void persist_shared();
+    void fetch_csv(std::vector<DatabaseRecord> *records);
+    void fetch_database(bool remember);
+    void remember_file(const DatabaseRecord *begin, const DatabaseRecord *end);
+    void write_snapshot(std::ostream& os, bool as_database);
+    bool reload_file();
+    bool file_changed();
 public:
-    AuthenticationServerImpl(std::string url_, bool save_on_edit=false);
+    AuthenticationServerImpl(std::string url_, bool save_on_edit=false, const JournalOptions& journal_options_ = JournalOptions(), bool watch=false);
+    ~AuthenticationServerImpl();
     void fetch() override;
+
+    /* Applies changes of the resource file to the running table. Rows appended to a CSV file are parsed alone,
+     * any other change is diffed row by row against the previous version of the file. Rows are compared
+     * without their counter, so counters are never reset by a reload and rewriting the file from the
+     * table (journal compaction, sync) changes nothing. Called by the watcher if enabled. */
+    void reload();
     void sync() override;
     void store(const puf::MAC& base_mac, const puf::ECP_Point& A, puf::MAC& hashed_mac, int ctr) override;
     puf::QueryResult query(const puf::MAC& hashed_mac, bool decrease_counter = true) override;
+
+    /* Query taking up to units counter units in one step, granted is set to the units taken */
+    puf::QueryResult take(const puf::MAC& hashed_mac, int units, int& granted);
+
+    /* Writes all entries to path, as binary database if it ends in .db and as CSV otherwise */
+    void export_to(const std::string& path);
+
+    /* Keeps the entries in the named shared memory segment instead of the table, shared by all processes using
+     * the same name. Only the process owning the segment loads and persists the resource file, the others
+     * neither sync nor journal. With save_on_edit the owner snapshots their changes every second,
+     * and each process checks as often whether the owner is gone and takes over if so. Has to be set before fetch. */
+    void set_shared_store(const std::string& name) { shared_name = name; }
+
+    /* Keeps the decoded points of up to entries supplicants, 0 disables */
+    void set_session_cache(size_t entries) { sessions.resize(entries); }
 };
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "platform.h"
+#include "errors.h"
+
+
+constexpr size_t FRAME_SLOT_SIZE = 1522;
+
+
+struct FrameSlot {
+    uint8_t data[FRAME_SLOT_SIZE];
+    size_t len;
+    uint64_t timestamp_ns;      // Kernel receive time (CLOCK_REALTIME), 0 if not available
+};
+
+
+/* Network that can move several frames per system call.
+ * receive_batch blocks until at least one frame is available and returns the number of filled slots,
+ * send_batch returns the number of frames handed to the kernel. */
+class BatchNetwork : public puf::Network {
+public:
+    virtual int receive_batch(FrameSlot *slots, size_t count) = 0;
+    virtual int send_batch(FrameSlot *slots, size_t count) = 0;
+
+    /* Zero copy receive, the frame stays valid until the next call. Only available if in_place() is true. */
+    virtual bool in_place() const { return false; }
+    virtual int receive_in_place(uint8_t **frame) { throw puf::NetworkException("In place receive not supported"); }
+
+    /* Kernel receive time of the frame last returned by receive_in_place, 0 if not available */
+    virtual uint64_t last_timestamp() const { return 0; }
+
+    /* Frames dropped by the kernel for lack of buffer space since the previous call */
+    virtual uint64_t kernel_drops() { return 0; }
+
+    /* Descriptor that becomes readable when frames arrive, for use with poll/epoll. -1 if there is none. */
+    virtual int poll_fd() const { return -1; }
+
+    /* True if frames were already taken from the kernel but not handed out yet. The descriptor
+     * does not signal those, so an event loop has to keep receiving until this returns false. */
+    virtual bool buffered() const { return false; }
+
+    /* Drops every frame already received without blocking and returns how many were dropped */
+    virtual size_t discard_pending() { return 0; }
+};
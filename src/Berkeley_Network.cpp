@@ -4,18 +4,78 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 
-BerkeleyNetwork::BerkeleyNetwork(const char* iface_name) : 
-    initialised(false), 
+std::vector<struct sock_filter> build_frame_filter(const std::vector<uint16_t>& ethertypes,
+                                                   const std::vector<std::array<uint8_t, ETH_ALEN>>& source_macs)
+{
+    constexpr uint32_t ACCEPT_SNAPLEN = 0x40000;
+    constexpr size_t MAX_JUMP = 255;
+    std::vector<struct sock_filter> prog;
+
+    /* Layout: [ldh type][jeq type]*E [ret 0] ([ldh src_hi][jeq][ld src_lo][jeq]*M [ret 0]) [ret accept]
+     * A matching EtherType jumps to the MAC checks, or straight to accept if there are none. */
+    size_t n_types = ethertypes.size();
+    size_t n_macs = source_macs.size();
+    size_t mac_start = n_types + 2;
+    size_t accept = mac_start + (n_macs ? 4*n_macs + 1 : 0);
+
+    if(n_types == 0 || accept > MAX_JUMP) {
+        throw puf::NetworkException("Invalid frame filter");
+    }
+
+    prog.push_back( BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12) );
+    for(size_t i=0; i<n_types; ++i) {
+        uint8_t jt = static_cast<uint8_t>(mac_start - (i+2));
+        prog.push_back( BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ethertypes[i], jt, 0) );
+    }
+    prog.push_back( BPF_STMT(BPF_RET | BPF_K, 0) );
+
+    for(size_t i=0; i<n_macs; ++i) {
+        const auto &mac = source_macs[i];
+        uint32_t hi = (mac[0] << 8) | mac[1];
+        uint32_t lo = (static_cast<uint32_t>(mac[2]) << 24) | (mac[3] << 16) | (mac[4] << 8) | mac[5];
+        size_t pos = mac_start + 4*i;
+
+        prog.push_back( BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6) );
+        prog.push_back( BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 2) );
+        prog.push_back( BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8) );
+        prog.push_back( BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, lo, static_cast<uint8_t>(accept - (pos+4)), 0) );
+    }
+    if(n_macs) {
+        prog.push_back( BPF_STMT(BPF_RET | BPF_K, 0) );
+    }
+
+    prog.push_back( BPF_STMT(BPF_RET | BPF_K, ACCEPT_SNAPLEN) );
+    return prog;
+}
+
+
+BerkeleyNetwork::BerkeleyNetwork(const char* iface_name, const BerkeleyOptions& options_) : 
+    sockfd(-1),
+    options(options_),
     remote_address{0}, 
     local_address{0}, 
-    addr_size(sizeof(struct sockaddr_ll))
+    addr_size(sizeof(struct sockaddr_ll)),
+    initialised(false), 
+    ring(nullptr),
+    ring_size(0),
+    ring_block(0),
+    ring_frames_left(0),
+    ring_frame(nullptr)
 {
     strncpy(ifName, iface_name, sizeof(ifName));
 }
 
 
+BerkeleyNetwork::~BerkeleyNetwork() {
+    if(ring) munmap(ring, ring_size);
+    if(sockfd >= 0) close(sockfd);
+}
+
+
 void BerkeleyNetwork::get_local_endpoint() {
     memset( static_cast<void*>(&local_address), 0, sizeof(struct sockaddr_ll) );
 	struct ifreq if_idx;    
@@ -56,6 +116,84 @@ void BerkeleyNetwork::set_timeout() {
 }
 
 
+void BerkeleyNetwork::setup_rx_ring() {
+    int version = TPACKET_V3;
+    if( setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = options.ring_block_size;
+    req.tp_block_nr = options.ring_block_count;
+    req.tp_frame_size = options.ring_frame_size;
+    req.tp_frame_nr = (req.tp_block_size * req.tp_block_nr) / req.tp_frame_size;
+    req.tp_retire_blk_tov = 10;     // Hand partially filled blocks to user space after 10 ms
+
+    if( setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    ring_size = static_cast<size_t>(req.tp_block_size) * req.tp_block_nr;
+    void *mapped = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, sockfd, 0);
+    if(mapped == MAP_FAILED) {
+        ring_size = 0;
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    ring = static_cast<uint8_t*>(mapped);
+    ring_block = 0;
+    ring_frames_left = 0;
+    ring_frame = nullptr;
+}
+
+
+void BerkeleyNetwork::release_block() {
+    auto *block = reinterpret_cast<struct tpacket_block_desc*>(ring + static_cast<size_t>(ring_block) * options.ring_block_size);
+
+    // All frames of this block are consumed, return the whole block at once
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring_block = (ring_block + 1) % options.ring_block_count;
+    ring_frame = nullptr;
+}
+
+
+void BerkeleyNetwork::attach_filter() {
+    auto prog = build_frame_filter(options.ethertypes, options.source_macs);
+
+    struct sock_fprog fprog;
+    fprog.len = static_cast<unsigned short>(prog.size());
+    fprog.filter = prog.data();
+
+    if( setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+}
+
+
+void BerkeleyNetwork::join_fanout() {
+    /* PACKET_FANOUT_HASH uses the flow hash, which ignores MAC addresses of non-IP frames and would put
+     * every supplicant on the same socket. Select the socket from the low bytes of the source MAC instead,
+     * so all frames of one supplicant still end up at the same worker. The fanout program sees the frame
+     * at the network header, so the MAC is addressed relative to the link layer. */
+    struct sock_filter prog[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_LL_OFF + 8)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, options.fanout_members),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog fprog;
+    fprog.len = sizeof(prog) / sizeof(prog[0]);
+    fprog.filter = prog;
+
+    int arg = (options.fanout_group & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+    if( setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0 ||
+        setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0 )
+    {
+        throw puf::NetworkException( strerror(errno) );
+    }
+}
+
+
 void BerkeleyNetwork::init() {
     if(initialised) return;
 
@@ -67,6 +205,22 @@ void BerkeleyNetwork::init() {
     set_timeout();
     get_local_endpoint();
 
+    if(options.timestamps) {
+        int one = 1;
+        if( setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0 ) {
+            throw puf::NetworkException( strerror(errno) );
+        }
+    }
+
+    // Attach before binding so no unfiltered frame is ever queued
+    if( !options.ethertypes.empty() ) {
+        attach_filter();
+    }
+
+    if(options.rx_ring) {
+        setup_rx_ring();
+    }
+
     // Bind to interface
     if (bind(sockfd, reinterpret_cast<struct sockaddr*>(&local_address), sizeof(struct sockaddr_ll)) == -1) {
         throw puf::NetworkException( strerror(errno) );
@@ -74,6 +228,11 @@ void BerkeleyNetwork::init() {
 
     set_promisc();
 
+    // Fanout can only be joined by a bound socket
+    if(options.fanout_group >= 0) {
+        join_fanout();
+    }
+
     printf("Bound to interface %s with index %d\n", ifName, local_address.sll_ifindex);
     initialised = true;
 }
@@ -88,9 +247,183 @@ void BerkeleyNetwork::send(uint8_t *buf, size_t bufSize) {
 
 int BerkeleyNetwork::receive(uint8_t *buf, size_t bufSize) {
     int n;
+
+    if(ring) {
+        uint8_t *frame;
+        n = receive_in_place(&frame);
+        n = (static_cast<size_t>(n) < bufSize) ? n : bufSize-1;
+        memcpy(buf, frame, n);
+        buf[n] = 0;
+        return n;
+    }
+
     if( (n = recvfrom(sockfd, buf, bufSize-1, 0, reinterpret_cast<struct sockaddr*>(&remote_address), &addr_size)) < 0) {
         throw puf::NetworkException("Timeout");
     }
     buf[n] = 0;
     return n;
+}
+
+
+int BerkeleyNetwork::receive_in_place(uint8_t **frame) {
+    if(!ring) {
+        throw puf::NetworkException("Receive ring not enabled");
+    }
+
+    // Previous block is exhausted, give it back before waiting for the next one
+    if(ring_frame && ring_frames_left == 0) {
+        release_block();
+    }
+
+    if(ring_frames_left == 0) {
+        auto *block = reinterpret_cast<struct tpacket_block_desc*>(ring + static_cast<size_t>(ring_block) * options.ring_block_size);
+
+        while( !(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) ) {
+            struct pollfd pfd = {0};
+            pfd.fd = sockfd;
+            pfd.events = POLLIN | POLLERR;
+            if( poll(&pfd, 1, NETWORK_TIMEOUT_MS) <= 0 ) {
+                throw puf::NetworkException("Timeout");
+            }
+        }
+
+        ring_frames_left = block->hdr.bh1.num_pkts;
+        if(ring_frames_left == 0) {
+            release_block();
+            return receive_in_place(frame);
+        }
+        ring_frame = reinterpret_cast<struct tpacket3_hdr*>(reinterpret_cast<uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt);
+    } else {
+        ring_frame = reinterpret_cast<struct tpacket3_hdr*>(reinterpret_cast<uint8_t*>(ring_frame) + ring_frame->tp_next_offset);
+    }
+
+    --ring_frames_left;
+    *frame = reinterpret_cast<uint8_t*>(ring_frame) + ring_frame->tp_mac;
+    return ring_frame->tp_snaplen;
+}
+
+
+uint64_t BerkeleyNetwork::last_timestamp() const {
+    if(!ring_frame) return 0;
+    return ring_frame->tp_sec * 1000000000ULL + ring_frame->tp_nsec;
+}
+
+
+uint64_t BerkeleyNetwork::kernel_drops() {
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    // Reading the statistics resets them. Both versions start with tp_packets and tp_drops.
+    memset(&stats, 0, sizeof(stats));
+    if( getsockopt(sockfd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+    return stats.tp_drops;
+}
+
+
+size_t BerkeleyNetwork::discard_pending() {
+    size_t n = 0;
+
+    if(ring) {
+        // Rest of the current block, then every block the kernel has handed over meanwhile
+        if(ring_frame) {
+            n += ring_frames_left;
+            ring_frames_left = 0;
+            release_block();
+        }
+        while(true) {
+            auto *block = reinterpret_cast<struct tpacket_block_desc*>(ring + static_cast<size_t>(ring_block) * options.ring_block_size);
+            if( !(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) ) break;
+            n += block->hdr.bh1.num_pkts;
+            release_block();
+        }
+        return n;
+    }
+
+    uint8_t scratch[64];
+    while( recv(sockfd, scratch, sizeof(scratch), MSG_DONTWAIT | MSG_TRUNC) >= 0 ) {
+        ++n;
+    }
+    return n;
+}
+
+
+void BerkeleyNetwork::prepare_msgs(FrameSlot *slots, size_t count, bool receiving) {
+    if(msgs.size() < count) {
+        msgs.resize(count);
+        iovecs.resize(count);
+        controls.resize(count);
+    }
+
+    for(size_t i=0; i<count; ++i) {
+        iovecs[i].iov_base = slots[i].data;
+        iovecs[i].iov_len = receiving ? sizeof(slots[i].data) : slots[i].len;
+
+        memset(&msgs[i], 0, sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if(!receiving) {
+            msgs[i].msg_hdr.msg_name = &local_address;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+        } else if(options.timestamps) {
+            msgs[i].msg_hdr.msg_control = controls[i].data();
+            msgs[i].msg_hdr.msg_controllen = controls[i].size();
+        }
+    }
+}
+
+
+int BerkeleyNetwork::receive_batch(FrameSlot *slots, size_t count) {
+    int n = 0;
+
+    if(count == 0) return 0;
+
+    if(ring) {
+        // Block for the first frame only, then drain what is left of the current block
+        do {
+            uint8_t *frame;
+            size_t len = receive_in_place(&frame);
+            slots[n].len = (len < sizeof(slots[n].data)) ? len : sizeof(slots[n].data);
+            slots[n].timestamp_ns = last_timestamp();
+            memcpy(slots[n].data, frame, slots[n].len);
+            ++n;
+        } while(static_cast<size_t>(n) < count && ring_frames_left > 0);
+
+        // Everything was copied, return an exhausted block right away so poll only reports unread blocks
+        if(ring_frames_left == 0) release_block();
+        return n;
+    }
+
+    prepare_msgs(slots, count, true);
+    if( (n = recvmmsg(sockfd, msgs.data(), count, MSG_WAITFORONE, nullptr)) < 0 ) {
+        throw puf::NetworkException("Timeout");
+    }
+
+    for(int i=0; i<n; ++i) {
+        slots[i].len = msgs[i].msg_len;
+        slots[i].timestamp_ns = 0;
+
+        for(auto *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                slots[i].timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            }
+        }
+    }
+    return n;
+}
+
+
+int BerkeleyNetwork::send_batch(FrameSlot *slots, size_t count) {
+    int n;
+
+    if(count == 0) return 0;
+
+    prepare_msgs(slots, count, false);
+    if( (n = sendmmsg(sockfd, msgs.data(), count, 0)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+    return n;
 }
\ No newline at end of file
@@ -1,30 +1,89 @@
 #pragma once
 
 #include "platform.h"
+#include "Batch_Network.h"
 
 #include <linux/if_packet.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <linux/if_ether.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <vector>
+#include <array>
 
 
-class BerkeleyNetwork : public puf::Network {
+struct BerkeleyOptions {
+    bool rx_ring = false;                   // Receive through a memory mapped TPACKET_V3 ring
+    unsigned int ring_block_size = 1 << 20; // Bytes per ring block, multiple of the page size
+    unsigned int ring_block_count = 64;     // Number of blocks in the ring
+    unsigned int ring_frame_size = 2048;    // Maximum size of a single frame slot
+
+    /* In-kernel frame filter, no filter is attached if ethertypes is empty */
+    std::vector<uint16_t> ethertypes;                       // Accepted EtherTypes
+    std::vector<std::array<uint8_t, ETH_ALEN>> source_macs; // Accepted source MACs, empty accepts all
+
+    int fanout_group = -1;                  // Join this fanout group, -1 disables fanout
+    unsigned int fanout_members = 1;        // Sockets in the group, frames are spread by source MAC
+
+    bool timestamps = false;                // Kernel receive timestamps for receive_batch (SO_TIMESTAMPNS), the ring always has them
+};
+
+
+/* Builds a classic BPF program accepting only frames with one of the given EtherTypes and,
+ * if any are given, one of the given source MACs. */
+std::vector<struct sock_filter> build_frame_filter(const std::vector<uint16_t>& ethertypes,
+                                                   const std::vector<std::array<uint8_t, ETH_ALEN>>& source_macs);
+
+
+class BerkeleyNetwork : public BatchNetwork {
 private:
     int sockfd;
     char ifName[IFNAMSIZ];
+    BerkeleyOptions options;
 
     struct sockaddr_ll remote_address;
     struct sockaddr_ll local_address;
     socklen_t addr_size;
     bool initialised;
 
+    /* TPACKET_V3 receive ring */
+    uint8_t *ring;
+    size_t ring_size;
+    unsigned int ring_block;                // Index of the block currently handed out
+    unsigned int ring_frames_left;          // Frames not yet consumed in the current block
+    struct tpacket3_hdr *ring_frame;        // Last frame handed out
+
+    /* Scratch space for recvmmsg/sendmmsg, grown on demand */
+    std::vector<struct mmsghdr> msgs;
+    std::vector<struct iovec> iovecs;
+    std::vector<std::array<char, CMSG_SPACE(sizeof(struct timespec))>> controls;
+
     void set_promisc(bool enable = true);
     void get_local_endpoint();
     void set_timeout();
+    void setup_rx_ring();
+    void attach_filter();
+    void join_fanout();
+    void release_block();
+    void prepare_msgs(FrameSlot *slots, size_t count, bool receiving);
 
 public:
-    BerkeleyNetwork(const char* iface_name);
+    BerkeleyNetwork(const char* iface_name, const BerkeleyOptions& options_ = BerkeleyOptions());
+    ~BerkeleyNetwork();
     void init() override;
     void send(uint8_t *buf, size_t bufSize) override;
     int receive(uint8_t *buf, size_t bufSize) override;
-};
\ No newline at end of file
+    int receive_batch(FrameSlot *slots, size_t count) override;
+    int send_batch(FrameSlot *slots, size_t count) override;
+
+    /* Hands out the next frame directly from the receive ring without copying it.
+     * The frame stays valid until the next call. Requires BerkeleyOptions::rx_ring. */
+    int receive_in_place(uint8_t **frame) override;
+    bool in_place() const override { return ring != nullptr; }
+    uint64_t last_timestamp() const override;
+    uint64_t kernel_drops() override;
+    int poll_fd() const override { return sockfd; }
+    bool buffered() const override { return ring && ring_frames_left > 0; }
+    size_t discard_pending() override;
+};
@@ -0,0 +1,50 @@
+#include "Bloom_Filter.h"
+
+
+static uint64_t mix(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+
+
+/* ----------------------------------------- BloomFilter Implementation ---------------------------------------*/
+
+BloomFilter::BloomFilter(size_t capacity) : capacity_(capacity) {
+    size_t count = 1;
+    while(count * sizeof(Block) * 8 < capacity * BITS_PER_KEY) count <<= 1;
+
+    blocks = std::make_unique<Block[]>(count);
+    for(size_t i=0; i<count; ++i) {
+        for(auto &word : blocks[i].words) word.store(0, std::memory_order_relaxed);
+    }
+    block_mask = count - 1;
+}
+
+
+void BloomFilter::add(uint64_t key) {
+    uint64_t hash = mix(key);
+    Block &block = blocks[hash & block_mask];
+
+    // 9 bits of the second hash select one of the 512 bits of the block per probe
+    uint64_t bits = mix(hash);
+    for(int i=0; i<PROBES; ++i, bits >>= 9) {
+        block.words[(bits & 511) >> 6].fetch_or(1ULL << (bits & 63), std::memory_order_relaxed);
+    }
+}
+
+
+bool BloomFilter::may_contain(uint64_t key) const {
+    uint64_t hash = mix(key);
+    const Block &block = blocks[hash & block_mask];
+
+    uint64_t bits = mix(hash);
+    for(int i=0; i<PROBES; ++i, bits >>= 9) {
+        if( !(block.words[(bits & 511) >> 6].load(std::memory_order_relaxed) & (1ULL << (bits & 63))) ) return false;
+    }
+    return true;
+}
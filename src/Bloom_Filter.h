@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+
+/* Blocked Bloom filter over hashed MACs: all bits of a key lie in one 64 byte block, so a lookup costs a single
+ * cache line. Bits are set atomically, lookups may run concurrently with additions without any lock.
+ * Keys cannot be removed, a stale key only adds to the false positive rate until the filter is rebuilt. */
+class BloomFilter {
+private:
+    static constexpr size_t BITS_PER_KEY = 16;      // About 0.1% false positives at capacity
+    static constexpr int PROBES = 6;
+
+    struct alignas(64) Block {
+        std::atomic<uint64_t> words[8];
+    };
+
+    std::unique_ptr<Block[]> blocks;
+    size_t block_mask;
+    size_t capacity_;
+
+public:
+    BloomFilter(size_t capacity);
+
+    void add(uint64_t key);
+    bool may_contain(uint64_t key) const;
+
+    /* Keys the filter was sized for, beyond that the false positive rate rises quickly */
+    size_t capacity() const { return capacity_; }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "Metrics.h"
+
+
+/* Values of recently used entries keyed by hashed MAC, e.g. decoded points, so repeated authentications skip
+ * fetching or decoding them. Eviction follows the CLOCK algorithm: a hit only sets a reference bit, the hand
+ * sweeping for a victim clears it, so hot entries survive without any reordering on hits. Hits, misses and
+ * evictions are counted in the given Metrics counters. Not thread safe, the owner guards it with its lock. */
+template<typename Value, Metrics::Counter HIT, Metrics::Counter MISS, Metrics::Counter EVICT>
+class ClockCache {
+private:
+    struct Slot {
+        uint64_t key;
+        bool referenced;
+        Value value;
+    };
+
+    std::vector<Slot> slots;
+    std::unordered_map<uint64_t, size_t> index;     // Key -> slot
+    size_t capacity;
+    size_t hand;
+
+public:
+    ClockCache(size_t capacity_ = 0) : capacity(capacity_), hand(0) {}
+
+    /* Drops all entries */
+    void resize(size_t capacity_) {
+        slots.clear();
+        index.clear();
+        capacity = capacity_;
+        hand = 0;
+    }
+
+    Value* find(uint64_t key) {
+        return find(key, [](const Value&) { return true; });
+    }
+
+    /* Like find, but an entry for which valid(value) is false counts as a miss, insert then replaces it */
+    template<typename Valid> Value* find(uint64_t key, Valid valid) {
+        if(capacity == 0) return nullptr;
+
+        auto it = index.find(key);
+        if(it == index.end() || !valid(slots[it->second].value)) {
+            Metrics::count(MISS);
+            return nullptr;
+        }
+
+        Metrics::count(HIT);
+        Slot &slot = slots[it->second];
+        slot.referenced = true;
+        return &slot.value;
+    }
+
+    void insert(uint64_t key, const Value& value) {
+        if(capacity == 0) return;
+
+        auto it = index.find(key);
+        if(it != index.end()) {
+            slots[it->second].value = value;
+            slots[it->second].referenced = true;
+            return;
+        }
+
+        // Fill up first, then advance the hand to the first slot not referenced since its last pass
+        size_t victim;
+        if(slots.size() < capacity) {
+            victim = slots.size();
+            slots.push_back( Slot{key, false, value} );
+        } else {
+            while(slots[hand].referenced) {
+                slots[hand].referenced = false;
+                hand = (hand + 1) % slots.size();
+            }
+            victim = hand;
+            hand = (hand + 1) % slots.size();
+
+            index.erase(slots[victim].key);
+            slots[victim].key = key;
+            slots[victim].referenced = false;
+            slots[victim].value = value;
+            Metrics::count(EVICT);
+        }
+        index[key] = victim;
+    }
+
+    void erase(uint64_t key) {
+        auto it = index.find(key);
+        if(it == index.end()) return;
+
+        // Swap the last slot into the hole, the hand only needs to stay in range
+        size_t hole = it->second;
+        size_t last = slots.size() - 1;
+        index.erase(it);
+        if(hole != last) {
+            slots[hole] = slots[last];
+            index[slots[hole].key] = hole;
+        }
+        slots.pop_back();
+        if(hand >= slots.size()) hand = 0;
+    }
+
+    size_t size() const { return index.size(); }
+};
@@ -0,0 +1,250 @@
+#include "Csv_Loader.h"
+#include "Supplicant_Database.h"
+
+#include <vector>
+#include <thread>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+constexpr char DELIM = ';';
+constexpr size_t MIN_CHUNK_SIZE = 1 << 20;     // Smaller files are not worth spreading over threads
+
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+static bool is_base64(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+
+static bool parse_int(const char *&p, const char *end, int32_t& value) {
+    bool negative = (p < end && *p == '-');
+    int64_t retval = 0;
+    const char *start;
+
+    if(negative) ++p;
+    start = p;
+    while(p < end && *p >= '0' && *p <= '9') {
+        retval = retval * 10 + (*p++ - '0');
+        if(retval > INT32_MAX) return false;
+    }
+
+    value = static_cast<int32_t>(negative ? -retval : retval);
+    return p != start;
+}
+
+
+// Accepts `xx:xx:xx:xx:xx:xx` with one or two hex digits per byte, as written by SupplicantEntry::to_string
+static bool parse_mac(const char *&p, const char *end, uint8_t *mac) {
+    for(int i=0; i<6; ++i) {
+        int hi, lo;
+        if(p >= end || (hi = hex_value(*p)) < 0) return false;
+        ++p;
+        if(p < end && (lo = hex_value(*p)) >= 0) {
+            hi = (hi << 4) | lo;
+            ++p;
+        }
+        mac[i] = static_cast<uint8_t>(hi);
+        if(i < 5) {
+            if(p >= end || *p != ':') return false;
+            ++p;
+        }
+    }
+    return true;
+}
+
+
+bool parse_csv_row(const char *begin, const char *end, CompactEntry& entry) {
+    const char *p = begin;
+
+    while(end > begin && (end[-1] == '\r' || end[-1] == '\n')) --end;
+
+    // Counter
+    if( !parse_int(p, end, entry.ctr) || p >= end || *p++ != DELIM ) return false;
+
+    // Base MAC
+    if( !parse_mac(p, end, entry.base_mac) || p >= end || *p++ != DELIM ) return false;
+
+    // A
+    const char *point = p;
+    while(p < end && is_base64(*p)) ++p;
+    while(p < end && *p == '=' && static_cast<size_t>(p - point) < POINT_CAPACITY) ++p;
+    size_t point_len = p - point;
+    if(point_len == 0 || point_len % 4 != 0 || point_len >= POINT_CAPACITY) return false;
+    if(p >= end || *p++ != DELIM) return false;
+    memcpy(entry.point, point, point_len);
+    entry.point[point_len] = '\0';
+    entry.point_len = static_cast<uint8_t>(point_len);
+
+    // Hashed MAC, the trailing delimiter is optional
+    if( !parse_mac(p, end, entry.hashed_mac) ) return false;
+    if(p < end && *p == DELIM) ++p;
+
+    return p == end;
+}
+
+
+namespace {
+
+struct Chunk {
+    const char *begin;
+    const char *end;
+    std::vector<DatabaseRecord> records;
+    std::vector<std::pair<const char*, const char*>> errors;
+};
+
+
+void parse_chunk(Chunk& chunk) {
+    const char *line = chunk.begin;
+
+    chunk.records.reserve( (chunk.end - chunk.begin) / 128 );
+    while(line < chunk.end) {
+        const char *eol = static_cast<const char*>( memchr(line, '\n', chunk.end - line) );
+        if(!eol) eol = chunk.end;
+
+        if(eol > line && !(eol == line+1 && *line == '\r')) {
+            DatabaseRecord record{};
+            if( parse_csv_row(line, eol, record.entry) ) {
+                puf::MAC hashed_mac;
+                memcpy(hashed_mac.bytes, record.entry.hashed_mac, sizeof(record.entry.hashed_mac));
+                record.key = hashed_mac.to_u64();
+                chunk.records.push_back(record);
+            } else {
+                chunk.errors.emplace_back(line, eol);
+            }
+        }
+        line = eol + 1;
+    }
+}
+
+}
+
+
+/* Maps path and parses it from offset in newline aligned chunks, one per thread.
+ * Returns the mapped size or 0 if there was nothing to parse. The caller unmaps. */
+static size_t parse_file(const std::string& path, size_t offset, unsigned int threads, void *&mapped, std::vector<Chunk>& chunks) {
+    struct stat st;
+    int fd;
+
+    if( (fd = open(path.c_str(), O_RDONLY)) < 0 ) {
+        std::cerr << "Error opening " << path << ": " << strerror(errno) << '\n';
+        return 0;
+    }
+    if( fstat(fd, &st) < 0 || st.st_size == 0 || static_cast<size_t>(st.st_size) <= offset ) {
+        close(fd);
+        return 0;
+    }
+
+    mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) {
+        std::cerr << "Error mapping " << path << ": " << strerror(errno) << '\n';
+        return 0;
+    }
+
+    const char *data = static_cast<const char*>(mapped) + offset;
+    size_t size = st.st_size - offset;
+
+    if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min<size_t>(threads, size / MIN_CHUNK_SIZE + 1));
+
+    // Split into newline aligned chunks of roughly equal size
+    chunks.resize(threads);
+    const char *pos = data;
+    for(unsigned int i=0; i<threads; ++i) {
+        const char *end = (i == threads-1) ? data + size : std::max(pos, data + size * (i+1) / threads);
+        if(end < data + size) {
+            const char *eol = static_cast<const char*>( memchr(end, '\n', data + size - end) );
+            end = eol ? eol + 1 : data + size;
+        }
+        chunks[i].begin = pos;
+        chunks[i].end = end;
+        pos = end;
+    }
+
+    std::vector<std::thread> workers;
+    for(unsigned int i=1; i<threads; ++i) {
+        workers.emplace_back(parse_chunk, std::ref(chunks[i]));
+    }
+    parse_chunk(chunks[0]);
+    for(auto &worker : workers) worker.join();
+
+    for(const auto &chunk : chunks) {
+        for(const auto &[begin, end] : chunk.errors) {
+            std::cerr << "Error loading entry: " << std::string(begin, end) << '\n';
+        }
+    }
+    return st.st_size;
+}
+
+
+size_t load_csv(const std::string& path, SupplicantTable& table, unsigned int threads, std::vector<DatabaseRecord> *records) {
+    std::vector<Chunk> chunks;
+    void *mapped = nullptr;
+    size_t size = parse_file(path, 0, threads, mapped, chunks);
+
+    if(size == 0) return 0;
+    threads = chunks.size();
+
+    size_t total = 0;
+    for(const auto &chunk : chunks) {
+        total += chunk.records.size();
+    }
+
+    /* Merge in parallel, each thread owning a disjoint set of shards. Walking the chunks in file
+     * order keeps the first occurrence of a duplicate MAC, just like a sequential load. */
+    table.reserve(total);
+    auto merge = [&](unsigned int part) {
+        for(const auto &chunk : chunks) {
+            for(const auto &record : chunk.records) {
+                if( SupplicantTable::shard_index(record.key) % threads == part ) {
+                    table.insert(record.key, record.entry);
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for(unsigned int i=1; i<threads; ++i) {
+        workers.emplace_back(merge, i);
+    }
+    merge(0);
+    for(auto &worker : workers) worker.join();
+
+    if(records) {
+        records->reserve(records->size() + total);
+        for(const auto &chunk : chunks) {
+            records->insert(records->end(), chunk.records.begin(), chunk.records.end());
+        }
+    }
+
+    munmap(mapped, size);
+    return total;
+}
+
+
+size_t read_csv(const std::string& path, size_t offset, std::vector<DatabaseRecord>& records, unsigned int threads) {
+    std::vector<Chunk> chunks;
+    void *mapped = nullptr;
+    size_t size = parse_file(path, offset, threads, mapped, chunks);
+
+    if(size == 0) return offset;
+    for(const auto &chunk : chunks) {
+        records.insert(records.end(), chunk.records.begin(), chunk.records.end());
+    }
+
+    munmap(mapped, size);
+    return size;
+}
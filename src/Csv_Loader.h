@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "Authentication_Server.h"
+#include "Supplicant_Database.h"
+
+
+/* Parses one `;` delimited row (without line break) into entry. The point is checked to be
+ * well formed base64 but not decoded. Returns false for malformed rows. Does not allocate. */
+bool parse_csv_row(const char *begin, const char *end, CompactEntry& entry);
+
+/* Loads a CSV resource file into table using up to `threads` threads (0 = all cores).
+ * Malformed rows are reported on stderr. Returns the number of well formed rows.
+ * If records is given, all well formed rows are also appended to it in file order. */
+size_t load_csv(const std::string& path, SupplicantTable& table, unsigned int threads = 0, std::vector<DatabaseRecord> *records = nullptr);
+
+/* Parses the rows of a CSV resource file starting at byte offset without loading them anywhere.
+ * Returns the file size the records were read from. */
+size_t read_csv(const std::string& path, size_t offset, std::vector<DatabaseRecord>& records, unsigned int threads = 0);
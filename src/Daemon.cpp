@@ -0,0 +1,594 @@
+#include "Daemon.h"
+#include "Loopback_Network.h"
+#include "Admission_Control.h"
+#include "Metrics.h"
+#include "packets.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <csignal>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+constexpr size_t BATCH_SIZE = 32;
+constexpr size_t MAX_EVENTS = 16;
+constexpr size_t MAX_COMMAND = 4096;    // Clients sending longer lines are dropped
+constexpr int SIGN_UP_TIMEOUT_MS = 10000;   // From the register command until the sign up has to arrive
+
+
+static sigset_t handled_signals() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    return mask;
+}
+
+
+/* Redirects std::cout into a string while in scope, so command output can be sent to the client */
+class CaptureStdout {
+private:
+    std::ostringstream buffer;
+    std::streambuf *saved;
+public:
+    CaptureStdout() : saved(std::cout.rdbuf(buffer.rdbuf())) {}
+    ~CaptureStdout() { std::cout.rdbuf(saved); }
+    std::string str() const { return buffer.str(); }
+};
+
+
+void Daemon::block_signals() {
+    sigset_t mask = handled_signals();
+    if( pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0 ) {
+        throw std::runtime_error("Error blocking signals");
+    }
+}
+
+
+Daemon::Daemon(puf::AuthenticationServer& as_, std::function<void()> reload_, SerialMaster& serial_, const DaemonOptions& options_) :
+    as(as_),
+    reload(reload_),
+    serial(serial_),
+    options(options_),
+    epoll_fd(-1),
+    signal_fd(-1),
+    control_fd(-1),
+    serial_fd(-1),
+    serial_hung(-1),
+    serial_events(0),
+    running(false),
+    next_client_id(0),
+    slots(BATCH_SIZE)
+{
+    if( (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating epoll instance: ") + strerror(errno) );
+    }
+
+    sigset_t mask = handled_signals();
+    if( (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating signalfd: ") + strerror(errno) );
+    }
+
+    watch(signal_fd);
+    if( !options.control_socket.empty() ) {
+        open_control_socket();
+    }
+    update_serial();
+}
+
+
+Daemon::~Daemon() {
+    for(const auto &client : clients) {
+        close(client.first);
+    }
+    if(control_fd >= 0) {
+        close(control_fd);
+        unlink(options.control_socket.c_str());
+    }
+    if(signal_fd >= 0) close(signal_fd);
+    if(epoll_fd >= 0) close(epoll_fd);
+}
+
+
+void Daemon::add_interface(const std::string& name, BatchNetwork& net, puf::Authenticator& au) {
+    if( net.poll_fd() < 0 ) {
+        throw std::runtime_error("The network backend of " + name + " cannot be polled, daemon mode is not available");
+    }
+
+    auto iface = std::make_unique<Interface>();
+    iface->name = name;
+    iface->net = &net;
+    iface->au = &au;
+    iface->stats.interface = name;
+    watch(net.poll_fd());
+    interfaces.push_back( std::move(iface) );
+}
+
+
+Daemon::Interface* Daemon::interface_of(int fd) {
+    for(auto &iface : interfaces) {
+        if(iface->net->poll_fd() == fd) return iface.get();
+    }
+    return nullptr;
+}
+
+
+void Daemon::watch(int fd, uint32_t events, int op) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+
+    if( epoll_ctl(epoll_fd, op, fd, &event) < 0 ) {
+        throw std::runtime_error( std::string("Error adding descriptor to epoll: ") + strerror(errno) );
+    }
+}
+
+
+void Daemon::unwatch(int fd) {
+    // Fails harmlessly if the descriptor was closed already, closing removes it from the epoll set
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+
+/* Follows reconnects and waits for the port to become writable while output is queued */
+void Daemon::update_serial() {
+    int fd = (serial.fd() == serial_hung) ? -1 : serial.fd();
+    uint32_t events = serial.wants_write() ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+
+    if(fd == serial_fd) {
+        if(fd >= 0 && events != serial_events) {
+            watch(fd, events, EPOLL_CTL_MOD);
+            serial_events = events;
+        }
+        return;
+    }
+
+    if(serial_fd >= 0) unwatch(serial_fd);
+    serial_fd = fd;
+    serial_events = events;
+    if(serial_fd >= 0) watch(serial_fd, events);
+}
+
+
+void Daemon::open_control_socket() {
+    const std::string &path = options.control_socket;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Control socket path too long: " + path);
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    unlink(path.c_str());
+    if( (control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(control_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(control_fd, 8) < 0 ) {
+        throw std::runtime_error( "Error opening control socket " + path + ": " + strerror(errno) );
+    }
+    watch(control_fd);
+}
+
+
+void Daemon::run() {
+    struct epoll_event events[MAX_EVENTS];
+    running = true;
+
+    std::cout << "Serving on " << (options.control_socket.empty() ? "no control socket" : options.control_socket) << std::endl;
+
+    while(running) {
+        // Wake up for the serial and sign up timeouts only, everything else is event driven
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms());
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            throw std::runtime_error( std::string("Error waiting for events: ") + strerror(errno) );
+        }
+
+        for(int i=0; i<n && running; ++i) {
+            int fd = events[i].data.fd;
+            Interface *iface;
+
+            if( (iface = interface_of(fd)) ) {
+                on_frames(*iface);
+            } else if(fd == signal_fd) {
+                on_signal();
+            } else if(fd == control_fd) {
+                on_control();
+            } else if(fd == serial_fd) {
+                on_serial(events[i].events);
+            } else if( clients.count(fd) ) {
+                on_client(fd);
+            }
+        }
+
+        serial.expire();
+        expire_sign_ups();
+        update_serial();
+    }
+}
+
+
+/* Milliseconds until the next serial or sign up timeout, -1 if none is pending */
+int Daemon::timeout_ms() const {
+    using namespace std::chrono;
+    int retval = serial.timeout_ms();
+    auto now = steady_clock::now();
+
+    for(const auto &iface : interfaces) {
+        if(!iface->sign_up_done) continue;
+        auto left = std::max<long long>(0, duration_cast<milliseconds>(iface->sign_up_deadline - now).count());
+        if(retval < 0 || left < retval) retval = static_cast<int>(left);
+    }
+    return retval;
+}
+
+
+void Daemon::expire_sign_ups() {
+    auto now = std::chrono::steady_clock::now();
+    for(auto &iface : interfaces) {
+        if(!iface->sign_up_done || now < iface->sign_up_deadline) continue;
+
+        auto done = std::move(iface->sign_up_done);
+        iface->sign_up_done = nullptr;
+        done("error: no sign up received on " + iface->name + "\n");
+    }
+}
+
+
+void Daemon::on_frames(Interface& iface) {
+    // Frames left over in the receive ring do not make the socket readable again
+    do {
+        size_t n;
+        try {
+            StageTimer timer(Metrics::RECEIVE);
+            n = iface.net->receive_batch(slots.data(), slots.size());
+        } catch(const puf::Exception &e) {
+            std::cerr << "Error receiving on " << iface.name << ": " << e.what() << '\n';
+            return;
+        }
+
+        // One malformed frame must not stop the daemon, skip it and go on with the rest
+        for(size_t i=0; i<n; ++i) {
+            try {
+                handle_frame(iface, slots[i]);
+            } catch(const puf::Exception &e) {
+                iface.errors++;
+                std::cerr << "Error handling frame on " << iface.name << ": " << e.what() << '\n';
+            } catch(const std::runtime_error &e) {
+                iface.errors++;
+                std::cerr << "Error handling frame on " << iface.name << ": " << e.what() << '\n';
+            }
+        }
+    } while( iface.net->buffered() );
+}
+
+
+void Daemon::handle_frame(Interface& iface, FrameSlot& slot) {
+    using namespace puf;
+    PacketType type = deduce_type(slot.data, slot.len);
+
+    if(type == PUF_CON_E) {
+        if( !AdmissionControl::admit(slot.data, slot.len) ) return;
+
+        int rejected;
+        {
+            StageTimer timer(Metrics::ACCEPT);
+            rejected = iface.au->accept(slot.data, slot.len);
+        }
+        rejected ? iface.rejected++ : iface.accepted++;
+
+        std::string result = iface.name + (rejected ? ": Rejected\n" : ": Accepted\n");
+        std::cout << result << std::flush;
+        notify(connect_waiters, result);
+        return;
+    }
+
+    if(iface.sign_up_done && type != PUF_PERFORMANCE_E) {
+        sign_up(iface, slot);
+        return;
+    }
+
+    if( speedtest_frame(slot.data, slot.len, slot.timestamp_ns, iface.pp, *iface.au, iface.stats) ) {
+        finish_speedtest(iface);
+    }
+}
+
+
+/* Authenticator::sign_up receives the sign up itself. It gets an authenticator of its own on a loopback network
+ * holding only the frame at hand, so it returns at once instead of blocking the loop on the interface. */
+void Daemon::sign_up(Interface& iface, FrameSlot& slot) {
+    auto done = std::move(iface.sign_up_done);
+    iface.sign_up_done = nullptr;
+
+    LoopbackNetwork net;
+    puf::Authenticator au(net, as);
+    net.inject(slot.data, slot.len);
+    net.close_input();
+    try {
+        au.init();
+        au.sign_up();
+    } catch(const puf::Exception &e) {
+        done(std::string("error: ") + e.what() + "\n");
+        throw;
+    } catch(const std::runtime_error &e) {
+        done(std::string("error: ") + e.what() + "\n");
+        throw;
+    }
+
+    // Whatever the authenticator answered goes out on the interface
+    std::vector<uint8_t> frame;
+    while( net.take_sent(frame) ) {
+        iface.net->send(frame.data(), frame.size());
+    }
+    std::cout << iface.name << ": Signed up" << std::endl;
+    done("ok\n");
+}
+
+
+void Daemon::finish_speedtest(Interface& iface) {
+    SpeedtestStats &stats = iface.stats;
+    stats.kernel_drops = iface.net->kernel_drops();
+    iface.speedtests++;
+    iface.frames += stats.frames;
+    iface.validated += stats.validated;
+
+    std::string result;
+    {
+        CaptureStdout capture;
+        stats.print();
+        result = capture.str();
+    }
+    std::cout << result << std::flush;
+
+    if( !options.results_file.empty() ) {
+        std::ofstream results(options.results_file, std::ios::app);
+        stats.write_json(results);
+    }
+
+    notify(speedtest_waiters, result);
+    stats = SpeedtestStats();
+    stats.interface = iface.name;
+}
+
+
+void Daemon::print_interfaces() {
+    std::cout << std::left << std::setw(16) << "Interface" << std::setw(10) << "Accepted" << std::setw(10) << "Rejected"
+              << std::setw(12) << "Speedtests" << std::setw(12) << "Frames" << std::setw(12) << "Validated" << "Errors" << std::endl;
+    for(const auto &iface : interfaces) {
+        std::cout << std::setw(16) << iface->name << std::setw(10) << iface->accepted << std::setw(10) << iface->rejected
+                  << std::setw(12) << iface->speedtests << std::setw(12) << iface->frames << std::setw(12) << iface->validated
+                  << iface->errors << std::endl;
+    }
+    std::cout << std::right;
+}
+
+
+void Daemon::on_signal() {
+    struct signalfd_siginfo info;
+
+    while( read(signal_fd, &info, sizeof(info)) == sizeof(info) ) {
+        if(info.ssi_signo == SIGHUP) {
+            std::cout << "Reloading resource file" << std::endl;
+            reload();
+        } else {
+            running = false;
+        }
+    }
+}
+
+
+void Daemon::on_serial(uint32_t events) {
+    serial.handle_io(events & (EPOLLIN | EPOLLHUP | EPOLLERR), events & EPOLLOUT);
+
+    // A hung up port stays readable, stop watching it until the next reconnect
+    if( events & (EPOLLHUP | EPOLLERR) ) {
+        std::cerr << "Serial port closed, use reconnect\n";
+        unwatch(serial_fd);
+        serial_hung = serial_fd;
+        serial_fd = -1;
+    }
+}
+
+
+void Daemon::on_control() {
+    int client;
+    while( (client = accept4(control_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 ) {
+        try {
+            watch(client);
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            close(client);
+            continue;
+        }
+        clients[client].id = next_client_id++;
+    }
+}
+
+
+void Daemon::on_client(int fd) {
+    char buf[1024];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+    if(n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if(n <= 0) {
+        drop_client(fd);
+        return;
+    }
+
+    std::string &input = clients[fd].input;
+    input.append(buf, n);
+
+    size_t eol;
+    while( (eol = input.find('\n')) != std::string::npos ) {
+        std::string line = input.substr(0, eol);
+        input.erase(0, eol + 1);
+        if( !line.empty() && line.back() == '\r' ) line.pop_back();
+        if( line.empty() ) continue;
+
+        command(fd, line);
+    }
+
+    if(input.size() > MAX_COMMAND) {
+        drop_client(fd);
+    }
+}
+
+
+void Daemon::drop_client(int fd) {
+    unwatch(fd);
+    close(fd);
+    clients.erase(fd);
+    connect_waiters.erase( std::remove(connect_waiters.begin(), connect_waiters.end(), fd), connect_waiters.end() );
+    speedtest_waiters.erase( std::remove(speedtest_waiters.begin(), speedtest_waiters.end(), fd), speedtest_waiters.end() );
+}
+
+
+/* Runs one command and answers with its output. connect and speedtest answer later through notify,
+ * instructions for the slave once it replied. */
+void Daemon::command(int fd, const std::string& line) {
+    std::string output;
+    uint64_t id = clients[fd].id;
+
+    // Answers a client later, unless it went away in the meantime
+    auto answer = [this, fd, id](const std::string& text) {
+        auto client = clients.find(fd);
+        if(client != clients.end() && client->second.id == id) reply(fd, text);
+    };
+    auto unwait = [fd](std::vector<int>& waiters) {
+        waiters.erase( std::remove(waiters.begin(), waiters.end(), fd), waiters.end() );
+    };
+
+    // Instructions for the slave are skipped without a serial port, the supplicant may be driven otherwise
+    auto slave = [&](void (SerialMaster::*instruction)(SerialMaster::Reply), SerialMaster::Reply done) {
+        if(serial.fd() < 0) {
+            std::cerr << "Slave not connected, skipping " << line << '\n';
+            return false;
+        }
+        (serial.*instruction)(done);
+        return true;
+    };
+
+    try {
+        CaptureStdout capture;
+
+        if(line == "status") {
+            serial.show_status();
+            print_interfaces();
+            Metrics::print(std::cout);
+        } else if(line == "metrics") {
+            std::cout << Metrics::prometheus();
+        } else if(line == "connect") {
+            connect_waiters.push_back(fd);
+            slave(&SerialMaster::slave_connect, [this, answer, unwait](bool ok, const std::string& reply) {
+                if(ok) return;
+                unwait(connect_waiters);
+                answer("error: slave: " + reply + "\n");
+            });
+            return;
+        } else if(line == "register" || line.compare(0, 9, "register ") == 0) {
+            // The sign up is received on the named interface, the first one by default
+            std::string name = line.size() > 9 ? line.substr(9) : "";
+            auto iface = std::find_if(interfaces.begin(), interfaces.end(), [&](const std::unique_ptr<Interface>& i) {
+                return name.empty() || i->name == name;
+            });
+            if(iface == interfaces.end()) {
+                reply(fd, "error: unknown interface " + name + "\n");
+                return;
+            }
+
+            // Answered by handle_frame once the sign up arrives, or on timeout
+            Interface *target = iface->get();
+            if(target->sign_up_done) {
+                reply(fd, "error: sign up already pending on " + target->name + "\n");
+                return;
+            }
+            uint64_t sign_up_id = ++target->sign_up_id;
+            target->sign_up_done = answer;
+            target->sign_up_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SIGN_UP_TIMEOUT_MS);
+
+            slave(&SerialMaster::slave_sign_up, [target, sign_up_id](bool ok, const std::string& reply) {
+                if(ok || !target->sign_up_done || target->sign_up_id != sign_up_id) return;
+                auto done = std::move(target->sign_up_done);
+                target->sign_up_done = nullptr;
+                done("error: slave: " + reply + "\n");
+            });
+            return;
+        } else if(line == "speedtest") {
+            // Only count drops of this test
+            for(auto &iface : interfaces) {
+                if(!iface->stats.started) iface->net->kernel_drops();
+            }
+            speedtest_waiters.push_back(fd);
+            slave(&SerialMaster::slave_speedtest, [this, answer, unwait](bool ok, const std::string& reply) {
+                if(ok) {
+                    std::cout << "Slave: " << reply << std::endl;
+                    return;
+                }
+                unwait(speedtest_waiters);
+                answer("error: slave: " + reply + "\n");
+            });
+            return;
+        } else if(line == "reconnect") {
+            serial.reconnect();
+            serial_hung = -1;
+            update_serial();
+        } else if(line == "esp_status") {
+            bool sent = slave(&SerialMaster::slave_status, [answer](bool ok, const std::string& reply) {
+                answer(ok ? reply + "\nok\n" : "error: slave: " + reply + "\n");
+            });
+            if(!sent) reply(fd, "error: slave not connected\n");
+            return;
+        } else if(line == "reload") {
+            reload();
+        } else if(line == "exit") {
+            running = false;
+        } else {
+            reply(fd, capture.str() + "error: unknown command " + line + "\n");
+            return;
+        }
+
+        output = capture.str();
+    } catch(const puf::Exception &e) {
+        reply(fd, std::string("error: ") + e.what() + "\n");
+        return;
+    } catch(const std::exception &e) {
+        reply(fd, std::string("error: ") + e.what() + "\n");
+        return;
+    }
+
+    reply(fd, output + "ok\n");
+}
+
+
+void Daemon::reply(int fd, const std::string& text) {
+    size_t written = 0;
+    while(written < text.size()) {
+        ssize_t n = send(fd, text.data() + written, text.size() - written, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            // Slow or gone client, it notices the missing "ok" line
+            return;
+        }
+        written += n;
+    }
+}
+
+
+void Daemon::notify(std::vector<int>& waiters, const std::string& text) {
+    for(int fd : waiters) {
+        reply(fd, text + "ok\n");
+    }
+    waiters.clear();
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <sys/epoll.h>
+#include "Batch_Network.h"
+#include "Speedtest.h"
+#include "Serial_Master.h"
+#include "authenticator.h"
+
+
+struct DaemonOptions {
+    std::string control_socket;     // UNIX socket accepting commands, empty disables
+    std::string results_file;       // Append speedtest results as JSON lines, empty disables
+};
+
+
+/* Headless authenticator driven by a single epoll loop over the networks, the serial port, a signalfd and
+ * the control socket. Connection requests are accepted and speedtest frames validated whenever they arrive,
+ * on every added interface.
+ *
+ * The control socket takes one command per line and answers with its output followed by a line "ok" or
+ * "error: <reason>". Commands: status, metrics, connect, register [interface], speedtest, reconnect,
+ * esp_status, reload, exit. connect and speedtest answer once the next connection request was handled or
+ * the next speedtest finished on any interface, register once the sign up arrived on its interface, the first
+ * one by default. status includes the counters of each interface. A frame the authenticator fails on is
+ * counted as an error of its interface and skipped.
+ * SIGINT and SIGTERM stop the loop, SIGHUP reloads the resource file. */
+class Daemon {
+private:
+    /* One served interface with its own socket and authenticator context */
+    struct Interface {
+        std::string name;
+        BatchNetwork *net;
+        puf::Authenticator *au;
+        puf::PUF_Performance pp;
+        SpeedtestStats stats;       // Speedtest in progress
+        size_t accepted = 0;
+        size_t rejected = 0;
+        size_t speedtests = 0;
+        size_t frames = 0;          // Speedtest frames of all speedtests
+        size_t validated = 0;
+        size_t errors = 0;          // Frames the authenticator failed on
+
+        // Set while a register command waits for the sign up of the supplicant on this interface
+        std::function<void(const std::string&)> sign_up_done;
+        std::chrono::steady_clock::time_point sign_up_deadline;
+        uint64_t sign_up_id = 0;    // Tells a sign up from a later one
+    };
+
+    std::vector<std::unique_ptr<Interface>> interfaces;
+    puf::AuthenticationServer &as;
+    std::function<void()> reload;     // Applies changes of the resource file of the authentication server
+    SerialMaster &serial;
+    DaemonOptions options;
+
+    int epoll_fd;
+    int signal_fd;
+    int control_fd;
+    int serial_fd;          // Descriptor currently registered for the serial port
+    int serial_hung;        // Port descriptor that hung up, ignored until reconnect
+    uint32_t serial_events;
+    bool running;
+
+    struct Client {
+        uint64_t id;        // Tells a client from a later one on the same descriptor
+        std::string input;
+    };
+    uint64_t next_client_id;
+    std::map<int, Client> clients;
+    std::vector<int> connect_waiters;       // Clients waiting for the next connection request
+    std::vector<int> speedtest_waiters;     // Clients waiting for the end of the next speedtest
+
+    std::vector<FrameSlot> slots;
+
+    void watch(int fd, uint32_t events = EPOLLIN, int op = EPOLL_CTL_ADD);
+    void unwatch(int fd);
+    void update_serial();
+    void open_control_socket();
+
+    Interface* interface_of(int fd);
+    void on_frames(Interface& iface);
+    void on_signal();
+    void on_serial(uint32_t events);
+    void on_control();
+    void on_client(int fd);
+    void drop_client(int fd);
+
+    int timeout_ms() const;
+    void expire_sign_ups();
+
+    void handle_frame(Interface& iface, FrameSlot& slot);
+    void sign_up(Interface& iface, FrameSlot& slot);
+    void finish_speedtest(Interface& iface);
+    void print_interfaces();
+    void command(int fd, const std::string& line);
+    void reply(int fd, const std::string& text);
+    void notify(std::vector<int>& waiters, const std::string& text);
+
+public:
+    Daemon(puf::AuthenticationServer& as_, std::function<void()> reload_, SerialMaster& serial_, const DaemonOptions& options_);
+    ~Daemon();
+
+    /* Serves an interface through its own network and authenticator, all of them share the authentication server */
+    void add_interface(const std::string& name, BatchNetwork& net, puf::Authenticator& au);
+
+    /* Blocks the signals handled by the loop. Has to be called before any thread is started,
+     * threads inherit the mask and would otherwise receive them instead of the signalfd. */
+    static void block_signals();
+
+    /* Runs until a signal or the exit command stops it */
+    void run();
+};
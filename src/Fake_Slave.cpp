@@ -0,0 +1,125 @@
+#include "Fake_Slave.h"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/eventfd.h>
+
+
+constexpr char DELIM = ';';
+constexpr char EOL = '\x04';
+
+
+FakeSlave::FakeSlave(const std::string& name_) :
+    name(name_),
+    master_fd(-1),
+    stop_fd(-1)
+{}
+
+
+FakeSlave::~FakeSlave() {
+    stop();
+}
+
+
+void FakeSlave::start() {
+    if( (master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+        grantpt(master_fd) < 0 || unlockpt(master_fd) < 0 ) {
+        throw std::runtime_error( std::string("Error creating pseudo terminal: ") + strerror(errno) );
+    }
+
+    // Raw mode on the slave side, the master opens it with its own settings later
+    const char *slave_path = ptsname(master_fd);
+    struct termios tty;
+    if( tcgetattr(master_fd, &tty) == 0 ) {
+        cfmakeraw(&tty);
+        tcsetattr(master_fd, TCSANOW, &tty);
+    }
+    port = std::string(slave_path).substr(5);   // Strip "/dev/"
+
+    if( (stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating eventfd: ") + strerror(errno) );
+    }
+
+    slave = std::thread(&FakeSlave::run, this);
+}
+
+
+void FakeSlave::stop() {
+    if(slave.joinable()) {
+        uint64_t one = 1;
+        if( write(stop_fd, &one, sizeof(one)) < 0 ) {
+            std::cerr << "Error stopping fake slave: " << strerror(errno) << '\n';
+        }
+        slave.join();
+    }
+    if(master_fd >= 0) close(master_fd);
+    if(stop_fd >= 0) close(stop_fd);
+    master_fd = stop_fd = -1;
+}
+
+
+std::string FakeSlave::answer(const std::string& cmd) {
+    if(cmd == "connect") return "connect_ok\r";
+    if(cmd == "register") return "register_ok";
+    if(cmd == "status") return name + " is a fake slave";
+    if(cmd == "speedtest") return "speedtest_ok";
+
+    // Speedtest parameters ;seconds;delay_us;frame_size
+    if( !cmd.empty() && cmd[0] == DELIM ) {
+        int values[3] = {0, 0, 0};
+        std::istringstream iss(cmd.substr(1));
+        std::string value;
+        for(int i=0; i<3 && std::getline(iss, value, DELIM); ++i) {
+            values[i] = atoi(value.c_str());
+        }
+        return on_speedtest ? on_speedtest(values[0], values[1], values[2]) : name + " sent 0 frames";
+    }
+
+    return "unknown command";
+}
+
+
+void FakeSlave::run() {
+    struct pollfd fds[2] = {
+        { stop_fd, POLLIN, 0 },
+        { master_fd, POLLIN, 0 },
+    };
+    std::string input;
+    char buf[256];
+
+    while(true) {
+        if( poll(fds, 2, -1) < 0 ) {
+            if(errno == EINTR) continue;
+            std::cerr << "Error in fake slave: " << strerror(errno) << '\n';
+            return;
+        }
+        if(fds[0].revents) return;
+
+        // POLLHUP without data just means nobody has the slave side open yet
+        if( !(fds[1].revents & POLLIN) ) {
+            usleep(10000);
+            continue;
+        }
+
+        ssize_t n = read(master_fd, buf, sizeof(buf));
+        if(n <= 0) continue;
+        input.append(buf, n);
+
+        size_t eol;
+        while( (eol = input.find(EOL)) != std::string::npos ) {
+            std::string reply = answer( input.substr(0, eol) ) + EOL;
+            input.erase(0, eol + 1);
+            if( write(master_fd, reply.data(), reply.size()) < 0 ) {
+                std::cerr << "Error answering in fake slave: " << strerror(errno) << '\n';
+            }
+        }
+    }
+}
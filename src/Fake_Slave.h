@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <functional>
+
+
+/* Stand-in for an ESP slave on a pseudo terminal, so serial orchestration runs without hardware.
+ * Answers connect, register, status and speedtest like the slave firmware. The speedtest parameters
+ * are passed to the speedtest handler, whose return value is sent as the slave's report. */
+class FakeSlave {
+public:
+    using Speedtest = std::function<std::string(int seconds, int delay_us, int frame_size)>;
+
+private:
+    std::string name;
+    int master_fd;
+    int stop_fd;
+    std::string port;           // Relative to /dev like the ports of SerialMaster
+    Speedtest on_speedtest;
+    std::thread slave;
+
+    void run();
+    std::string answer(const std::string& cmd);
+
+public:
+    FakeSlave(const std::string& name_);
+    ~FakeSlave();
+    FakeSlave(const FakeSlave&) = delete;
+    FakeSlave& operator=(const FakeSlave&) = delete;
+
+    void start();
+    void stop();
+    const std::string& get_port() const { return port; }
+    void set_speedtest_handler(Speedtest handler) { on_speedtest = handler; }
+};
@@ -0,0 +1,126 @@
+#include "Fanout_Workers.h"
+#include "Metrics.h"
+#include "errors.h"
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <pthread.h>
+#include <unistd.h>
+
+
+FanoutWorkers::FanoutWorkers(const std::string& iface_name, const BerkeleyOptions& options, puf::AuthenticationServer& as, int n_workers) {
+    BerkeleyOptions worker_opts = options;
+    worker_opts.fanout_group = getpid() & 0xffff;
+    worker_opts.fanout_members = n_workers;
+
+    workers.resize(n_workers);
+    for(auto &worker : workers) {
+        worker.net = std::make_unique<BerkeleyNetwork>(iface_name.c_str(), worker_opts);
+        worker.au = std::make_unique<puf::Authenticator>(*worker.net, as);
+    }
+}
+
+
+void FanoutWorkers::init() {
+    for(auto &worker : workers) {
+        worker.au->init();
+    }
+}
+
+
+SpeedtestStats FanoutWorkers::speedtest(int senders, SpeedtestPoll poll) {
+    std::atomic<int> finished_senders(0);
+    std::atomic<bool> failed(false);
+    std::atomic<bool> stopped(false);
+    std::exception_ptr error;
+    std::mutex error_lock;
+    std::vector<std::thread> threads;
+    unsigned int n_cpus = std::thread::hardware_concurrency();
+    SpeedtestWatch watch(poll);
+
+    // The calling thread watches the deadline and runs the poll hook until all workers are done
+    size_t running = workers.size();
+    std::mutex running_lock;
+    std::condition_variable exited;
+
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if(!error) error = std::current_exception();
+        failed.store(true, std::memory_order_relaxed);
+    };
+
+    for(size_t i=0; i<workers.size(); ++i) {
+        threads.emplace_back([&, i]() {
+            constexpr size_t BATCH_SIZE = 32;
+            std::vector<FrameSlot> slots(BATCH_SIZE);
+            puf::PUF_Performance pp;
+            auto &worker = workers[i];
+
+            // Any other error ends the test on all workers and is rethrown to the caller, like run_speedtest does
+            try {
+                worker.stats = SpeedtestStats();
+                worker.net->kernel_drops();
+                while(finished_senders.load(std::memory_order_relaxed) < senders && !failed.load(std::memory_order_relaxed)
+                      && !stopped.load(std::memory_order_relaxed)) {
+                    size_t n;
+                    try {
+                        if( !SpeedtestWatch::wait(*worker.net) ) continue;
+                        StageTimer timer(Metrics::RECEIVE);
+                        n = worker.net->receive_batch(slots.data(), slots.size());
+                    } catch(const puf::NetworkException &e) {
+                        continue;   // Idle worker, the deadline is up to the calling thread
+                    }
+                    if(n > 0) watch.received();
+
+                    for(size_t j=0; j<n; ++j) {
+                        if( speedtest_frame(slots[j].data, slots[j].len, slots[j].timestamp_ns, pp, *worker.au, worker.stats) ) {
+                            finished_senders.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                }
+                worker.stats.kernel_drops = worker.net->kernel_drops();
+            } catch(...) {
+                fail();
+            }
+
+            std::lock_guard<std::mutex> guard(running_lock);
+            running--;
+            exited.notify_one();
+        });
+
+        if(n_cpus) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(i % n_cpus, &cpuset);
+            if( pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpu_set_t), &cpuset) != 0 ) {
+                std::cerr << "Could not pin worker " << i << '\n';
+            }
+        }
+    }
+
+    try {
+        std::unique_lock<std::mutex> lk(running_lock);
+        while( !exited.wait_for(lk, std::chrono::milliseconds(SPEEDTEST_TICK_MS), [&running]() { return running == 0; }) ) {
+            lk.unlock();
+            if( !watch.keep_going() ) stopped.store(true, std::memory_order_relaxed);
+            lk.lock();
+        }
+    } catch(...) {
+        fail();
+    }
+
+    SpeedtestStats retval;
+    for(size_t i=0; i<threads.size(); ++i) {
+        threads[i].join();
+        std::cout << "Worker " << i << ":\t" << workers[i].stats.frames << " frames" << std::endl;
+        retval.merge(workers[i].stats);
+    }
+
+    if(error) std::rethrow_exception(error);
+    return retval;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include "Berkeley_Network.h"
+#include "Speedtest.h"
+#include "authenticator.h"
+
+
+/* N raw sockets on one interface joined in a fanout group that splits traffic by source MAC. Each socket is served by its
+ * own thread and Authenticator pinned to its own core, all sharing one authentication server. */
+class FanoutWorkers {
+private:
+    struct Worker {
+        std::unique_ptr<BerkeleyNetwork> net;
+        std::unique_ptr<puf::Authenticator> au;
+        SpeedtestStats stats;
+    };
+
+    std::vector<Worker> workers;
+
+public:
+    FanoutWorkers(const std::string& iface_name, const BerkeleyOptions& options, puf::AuthenticationServer& as, int n_workers);
+    void init();
+
+    /* Runs a speedtest on all workers until `senders` supplicants sent their last frame, poll returned false or
+     * nothing arrived for SPEEDTEST_IDLE_MS */
+    SpeedtestStats speedtest(int senders = 1, SpeedtestPoll poll = nullptr);
+};
@@ -0,0 +1,188 @@
+#include "Load_Test.h"
+#include "Admission_Control.h"
+#include "Speedtest.h"
+#include "Metrics.h"
+#include "packets.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+
+constexpr size_t BATCH_SIZE = 32;
+constexpr int CONNECT_TIMEOUT_MS = 10000;
+constexpr int TICK_MS = 100;            // Longest sleep, the end conditions depend on time as well
+
+
+static uint64_t source_of(const uint8_t *frame) {
+    uint64_t retval = 0;
+    for(int i=6; i<12; ++i) retval = (retval << 8) | frame[i];
+    return retval;
+}
+
+
+static std::string mac_string(uint64_t mac) {
+    std::ostringstream oss;
+    for(int i=5; i>=0; --i) {
+        oss << std::hex << std::setw(2) << std::setfill('0') << ((mac >> (8*i)) & 0xff) << (i ? ":" : "");
+    }
+    return oss.str();
+}
+
+
+static void print_results(const char *phase, const std::vector<SerialFleet::Result>& results) {
+    std::cout << phase << std::endl;
+    for(const auto &result : results) {
+        std::cout << "  " << std::left << std::setw(16) << result.port << std::setw(8) << (result.ok ? "ok" : "failed")
+                  << result.reply << std::right << std::endl;
+    }
+}
+
+
+/* Receives frames and serves the serial ports until finished returns true or timeout_ms passed (-1 waits forever) */
+static void pump(BatchNetwork& net, SerialFleet& fleet, const std::function<void(FrameSlot&)>& on_frame,
+                 const std::function<bool()>& finished, int timeout_ms) {
+    using namespace std::chrono;
+    auto deadline = steady_clock::now() + milliseconds(timeout_ms);
+    std::vector<FrameSlot> slots(BATCH_SIZE);
+    std::vector<struct pollfd> fds;
+
+    while( !finished() ) {
+        int timeout = fleet.timeout_ms();
+        if(timeout < 0 || timeout > TICK_MS) timeout = TICK_MS;
+        if(timeout_ms >= 0) {
+            auto left = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+            if(left <= 0) return;
+            if(left < timeout) timeout = static_cast<int>(left);
+        }
+
+        fds.clear();
+        fds.push_back({ net.poll_fd(), POLLIN, 0 });
+        fleet.add_pollfds(fds);
+
+        int n = poll(fds.data(), fds.size(), timeout);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            throw std::runtime_error( std::string("Error polling: ") + strerror(errno) );
+        }
+
+        if(fds[0].revents & POLLIN) {
+            do {
+                size_t received;
+                {
+                    StageTimer timer(Metrics::RECEIVE);
+                    received = net.receive_batch(slots.data(), slots.size());
+                }
+                for(size_t i=0; i<received; ++i) {
+                    on_frame(slots[i]);
+                }
+            } while( net.buffered() );
+        }
+        fleet.handle_pollfds(fds, 1);
+        fleet.expire();
+    }
+}
+
+
+void run_load_test(BatchNetwork& net, puf::Authenticator& au, SerialFleet& fleet, const LoadTestOptions& options) {
+    using namespace puf;
+    using namespace std::chrono;
+
+    if( net.poll_fd() < 0 ) {
+        throw std::runtime_error("The network backend cannot be polled, the load test is not available");
+    }
+
+    std::vector<SerialFleet::Result> results;
+    bool done = false;
+    auto collect = [&](const std::vector<SerialFleet::Result>& r) {
+        results = r;
+        done = true;
+    };
+    auto succeeded = [&]() {
+        return static_cast<size_t>( std::count_if(results.begin(), results.end(), [](const SerialFleet::Result& r) { return r.ok; }) );
+    };
+
+    // Sign ups are taken one after the other, the slaves only get triggered together
+    if(options.sign_up) {
+        fleet.sign_up_all(collect);
+        fleet.wait_for(done);
+        print_results("Register", results);
+        for(size_t i=0; i<succeeded(); ++i) {
+            au.sign_up();
+        }
+    }
+
+    // Connect all slaves and accept their requests as they come in
+    std::map<uint64_t, bool> connections;
+    done = false;
+    fleet.connect_all(collect);
+    pump(net, fleet, [&](FrameSlot& slot) {
+        if(deduce_type(slot.data, slot.len) != PUF_CON_E || !AdmissionControl::admit(slot.data, slot.len)) return;
+        StageTimer timer(Metrics::ACCEPT);
+        connections[source_of(slot.data)] = (au.accept(slot.data, slot.len) == 0);
+    }, [&]() { return done && connections.size() >= succeeded(); }, CONNECT_TIMEOUT_MS);
+
+    print_results("Connect", results);
+    for(const auto &connection : connections) {
+        std::cout << "  " << mac_string(connection.first) << (connection.second ? " accepted" : " rejected") << std::endl;
+    }
+
+    // Speedtest of all slaves at once, validated per source
+    std::map<uint64_t, SpeedtestStats> sources;
+    size_t finished = 0;
+    PUF_Performance pp;
+    steady_clock::time_point reported;
+
+    done = false;
+    net.kernel_drops();
+    fleet.speedtest_all([&](const std::vector<SerialFleet::Result>& r) {
+        collect(r);
+        reported = steady_clock::now();
+    });
+    pump(net, fleet, [&](FrameSlot& slot) {
+        uint64_t source = source_of(slot.data);
+        auto it = sources.find(source);
+        if(it == sources.end()) {
+            // Only speedtest frames make a source, other traffic on the link would hold up the end of the test
+            if(deduce_type(slot.data, slot.len) != PUF_PERFORMANCE_E) return;
+            it = sources.emplace(source, SpeedtestStats()).first;
+        }
+
+        SpeedtestStats &stats = it->second;
+        if( !stats.finished && speedtest_frame(slot.data, slot.len, slot.timestamp_ns, pp, au, stats) ) {
+            finished++;
+        }
+    }, [&]() {
+        // Frames may still be on their way when the slaves report
+        return done && (finished >= std::max(succeeded(), sources.size()) ||
+                        steady_clock::now() - reported > milliseconds(options.grace_ms));
+    }, -1);
+    uint64_t kernel_drops = net.kernel_drops();
+
+    print_results("Speedtest", results);
+
+    SpeedtestStats total;
+    std::ofstream json;
+    if( !options.results_file.empty() ) {
+        json.open(options.results_file, std::ios::app);
+    }
+    for(auto &source : sources) {
+        source.second.source = mac_string(source.first);
+        std::cout << std::endl;
+        source.second.print();
+        if(json.is_open()) source.second.write_json(json);
+        total.merge(source.second);
+    }
+
+    total.kernel_drops = kernel_drops;
+    std::cout << "\nAll " << sources.size() << " sources" << std::endl;
+    total.print();
+    if(json.is_open()) total.write_json(json);
+}
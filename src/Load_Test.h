@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include "Batch_Network.h"
+#include "Serial_Fleet.h"
+#include "authenticator.h"
+
+
+struct LoadTestOptions {
+    bool sign_up = false;       // Register all slaves before connecting them
+    int grace_ms = 1000;        // Wait this long for outstanding frames after the last slave reported
+    std::string results_file;   // Append one JSON line per source, empty disables
+};
+
+
+/* Parallel load test: connects all slaves of the fleet, starts their speedtests at the same time and
+ * validates the frames of all of them on one network. Prints each slave's own report next to the
+ * authenticator's results per source MAC. */
+void run_load_test(BatchNetwork& net, puf::Authenticator& au, SerialFleet& fleet, const LoadTestOptions& options);
@@ -0,0 +1,121 @@
+#include "Loopback_Network.h"
+
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+
+
+LoopbackNetwork::LoopbackNetwork(size_t capacity_) :
+    capacity(capacity_),
+    input_closed(false),
+    shut_down(false),
+    sent_frames(0)
+{}
+
+
+bool LoopbackNetwork::inject(const uint8_t *frame, size_t len) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    std::unique_lock<std::mutex> lk(lock);
+    writable.wait(lk, [this]() { return inbound.size() < capacity || shut_down; });
+    if(shut_down) return false;
+
+    inbound.push_back( Frame{ std::vector<uint8_t>(frame, frame + len), now.tv_sec * 1000000000ULL + now.tv_nsec } );
+    readable.notify_one();
+    return true;
+}
+
+
+void LoopbackNetwork::close_input() {
+    std::lock_guard<std::mutex> guard(lock);
+    input_closed = true;
+    readable.notify_all();
+}
+
+
+void LoopbackNetwork::shutdown() {
+    std::lock_guard<std::mutex> guard(lock);
+    input_closed = true;
+    shut_down = true;
+    inbound.clear();
+    readable.notify_all();
+    writable.notify_all();
+}
+
+
+/* Waits for a frame, like a socket with receive timeout if timeout is set. False at the end of the input. */
+bool LoopbackNetwork::wait_inbound(std::unique_lock<std::mutex>& lk, bool timeout) {
+    auto ready = [this]() { return !inbound.empty() || input_closed; };
+
+    if(!timeout) {
+        readable.wait(lk, ready);
+    } else if( !readable.wait_for(lk, std::chrono::milliseconds(NETWORK_TIMEOUT_MS), ready) ) {
+        throw puf::NetworkException("Timeout");
+    }
+    return !inbound.empty();
+}
+
+
+void LoopbackNetwork::pop_inbound(uint8_t *buf, size_t bufSize, size_t& len, uint64_t& timestamp_ns) {
+    auto &frame = inbound.front();
+    len = std::min(frame.data.size(), bufSize);
+    memcpy(buf, frame.data.data(), len);
+    timestamp_ns = frame.timestamp_ns;
+    inbound.pop_front();
+}
+
+
+int LoopbackNetwork::receive(uint8_t *buf, size_t bufSize) {
+    std::unique_lock<std::mutex> lk(lock);
+    size_t len;
+    uint64_t timestamp_ns;
+
+    if( !wait_inbound(lk, true) ) {
+        throw puf::NetworkException("End of input");
+    }
+    pop_inbound(buf, bufSize, len, timestamp_ns);
+    writable.notify_one();
+    return len;
+}
+
+
+int LoopbackNetwork::receive_batch(FrameSlot *slots, size_t count) {
+    std::unique_lock<std::mutex> lk(lock);
+    size_t n = 0;
+
+    if(count == 0 || !wait_inbound(lk, false)) return 0;
+
+    for(; n < count && !inbound.empty(); ++n) {
+        pop_inbound(slots[n].data, sizeof(slots[n].data), slots[n].len, slots[n].timestamp_ns);
+    }
+    writable.notify_all();
+    return n;
+}
+
+
+void LoopbackNetwork::send(uint8_t *buf, size_t bufSize) {
+    std::lock_guard<std::mutex> guard(lock);
+    if(outbound.size() >= capacity) outbound.pop_front();
+    outbound.push_back( Frame{ std::vector<uint8_t>(buf, buf + bufSize), 0 } );
+    sent_frames++;
+}
+
+
+int LoopbackNetwork::send_batch(FrameSlot *slots, size_t count) {
+    for(size_t i=0; i<count; ++i) {
+        send(slots[i].data, slots[i].len);
+    }
+    return count;
+}
+
+
+bool LoopbackNetwork::take_sent(std::vector<uint8_t>& frame) {
+    std::lock_guard<std::mutex> guard(lock);
+    if(outbound.empty()) return false;
+
+    frame.swap(outbound.front().data);
+    outbound.pop_front();
+    return true;
+}
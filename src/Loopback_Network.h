@@ -0,0 +1,60 @@
+#pragma once
+
+#include "platform.h"
+#include "Batch_Network.h"
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+
+/* Network on in-memory queues, for running the authenticator without a NIC or CAP_NET_RAW.
+ *
+ * Frames handed to inject() are received in order. receive blocks like a socket and times out after
+ * NETWORK_TIMEOUT_MS, receive_batch waits as long as the input is open, so gaps in the input never end a
+ * batch receiver. Once close_input() was called and all frames are consumed, receive_batch returns 0.
+ * Sent frames are kept for inspection up to the queue capacity, older ones are dropped and only counted. */
+class LoopbackNetwork : public BatchNetwork {
+private:
+    struct Frame {
+        std::vector<uint8_t> data;
+        uint64_t timestamp_ns;
+    };
+
+    size_t capacity;
+    std::mutex lock;
+    std::condition_variable readable;
+    std::condition_variable writable;
+    std::deque<Frame> inbound;
+    std::deque<Frame> outbound;
+    bool input_closed;
+    bool shut_down;
+    std::atomic<size_t> sent_frames;
+
+    bool wait_inbound(std::unique_lock<std::mutex>& lk, bool timeout);
+    void pop_inbound(uint8_t *buf, size_t bufSize, size_t& len, uint64_t& timestamp_ns);
+
+public:
+    LoopbackNetwork(size_t capacity_ = 4096);
+    void init() override {}
+    void send(uint8_t *buf, size_t bufSize) override;
+    int receive(uint8_t *buf, size_t bufSize) override;
+    int receive_batch(FrameSlot *slots, size_t count) override;
+    int send_batch(FrameSlot *slots, size_t count) override;
+
+    /* Queues a frame for receiving, blocks while the inbound queue is full. Stamped with the current time
+     * in place of a kernel receive timestamp. False if the network was shut down, the frame is dropped. */
+    bool inject(const uint8_t *frame, size_t len);
+
+    /* No more frames will be injected, receivers drain the queue and then see the end */
+    void close_input();
+
+    /* Closes the input and drops what is queued, blocked injectors return at once */
+    void shutdown();
+
+    /* Oldest sent frame still kept, false if there is none */
+    bool take_sent(std::vector<uint8_t>& frame);
+    size_t sent() const { return sent_frames; }
+};
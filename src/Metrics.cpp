@@ -0,0 +1,365 @@
+#include "Metrics.h"
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/* ----------------------------------------- Metrics Implementation ---------------------------------------*/
+
+namespace {
+
+// Counters of one thread, only ever written by that thread
+struct ThreadBlock {
+    std::atomic<uint64_t> count[Metrics::STAGE_COUNT];
+    std::atomic<uint64_t> sum_ns[Metrics::STAGE_COUNT];
+    std::atomic<uint64_t> buckets[Metrics::STAGE_COUNT][Metrics::BUCKETS];
+    std::atomic<uint64_t> counters[Metrics::COUNTER_COUNT];
+};
+
+std::mutex registry_lock;
+std::vector<std::unique_ptr<ThreadBlock>> registry;
+std::vector<ThreadBlock*> idle_blocks;      // Blocks of exited threads, reused by new threads
+
+
+// Hands the block back when its thread exits. The counts stay in the block, so they remain part of the totals
+// and the next thread using the block simply adds to them.
+struct BlockLease {
+    ThreadBlock *block = nullptr;
+
+    ~BlockLease() {
+        if(!block) return;
+        std::lock_guard<std::mutex> guard(registry_lock);
+        idle_blocks.push_back(block);
+    }
+};
+
+
+ThreadBlock* local_block() {
+    thread_local BlockLease lease;
+
+    if(!lease.block) {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        if( !idle_blocks.empty() ) {
+            lease.block = idle_blocks.back();
+            idle_blocks.pop_back();
+        } else {
+            registry.push_back( std::make_unique<ThreadBlock>() );     // Value initialised, all counters zero
+            lease.block = registry.back().get();
+        }
+    }
+    return lease.block;
+}
+
+
+// Single writer, a load and a store are enough and avoid the locked read-modify-write
+inline void bump(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+}
+
+
+size_t Metrics::bucket_of(uint64_t ns) {
+    if(ns < SUB_BUCKETS) return ns;
+
+    size_t msb = 63 - __builtin_clzll(ns);
+    size_t bucket = (msb - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return std::min(bucket, BUCKETS - 1);
+}
+
+
+uint64_t Metrics::bucket_upper(size_t bucket) {
+    if(bucket < SUB_BUCKETS) return bucket + 1;
+
+    size_t msb = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (msb - SUB_BITS);
+}
+
+
+void Metrics::record(Stage stage, uint64_t ns) {
+    ThreadBlock *block = local_block();
+    bump(block->count[stage], 1);
+    bump(block->sum_ns[stage], ns);
+    bump(block->buckets[stage][bucket_of(ns)], 1);
+}
+
+
+void Metrics::count(Counter counter, uint64_t n) {
+    bump(local_block()->counters[counter], n);
+}
+
+
+uint64_t Metrics::total(Counter counter) {
+    uint64_t retval = 0;
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    for(const auto &block : registry) {
+        retval += block->counters[counter].load(std::memory_order_relaxed);
+    }
+    return retval;
+}
+
+
+Metrics::Histogram Metrics::histogram(Stage stage) {
+    Histogram retval;
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    for(const auto &block : registry) {
+        retval.count += block->count[stage].load(std::memory_order_relaxed);
+        retval.sum_ns += block->sum_ns[stage].load(std::memory_order_relaxed);
+        for(size_t i=0; i<BUCKETS; ++i) {
+            retval.buckets[i] += block->buckets[stage][i].load(std::memory_order_relaxed);
+        }
+    }
+    return retval;
+}
+
+
+void Metrics::Histogram::add(uint64_t ns) {
+    count++;
+    sum_ns += ns;
+    buckets[bucket_of(ns)]++;
+}
+
+
+void Metrics::Histogram::merge(const Histogram& other) {
+    count += other.count;
+    sum_ns += other.sum_ns;
+    for(size_t i=0; i<BUCKETS; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+
+double Metrics::Histogram::percentile(double p) const {
+    uint64_t total = 0;
+    for(auto n : buckets) total += n;
+    if(total == 0) return 0;
+
+    uint64_t rank = static_cast<uint64_t>(p / 100 * total), seen = 0;
+    for(size_t i=0; i<BUCKETS; ++i) {
+        seen += buckets[i];
+        if(seen > rank) return bucket_upper(i);
+    }
+    return bucket_upper(BUCKETS - 1);
+}
+
+
+const char* Metrics::stage_name(Stage stage) {
+    static const char* names[STAGE_COUNT] = {
+        "receive", "deduce_type", "from_binary", "validate", "accept", "query", "sync"
+    };
+    return names[stage];
+}
+
+
+const char* Metrics::counter_name(Counter counter) {
+    static const char* names[COUNTER_COUNT] = {
+        "session_hit", "session_miss", "session_evict",
+        "remote_hit", "remote_miss", "remote_evict", "remote_leased", "filter_reject", "admission_drop"
+    };
+    return names[counter];
+}
+
+
+std::string Metrics::prometheus() {
+    std::ostringstream oss;
+
+    oss << "# HELP au_stage_duration_seconds Time spent in a hot path stage\n";
+    oss << "# TYPE au_stage_duration_seconds histogram\n";
+    for(int s=0; s<STAGE_COUNT; ++s) {
+        Histogram hist = histogram( static_cast<Stage>(s) );
+        const char *name = stage_name( static_cast<Stage>(s) );
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+
+        // Export power of two boundaries from 1 us to 64 s, the fine buckets only feed the percentiles
+        for(int exp=10; exp<=36; ++exp) {
+            for(; bucket < BUCKETS && bucket_upper(bucket) <= (1ULL << exp); ++bucket) {
+                cumulative += hist.buckets[bucket];
+            }
+            oss << "au_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\"" << (1ULL << exp) * 1e-9 << "\"} " << cumulative << '\n';
+        }
+        oss << "au_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\"+Inf\"} " << hist.count << '\n';
+        oss << "au_stage_duration_seconds_sum{stage=\"" << name << "\"} " << hist.sum_ns * 1e-9 << '\n';
+        oss << "au_stage_duration_seconds_count{stage=\"" << name << "\"} " << hist.count << '\n';
+    }
+
+    oss << "# HELP au_events_total Occurrences of an event on the hot path\n";
+    oss << "# TYPE au_events_total counter\n";
+    for(int c=0; c<COUNTER_COUNT; ++c) {
+        oss << "au_events_total{event=\"" << counter_name( static_cast<Counter>(c) ) << "\"} " << total( static_cast<Counter>(c) ) << '\n';
+    }
+    return oss.str();
+}
+
+
+void Metrics::print(std::ostream& os) {
+    os << std::left << std::setw(14) << "Stage" << std::right << std::setw(12) << "Count"
+       << std::setw(12) << "Mean [us]" << std::setw(12) << "p50 [us]" << std::setw(12) << "p99 [us]" << std::setw(12) << "p99.9 [us]" << '\n';
+
+    for(int s=0; s<STAGE_COUNT; ++s) {
+        Histogram hist = histogram( static_cast<Stage>(s) );
+        double mean = hist.count ? static_cast<double>(hist.sum_ns) / hist.count : 0;
+
+        os << std::left << std::setw(14) << stage_name( static_cast<Stage>(s) ) << std::right << std::setw(12) << hist.count
+           << std::fixed << std::setprecision(2)
+           << std::setw(12) << mean / 1000 << std::setw(12) << hist.percentile(50) / 1000
+           << std::setw(12) << hist.percentile(99) / 1000 << std::setw(12) << hist.percentile(99.9) / 1000 << '\n';
+        os.unsetf(std::ios::fixed);
+    }
+
+    auto print_cache = [&os](const char *name, Counter hit, Counter miss, Counter evict) {
+        uint64_t hits = total(hit), misses = total(miss);
+        if(hits + misses == 0) return;
+
+        os << name << ": " << hits << " hits, " << misses << " misses, " << total(evict) << " evictions ("
+           << std::fixed << std::setprecision(1) << 100.0 * hits / (hits + misses) << "% hit rate)\n";
+        os.unsetf(std::ios::fixed);
+    };
+    print_cache("Session cache", SESSION_HIT, SESSION_MISS, SESSION_EVICT);
+    print_cache("Remote cache", REMOTE_HIT, REMOTE_MISS, REMOTE_EVICT);
+    if( uint64_t leased = total(REMOTE_LEASED) ) os << "Counter decrements served from leases: " << leased << '\n';
+    if( uint64_t rejected = total(FILTER_REJECT) ) os << "Unknown MACs rejected by the filter: " << rejected << '\n';
+    if( uint64_t dropped = total(ADMISSION_DROP) ) os << "Frames over the admission budget of their source: " << dropped << '\n';
+}
+
+
+
+/* -------------------------------------- MetricsServer Implementation ---------------------------------------*/
+
+MetricsServer::MetricsServer(const std::string& unix_path_, int tcp_port_) :
+    unix_path(unix_path_),
+    tcp_port(tcp_port_),
+    unix_fd(-1),
+    tcp_fd(-1),
+    stop_fd(-1)
+{}
+
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+
+void MetricsServer::start() {
+    if( !unix_path.empty() ) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(unix_path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Metrics socket path too long: " + unix_path);
+        }
+        strcpy(addr.sun_path, unix_path.c_str());
+
+        unlink(unix_path.c_str());
+        if( (unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+            bind(unix_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(unix_fd, 8) < 0 ) {
+            throw std::runtime_error( "Error opening metrics socket " + unix_path + ": " + strerror(errno) );
+        }
+    }
+
+    if(tcp_port > 0) {
+        struct sockaddr_in addr;
+        int one = 1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(tcp_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if( (tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+            setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(tcp_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(tcp_fd, 8) < 0 ) {
+            throw std::runtime_error( "Error opening metrics port " + std::to_string(tcp_port) + ": " + strerror(errno) );
+        }
+    }
+
+    if( (stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating eventfd: ") + strerror(errno) );
+    }
+
+    server = std::thread(&MetricsServer::run, this);
+}
+
+
+void MetricsServer::stop() {
+    if(server.joinable()) {
+        uint64_t one = 1;
+        if( write(stop_fd, &one, sizeof(one)) < 0 ) {
+            std::cerr << "Error stopping metrics server: " << strerror(errno) << '\n';
+        }
+        server.join();
+    }
+
+    if(unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path.c_str());
+    }
+    if(tcp_fd >= 0) close(tcp_fd);
+    if(stop_fd >= 0) close(stop_fd);
+    unix_fd = tcp_fd = stop_fd = -1;
+}
+
+
+void MetricsServer::respond(int client) {
+    char request[1024];
+    struct timeval timeout = {0, 100000};
+
+    // Any request gets the metrics, read whatever the client sends first so closing does not reset the connection
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if( recv(client, request, sizeof(request), 0) < 0 && errno != EAGAIN ) return;
+
+    std::string body = Metrics::prometheus();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                           + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+    size_t written = 0;
+    while(written < response.size()) {
+        ssize_t n = send(client, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        written += n;
+    }
+}
+
+
+void MetricsServer::run() {
+    struct pollfd fds[3] = {
+        { stop_fd, POLLIN, 0 },
+        { unix_fd, POLLIN, 0 },
+        { tcp_fd, POLLIN, 0 },
+    };
+
+    while(true) {
+        if( poll(fds, 3, -1) < 0 ) {
+            if(errno == EINTR) continue;
+            std::cerr << "Error serving metrics: " << strerror(errno) << '\n';
+            return;
+        }
+        if(fds[0].revents) return;
+
+        for(int i=1; i<3; ++i) {
+            if( !(fds[i].revents & POLLIN) ) continue;
+            int client = accept4(fds[i].fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if(client < 0) continue;
+            respond(client);
+            close(client);
+        }
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <ostream>
+#include <cstdint>
+
+
+/* Latency histograms of the hot path stages.
+ *
+ * Every thread records into its own block of counters, taken on the first record, so recording is a plain relaxed
+ * store without locks or contended cache lines. A thread hands its block to the next new thread when it exits, so the
+ * number of blocks is bounded by the number of threads alive at once. Readers sum up all blocks. Buckets are log-linear:
+ * 8 sub-buckets per power of two, i.e. every value is accurate to 12.5%, from 1 ns to about 18 minutes. */
+class Metrics {
+public:
+    enum Stage {
+        RECEIVE,
+        DEDUCE_TYPE,
+        FROM_BINARY,
+        VALIDATE,
+        ACCEPT,
+        QUERY,
+        SYNC,
+        STAGE_COUNT
+    };
+
+    enum Counter {
+        SESSION_HIT,
+        SESSION_MISS,
+        SESSION_EVICT,
+        REMOTE_HIT,
+        REMOTE_MISS,
+        REMOTE_EVICT,
+        REMOTE_LEASED,
+        FILTER_REJECT,
+        ADMISSION_DROP,
+        COUNTER_COUNT
+    };
+
+    static constexpr size_t SUB_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (40 - SUB_BITS + 2) * SUB_BUCKETS;
+
+    struct Histogram {
+        uint64_t count = 0;
+        uint64_t sum_ns = 0;
+        std::array<uint64_t, BUCKETS> buckets{};
+
+        void add(uint64_t ns);
+        void merge(const Histogram& other);
+        double percentile(double p) const;     // Upper bound of the bucket holding the p-th percentile [ns]
+    };
+
+    static void record(Stage stage, uint64_t ns);
+    static Histogram histogram(Stage stage);
+    static const char* stage_name(Stage stage);
+    static size_t bucket_of(uint64_t ns);
+    static uint64_t bucket_upper(size_t bucket);
+
+    /* Plain event counters, recorded the same way as the histograms */
+    static void count(Counter counter, uint64_t n = 1);
+    static uint64_t total(Counter counter);
+    static const char* counter_name(Counter counter);
+
+    /* All histograms in Prometheus text exposition format */
+    static std::string prometheus();
+
+    /* Human readable summary for the status menu */
+    static void print(std::ostream& os);
+};
+
+
+/* Records the time from construction to destruction for one stage */
+class StageTimer {
+private:
+    Metrics::Stage stage;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    StageTimer(Metrics::Stage stage_) : stage(stage_), start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        Metrics::record(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+
+/* Serves Metrics::prometheus() over HTTP on a UNIX socket and/or a TCP port bound to localhost */
+class MetricsServer {
+private:
+    std::string unix_path;
+    int tcp_port;
+    int unix_fd;
+    int tcp_fd;
+    int stop_fd;
+    std::thread server;
+
+    void run();
+    void respond(int client);
+
+public:
+    MetricsServer(const std::string& unix_path_, int tcp_port_);
+    ~MetricsServer();
+    void start();
+    void stop();
+};
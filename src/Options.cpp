@@ -1,6 +1,27 @@
 #include "Options.h"
+#include "Admission_Control.h"
 #include <boost/program_options.hpp>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+
+
+static std::array<uint8_t, 6> parse_mac(const std::string& str) {
+    std::array<uint8_t, 6> mac;
+    std::istringstream iss(str);
+    char delim_void = '\0';
+
+    for(size_t i=0; i<mac.size(); ++i) {
+        int byte = -1;
+        iss >> std::hex >> byte;
+        if( iss.fail() || byte < 0 || byte > 0xff || (i < mac.size()-1 && !(iss >> delim_void)) ) {
+            throw std::runtime_error("Invalid MAC address: " + str);
+        }
+        mac[i] = static_cast<uint8_t>(byte);
+    }
+    return mac;
+}
+
 
 Options get_options(int argc, char** argv) {
     namespace po = boost::program_options;
@@ -8,6 +29,10 @@ Options get_options(int argc, char** argv) {
     po::options_description opts_desc("Allowed options");
     po::positional_options_description p;
     po::variables_map vm;
+    std::vector<std::string> ethertypes;
+    std::vector<std::string> allowed_macs;
+    std::vector<std::string> interfaces;
+    std::vector<std::string> slaves;
 
     auto print_help = [&opts_desc]() {
         std::cout << "Usage: au [interface] [file]" << std::endl;
@@ -15,13 +40,47 @@ Options get_options(int argc, char** argv) {
     };
 
     opts_desc.add_options()
+        ("allow_mac", po::value<std::vector<std::string>>(&allowed_macs)->multitoken(), "Only receive frames from these source MACs")
+        ("backend,b", po::value<std::string>(&retval.backend)->default_value("berkeley"), "Network backend (berkeley, xdp)")
+        ("daemon,d", "Serve supplicants continuously without the menu, commands are taken from --control_socket")
+        ("ethertype,e", po::value<std::vector<std::string>>(&ethertypes)->multitoken(), "Filter received frames in the kernel by EtherType (hex)")
+        ("compact_every", po::value<size_t>(&retval.compact_every)->default_value(100000), "Rewrite the resource file after this many journal records")
+        ("control_socket", po::value<std::string>(&retval.control_socket)->default_value("au.sock"), "Command socket of the daemon mode, empty disables")
+        ("convert", po::value<std::string>(&retval.convert_to), "Convert the resource file to this file (.db for binary, CSV otherwise) and exit")
+        ("fake_slaves", po::value<int>(&retval.fake_slaves)->default_value(0), "Add this many simulated slaves on pseudo terminals to the load test")
         ("file,f", po::value<std::string>(&retval.resource_file)->default_value("Supplicant.csv"), "Resource file")
+        ("flush_interval", po::value<int>(&retval.flush_interval_ms)->default_value(5), "Group commit interval of the journal [ms]")
+        ("fsync_batch", po::value<int>(&retval.fsync_batch)->default_value(1), "fsync the journal every n group commits, 0 never")
         ("help,h", "Print this help")
-        ("interface,I", po::value<std::string>(&retval.iface_name)->default_value("enp4s0"), "Bind to interface")
+        ("interface,I", po::value<std::vector<std::string>>(&interfaces)->multitoken()->default_value({"enp4s0"}, "enp4s0"), "Bind to these interfaces, several require --daemon")
+        ("metrics_port", po::value<int>(&retval.metrics_port)->default_value(0), "Serve Prometheus metrics on this localhost TCP port, 0 disables")
+        ("metrics_socket", po::value<std::string>(&retval.metrics_socket), "Serve Prometheus metrics on this UNIX socket")
         ("payload_bufsize,p", po::value<int>(&retval.payload_bufsize)->default_value(3), "Payload buffer size")
+        ("ring_blocks", po::value<int>(&retval.ring_blocks)->default_value(64), "Number of 1 MiB blocks in the receive ring")
+        ("rate_burst", po::value<int>(&retval.rate_burst)->default_value(32), "Frames a source may send at once above --rate_limit")
+        ("rate_limit", po::value<double>(&retval.rate_limit)->default_value(0), "Validate at most this many frames per second of each source MAC, 0 disables")
+        ("rate_sources", po::value<size_t>(&retval.rate_sources)->default_value(65536), "Source MACs tracked by --rate_limit")
+        ("remote", po::value<std::string>(&retval.remote), "Query the authentication server at this UNIX socket path or host:port instead of the resource file")
+        ("remote_lease", po::value<int>(&retval.remote_lease)->default_value(1), "Counter units taken per query from the remote server, the rest is used up locally")
+        ("replay", po::value<std::string>(&retval.replay_file), "Process this pcap capture on an in-process network instead of a NIC and exit")
+        ("replay_speed", po::value<double>(&retval.replay_speed)->default_value(1.0), "Speed factor for original replay timing")
+        ("replay_timing", po::value<std::string>(&retval.replay_timing)->default_value("max"), "Replay as fast as possible (max) or as captured (original)")
+        ("results", po::value<std::string>(&retval.results_file), "Append speedtest results as JSON lines to this file")
         ("rounds,r", po::value<int>(&retval.rounds)->default_value(10), "Number of rounds")
+        ("rx_ring", "Receive through a memory mapped TPACKET_V3 ring")
         ("save_on_edit,s", "Save resource file on edit")
+        ("serve", po::value<std::string>(&retval.serve), "Serve the resource file to --remote clients on this UNIX socket path or host:port, :port listens on localhost only. "
+                                                        "The protocol has no authentication, only listen on other addresses in trusted networks")
+        ("session_cache", po::value<size_t>(&retval.session_cache)->default_value(65536), "Keep the decoded points of this many recently queried supplicants, 0 disables")
+        ("shared_store", po::value<std::string>(&retval.shared_store), "Share the supplicant table with all processes using this shared memory name")
+        ("sign_up_slaves", "Register the slaves before the load test")
+        ("slaves", po::value<std::vector<std::string>>(&slaves)->multitoken(), "Run a parallel load test with the slaves on these serial ports and exit")
+        ("timestamps", "Use kernel receive timestamps in the speedtest")
+        ("validators", po::value<int>(&retval.validators)->default_value(0), "Validate speedtest frames on this many threads fed by one receive thread")
         ("verbose,v", "Verbose output")
+        ("watch", "Apply changes of the resource file while running")
+        ("workers,w", po::value<int>(&retval.workers)->default_value(1), "Validate on this many PACKET_FANOUT worker sockets")
+        ("xdp_queue", po::value<int>(&retval.xdp_queue)->default_value(0), "NIC queue used by the xdp backend")
     ;
 
     p.add("interface", 1);
@@ -42,5 +101,81 @@ Options get_options(int argc, char** argv) {
 
     retval.verbose = vm.count("verbose");
     retval.save_on_edit = vm.count("save_on_edit");
+    retval.rx_ring = vm.count("rx_ring");
+    retval.watch = vm.count("watch");
+    retval.timestamps = vm.count("timestamps");
+    retval.daemon = vm.count("daemon");
+    retval.sign_up_slaves = vm.count("sign_up_slaves");
+
+    for(const auto &type : ethertypes) {
+        try {
+            retval.ethertypes.push_back( static_cast<uint16_t>(std::stoul(type, nullptr, 16)) );
+        } catch(const std::logic_error &e) {
+            throw std::runtime_error("Invalid EtherType: " + type);
+        }
+    }
+    // Serial ports may also be given as comma separated list
+    for(const auto &list : slaves) {
+        std::istringstream iss(list);
+        std::string port;
+        while( std::getline(iss, port, ',') ) {
+            if( !port.empty() ) retval.slaves.push_back(port);
+        }
+    }
+
+    // Interfaces may also be given as comma separated list
+    for(const auto &list : interfaces) {
+        std::istringstream iss(list);
+        std::string name;
+        while( std::getline(iss, name, ',') ) {
+            if( name.empty() ) continue;
+            if( std::find(retval.interfaces.begin(), retval.interfaces.end(), name) != retval.interfaces.end() ) {
+                throw std::runtime_error("Interface given twice: " + name);
+            }
+            retval.interfaces.push_back(name);
+        }
+    }
+    if( retval.interfaces.empty() ) {
+        throw std::runtime_error("No interface given");
+    }
+    for(const auto &mac : allowed_macs) {
+        retval.allowed_macs.push_back( parse_mac(mac) );
+    }
+    if( retval.backend != "berkeley" && retval.backend != "xdp" ) {
+        throw std::runtime_error("Unknown backend: " + retval.backend);
+    }
+    if( retval.workers < 1 || (retval.workers > 1 && retval.backend != "berkeley") ) {
+        throw std::runtime_error("--workers requires the berkeley backend and must be at least 1");
+    }
+    if( retval.workers > 1 && retval.validators > 0 ) {
+        throw std::runtime_error("--workers validates on the fanout sockets and does not support --validators");
+    }
+    if( !retval.allowed_macs.empty() && retval.ethertypes.empty() ) {
+        throw std::runtime_error("--allow_mac requires --ethertype");
+    }
+    if( (retval.replay_timing != "max" && retval.replay_timing != "original") || retval.replay_speed <= 0 ) {
+        throw std::runtime_error("--replay_timing must be max or original with a positive --replay_speed");
+    }
+    if( (!retval.slaves.empty() || retval.fake_slaves > 0) && (retval.daemon || retval.workers > 1 || retval.validators > 0) ) {
+        throw std::runtime_error("The load test validates on one thread and does not support --daemon, --workers or --validators");
+    }
+    if( retval.interfaces.size() > 1 && !retval.daemon ) {
+        throw std::runtime_error("Serving several interfaces requires --daemon");
+    }
+    if( retval.daemon && (retval.workers > 1 || retval.validators > 0) ) {
+        throw std::runtime_error("--daemon validates on its event loop and does not support --workers or --validators");
+    }
+    if( retval.rate_limit < 0 || retval.rate_burst < 1 || retval.rate_burst > AdmissionControl::MAX_BURST ) {
+        throw std::runtime_error("--rate_limit must not be negative and --rate_burst between 1 and " + std::to_string(AdmissionControl::MAX_BURST));
+    }
+    if( retval.remote_lease < 1 || retval.remote_lease > 65535 ) {
+        throw std::runtime_error("--remote_lease must be between 1 and 65535");
+    }
+    if( !retval.remote.empty() && (!retval.serve.empty() || !retval.shared_store.empty() || retval.watch || !retval.convert_to.empty()) ) {
+        throw std::runtime_error("--remote leaves the resource file to the server and does not support --serve, --shared_store, --watch or --convert");
+    }
+    if( !retval.shared_store.empty() && retval.watch ) {
+        throw std::runtime_error("--shared_store is loaded once by its owner and does not support --watch");
+    }
     return retval;
 }
\ No newline at end of file
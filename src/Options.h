@@ -1,14 +1,50 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
 
 typedef struct Options {
-    std::string iface_name;
+    std::vector<std::string> interfaces;
+    std::string backend;
     std::string resource_file;
+    std::string convert_to;
     int payload_bufsize;
     int rounds;
     bool verbose;
     bool save_on_edit;
+    bool watch;
+    bool rx_ring;
+    int ring_blocks;
+    std::vector<uint16_t> ethertypes;
+    std::vector<std::array<uint8_t, 6>> allowed_macs;
+    int xdp_queue;
+    int workers;
+    int validators;
+    int fsync_batch;
+    int flush_interval_ms;
+    size_t compact_every;
+    size_t session_cache;
+    std::string shared_store;
+    std::string remote;
+    int remote_lease;
+    std::string serve;
+    double rate_limit;
+    int rate_burst;
+    size_t rate_sources;
+    std::string metrics_socket;
+    int metrics_port;
+    bool timestamps;
+    std::string results_file;
+    std::string replay_file;
+    std::string replay_timing;
+    double replay_speed;
+    bool daemon;
+    std::string control_socket;
+    std::vector<std::string> slaves;
+    int fake_slaves;
+    bool sign_up_slaves;
 } Options;
 
 
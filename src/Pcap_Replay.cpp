@@ -0,0 +1,182 @@
+#include "Pcap_Replay.h"
+#include "Admission_Control.h"
+#include "Metrics.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+constexpr uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+constexpr uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+constexpr uint32_t LINKTYPE_ETHERNET = 1;
+constexpr size_t PCAP_HEADER_LEN = 24;
+constexpr size_t PCAP_RECORD_LEN = 16;
+
+
+/* ----------------------------------------- PcapFile Implementation ---------------------------------------*/
+
+PcapFile::PcapFile() : map(nullptr), map_len(0) {}
+
+
+PcapFile::~PcapFile() {
+    close();
+}
+
+
+void PcapFile::open(const std::string& path) {
+    struct stat st;
+    int fd;
+
+    close();
+    if( (fd = ::open(path.c_str(), O_RDONLY)) < 0 ) {
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+    if( fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < PCAP_HEADER_LEN ) {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a pcap file");
+    }
+
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+        throw std::runtime_error("Cannot map " + path + ": " + strerror(errno));
+    }
+    map = static_cast<const uint8_t*>(mapped);
+    map_len = st.st_size;
+
+    uint32_t magic;
+    memcpy(&magic, map, sizeof(magic));
+    bool swapped = (magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS));
+    if(swapped) magic = __builtin_bswap32(magic);
+    if(magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        close();
+        throw std::runtime_error(path + " is not a pcap file (pcapng is not supported)");
+    }
+
+    auto field = [&](size_t offset) {
+        uint32_t value;
+        memcpy(&value, map + offset, sizeof(value));
+        return swapped ? __builtin_bswap32(value) : value;
+    };
+
+    if( (field(20) & 0xffff) != LINKTYPE_ETHERNET ) {
+        close();
+        throw std::runtime_error(path + " does not contain Ethernet frames");
+    }
+
+    uint64_t fraction_ns = (magic == PCAP_MAGIC_NS) ? 1 : 1000;
+    for(size_t pos = PCAP_HEADER_LEN; pos + PCAP_RECORD_LEN <= map_len; ) {
+        uint32_t incl_len = field(pos + 8);
+        if(pos + PCAP_RECORD_LEN + incl_len > map_len) {
+            std::cerr << "Truncated pcap record at offset " << pos << '\n';
+            break;
+        }
+
+        PcapFrame frame;
+        frame.data = map + pos + PCAP_RECORD_LEN;
+        frame.len = incl_len;
+        frame.timestamp_ns = field(pos) * 1000000000ULL + field(pos + 4) * fraction_ns;
+        frames.push_back(frame);
+        pos += PCAP_RECORD_LEN + incl_len;
+    }
+}
+
+
+void PcapFile::close() {
+    if(map) munmap(const_cast<uint8_t*>(map), map_len);
+    map = nullptr;
+    map_len = 0;
+    frames.clear();
+}
+
+
+
+/* ---------------------------------------- PcapReplay Implementation ---------------------------------------*/
+
+PcapReplay::PcapReplay(const std::string& path) : target(nullptr), stopping(false) {
+    pcap.open(path);
+}
+
+
+// Also reached while unwinding from process_replay, when the feeder may still be sleeping or blocked on a full queue
+PcapReplay::~PcapReplay() {
+    stop();
+}
+
+
+void PcapReplay::stop() {
+    if( !feeder.joinable() ) return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        wakeup.notify_all();
+    }
+    target->shutdown();
+    feeder.join();
+}
+
+
+void PcapReplay::start(LoopbackNetwork& net, bool original_timing, double speed) {
+    wait();
+    target = &net;
+    stopping = false;
+    feeder = std::thread([this, &net, original_timing, speed]() {
+        const auto &frames = pcap.get_frames();
+        auto start = std::chrono::steady_clock::now();
+
+        for(const auto &frame : frames) {
+            if(original_timing) {
+                auto offset = std::chrono::nanoseconds( static_cast<int64_t>((frame.timestamp_ns - frames.front().timestamp_ns) / speed) );
+                std::unique_lock<std::mutex> lk(lock);
+                if( wakeup.wait_until(lk, start + offset, [this]() { return stopping; }) ) return;
+            }
+            if( !net.inject(frame.data, frame.len) ) return;
+        }
+        net.close_input();
+    });
+}
+
+
+void PcapReplay::wait() {
+    if(feeder.joinable()) feeder.join();
+}
+
+
+
+SpeedtestStats process_replay(BatchNetwork& net, puf::Authenticator& au) {
+    using namespace puf;
+    constexpr size_t BATCH_SIZE = 32;
+    std::vector<FrameSlot> slots(BATCH_SIZE);
+    SpeedtestStats stats;
+    PUF_Performance pp;
+    size_t requests = 0, accepted = 0;
+
+    while(true) {
+        size_t n;
+        {
+            StageTimer timer(Metrics::RECEIVE);
+            n = net.receive_batch(slots.data(), slots.size());
+        }
+        if(n == 0) break;
+
+        for(size_t i=0; i<n; ++i) {
+            if(deduce_type(slots[i].data, slots[i].len) == PUF_CON_E) {
+                StageTimer timer(Metrics::ACCEPT);
+                requests++;
+                if( AdmissionControl::admit(slots[i].data, slots[i].len) && au.accept(slots[i].data, slots[i].len) == 0 ) accepted++;
+            } else {
+                speedtest_frame(slots[i].data, slots[i].len, slots[i].timestamp_ns, pp, au, stats);
+            }
+        }
+    }
+
+    std::cout << "Accepted\t" << accepted << " of " << requests << " connection requests" << std::endl;
+    return stats;
+}
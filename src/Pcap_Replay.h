@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "Loopback_Network.h"
+#include "Speedtest.h"
+#include "authenticator.h"
+
+
+struct PcapFrame {
+    const uint8_t *data;
+    size_t len;
+    uint64_t timestamp_ns;      // Capture time
+};
+
+
+/* Memory mapped classic pcap file (microsecond or nanosecond timestamps, either byte order) with Ethernet frames.
+ * pcapng is not supported, convert with `editcap -F pcap`. */
+class PcapFile {
+private:
+    const uint8_t *map;
+    size_t map_len;
+    std::vector<PcapFrame> frames;
+
+public:
+    PcapFile();
+    ~PcapFile();
+    PcapFile(const PcapFile&) = delete;
+    PcapFile& operator=(const PcapFile&) = delete;
+
+    void open(const std::string& path);
+    void close();
+    const std::vector<PcapFrame>& get_frames() const { return frames; }
+};
+
+
+/* Feeds a capture into a LoopbackNetwork from a background thread, either as fast as the receiver
+ * takes the frames or spaced like they were captured (scaled by speed). Destroying the replay before
+ * the feeder finished stops it and shuts the network down. */
+class PcapReplay {
+private:
+    PcapFile pcap;
+    std::thread feeder;
+    LoopbackNetwork *target;
+    std::mutex lock;
+    std::condition_variable wakeup;     // Ends the feeder's sleep between frames when stopping
+    bool stopping;
+
+    void stop();
+
+public:
+    PcapReplay(const std::string& path);
+    ~PcapReplay();
+    void start(LoopbackNetwork& net, bool original_timing, double speed = 1.0);
+    void wait();
+    size_t size() const { return pcap.get_frames().size(); }
+};
+
+
+/* Runs received frames through the authenticator until the end of the input: connection requests go to
+ * Authenticator::accept, speedtest frames to speedtest_frame */
+SpeedtestStats process_replay(BatchNetwork& net, puf::Authenticator& au);
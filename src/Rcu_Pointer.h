@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstddef>
+
+
+/* Stripe of the reader counters used by the calling thread, threads are spread round robin */
+inline size_t rcu_stripe(size_t stripes) {
+    static std::atomic<size_t> next{0};
+    thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed);
+    return stripe % stripes;
+}
+
+
+/* Pointer that can be replaced while readers keep using the old object.
+ *
+ * Readers register in the counter of the current epoch and never block. A writer publishes the new
+ * object, switches the epoch and waits until the readers of the previous epoch are gone before it
+ * hands the old object back. Writers must be serialised by the caller.
+ *
+ * The counters are striped over cache lines by thread, so readers on different cores do not bounce
+ * a shared line. Only the rare writer has to look at all stripes. */
+template<typename T>
+class RcuPointer {
+private:
+    static constexpr size_t STRIPES = 64;
+
+    struct alignas(64) Stripe {
+        std::atomic<long> readers[2];
+    };
+
+    std::atomic<T*> ptr;
+    std::atomic<unsigned int> epoch;
+    Stripe stripes[STRIPES];
+
+public:
+    class ReadGuard {
+    private:
+        std::atomic<long> *counter;
+        T *obj;
+        friend class RcuPointer;
+
+        ReadGuard(RcuPointer *owner) {
+            Stripe &stripe = owner->stripes[ rcu_stripe(STRIPES) ];
+            while(true) {
+                unsigned int slot = owner->epoch.load() & 1;
+                counter = &stripe.readers[slot];
+                counter->fetch_add(1);
+                if( (owner->epoch.load() & 1) == slot ) break;
+                counter->fetch_sub(1);      // Raced with a writer, register again
+            }
+            obj = owner->ptr.load();
+        }
+
+    public:
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ~ReadGuard() { counter->fetch_sub(1); }
+
+        T* operator->() const { return obj; }
+        T& operator*() const { return *obj; }
+    };
+
+    RcuPointer(std::unique_ptr<T> initial = std::make_unique<T>()) : ptr(initial.release()), epoch(0) {
+        for(auto &stripe : stripes) {
+            stripe.readers[0] = 0;
+            stripe.readers[1] = 0;
+        }
+    }
+
+    ~RcuPointer() { delete ptr.load(); }
+
+    RcuPointer(const RcuPointer&) = delete;
+    RcuPointer& operator=(const RcuPointer&) = delete;
+
+    ReadGuard read() { return ReadGuard(this); }
+
+    /* Publishes next and returns the previous object once no reader can reach it anymore */
+    std::unique_ptr<T> exchange(std::unique_ptr<T> next) {
+        T *old = ptr.exchange(next.release());
+        unsigned int old_slot = epoch.fetch_add(1) & 1;
+
+        for(auto &stripe : stripes) {
+            while(stripe.readers[old_slot].load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+        return std::unique_ptr<T>(old);
+    }
+};
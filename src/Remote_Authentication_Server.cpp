@@ -0,0 +1,289 @@
+#include "Remote_Authentication_Server.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+
+constexpr int RECONNECT_MIN_MS = 100;
+constexpr int RECONNECT_MAX_MS = 5000;
+
+
+/* ---------------------------------- RemoteAuthenticationServer Implementation --------------------------------*/
+
+RemoteAuthenticationServer::RemoteAuthenticationServer(const std::string& address_, const RemoteOptions& options_) :
+    address(address_),
+    options(options_),
+    fd(-1),
+    wake_fd(-1),
+    stopping(false),
+    connected(false),
+    next_id(1),
+    cache(options_.cache_entries)
+{
+    if(options.lease < 1 || options.lease > UINT16_MAX) {
+        throw std::runtime_error("Lease must be between 1 and " + std::to_string(UINT16_MAX));
+    }
+}
+
+
+RemoteAuthenticationServer::~RemoteAuthenticationServer() {
+    if(io.joinable()) {
+        uint64_t one = 1;
+        stopping = true;
+        if( write(wake_fd, &one, sizeof(one)) < 0 ) {
+            std::cerr << "Error stopping remote client: " << strerror(errno) << '\n';
+        }
+        io.join();
+    }
+    if(fd >= 0) close(fd);
+    if(wake_fd >= 0) close(wake_fd);
+}
+
+
+void RemoteAuthenticationServer::fetch() {
+    std::lock_guard<std::mutex> guard(lock);
+
+    // Several authenticators may share this server, only the first one connects
+    if(connected || io.joinable()) return;
+
+    fd = remote_connect(address);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if( (wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating eventfd: ") + strerror(errno) );
+    }
+
+    connected = true;
+    io = std::thread(&RemoteAuthenticationServer::run, this);
+    std::cout << "Connected to authentication server " << address << std::endl;
+}
+
+
+RemoteAuthenticationServer::Reply RemoteAuthenticationServer::call(RemoteRequest request, const std::string& payload) {
+    std::future<Reply> answer;
+
+    request.length = payload.size();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!connected) return Reply{REMOTE_ERROR, 0, {}};
+
+        request.id = next_id++;
+        answer = pending[request.id].get_future();
+
+        // The I/O thread only needs waking for the first request of a batch, it takes all of them at once
+        bool idle = output.empty();
+        output.append( reinterpret_cast<const char*>(&request), sizeof(request) );
+        output.append(payload);
+        if(idle) {
+            uint64_t one = 1;
+            if( write(wake_fd, &one, sizeof(one)) < 0 ) {}
+        }
+    }
+
+    if( answer.wait_for(std::chrono::milliseconds(options.timeout_ms)) != std::future_status::ready ) {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.erase(request.id);
+        std::cerr << "Timeout waiting for authentication server " << address << std::endl;
+        return Reply{REMOTE_ERROR, 0, {}};
+    }
+    return answer.get();
+}
+
+
+void RemoteAuthenticationServer::disconnect(const std::string& reason) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::cerr << "Lost authentication server " << address << ": " << reason << std::endl;
+    connected = false;
+    close(fd);
+    fd = -1;
+    for(auto &[id, promise] : pending) promise.set_value( Reply{REMOTE_ERROR, 0, {}} );
+    pending.clear();
+    output.clear();
+}
+
+
+void RemoteAuthenticationServer::run() {
+    int backoff_ms = RECONNECT_MIN_MS;
+
+    while(!stopping) {
+        if(fd < 0) {
+            // Wait before every attempt, the destructor wakes the thread up to stop it
+            struct pollfd wake = { wake_fd, POLLIN, 0 };
+            if( poll(&wake, 1, backoff_ms) > 0 ) {
+                uint64_t value;
+                if( read(wake_fd, &value, sizeof(value)) < 0 ) {}
+                continue;
+            }
+            backoff_ms = std::min(2 * backoff_ms, RECONNECT_MAX_MS);
+
+            int reconnected;
+            try {
+                reconnected = remote_connect(address);
+            } catch(const std::runtime_error &e) {
+                continue;
+            }
+            fcntl(reconnected, F_SETFL, fcntl(reconnected, F_GETFL) | O_NONBLOCK);
+
+            std::lock_guard<std::mutex> guard(lock);
+            fd = reconnected;
+            connected = true;
+            backoff_ms = RECONNECT_MIN_MS;
+            std::cout << "Reconnected to authentication server " << address << std::endl;
+        }
+        serve();
+    }
+}
+
+
+void RemoteAuthenticationServer::serve() {
+    std::string input;
+    char buffer[65536];
+
+    while(!stopping) {
+        bool writable;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            writable = !output.empty();
+        }
+
+        struct pollfd fds[2] = {
+            { wake_fd, POLLIN, 0 },
+            { fd, static_cast<short>(POLLIN | (writable ? POLLOUT : 0)), 0 },
+        };
+        if( poll(fds, 2, -1) < 0 ) {
+            if(errno == EINTR) continue;
+            disconnect(strerror(errno));
+            return;
+        }
+
+        if(fds[0].revents & POLLIN) {
+            uint64_t value;
+            if( read(wake_fd, &value, sizeof(value)) < 0 ) {}
+        }
+
+        if(fds[1].revents & (POLLOUT | POLLIN | POLLHUP)) {
+            std::lock_guard<std::mutex> guard(lock);
+            if( !output.empty() ) {
+                ssize_t n = send(fd, output.data(), output.size(), MSG_NOSIGNAL);
+                if(n > 0) output.erase(0, n);
+            }
+        }
+
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n;
+            while( (n = recv(fd, buffer, sizeof(buffer), 0)) > 0 ) input.append(buffer, n);
+            if( n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+                disconnect(n == 0 ? "connection closed" : strerror(errno));
+                return;
+            }
+
+            // Hand every complete answer to its caller, callers that gave up are gone from pending
+            size_t pos = 0;
+            std::lock_guard<std::mutex> guard(lock);
+            while(input.size() - pos >= sizeof(RemoteReply)) {
+                RemoteReply reply;
+                memcpy(&reply, input.data() + pos, sizeof(reply));
+                if(input.size() - pos < sizeof(reply) + reply.length) break;
+
+                auto it = pending.find(reply.id);
+                if(it != pending.end()) {
+                    it->second.set_value( Reply{reply.status, reply.granted, input.substr(pos + sizeof(reply), reply.length)} );
+                    pending.erase(it);
+                }
+                pos += sizeof(reply) + reply.length;
+            }
+            input.erase(0, pos);
+        }
+    }
+}
+
+
+void RemoteAuthenticationServer::sync() {
+    RemoteRequest request = {};
+    request.op = REMOTE_SYNC;
+    if( call(request).status != REMOTE_OK ) std::cerr << "Error syncing authentication server" << std::endl;
+}
+
+
+void RemoteAuthenticationServer::reload() {
+    RemoteRequest request = {};
+    request.op = REMOTE_RELOAD;
+    if( call(request).status != REMOTE_OK ) std::cerr << "Error reloading authentication server" << std::endl;
+}
+
+
+void RemoteAuthenticationServer::store(const puf::MAC& base_mac, const puf::ECP_Point& A, puf::MAC& hashed_mac, int ctr) {
+    CompactEntry entry = SupplicantEntry(ctr, base_mac, hashed_mac, A).compact();
+    RemoteRequest request = {};
+    request.op = REMOTE_STORE;
+    memcpy(request.hashed_mac, hashed_mac.bytes, sizeof(request.hashed_mac));
+
+    if( call(request, std::string(reinterpret_cast<const char*>(&entry), sizeof(entry))).status == REMOTE_OK ) {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        cache.erase( hashed_mac.to_u64() );
+    } else {
+        std::cerr << "Error storing supplicant" << std::endl;
+    }
+}
+
+
+puf::QueryResult RemoteAuthenticationServer::query(const puf::MAC& hashed_mac, bool decrease_counter) {
+    StageTimer timer(Metrics::QUERY);
+    puf::QueryResult retval;
+    uint64_t key = hashed_mac.to_u64();
+    bool cached = false;
+    retval.valid = false;
+
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        if( Cached *entry = cache.find(key) ) {
+            retval.ecp = entry->point;
+            retval.mac = entry->base_mac;
+            cached = true;
+
+            if(!decrease_counter || entry->leased > 0) {
+                if(decrease_counter) {
+                    entry->leased--;
+                    Metrics::count(Metrics::REMOTE_LEASED);
+                }
+                retval.valid = true;
+                return retval;
+            }
+        }
+    }
+
+    RemoteRequest request = {};
+    request.op = REMOTE_QUERY;
+    request.want_point = !cached;
+    request.take = decrease_counter ? options.lease : 0;
+    memcpy(request.hashed_mac, hashed_mac.bytes, sizeof(request.hashed_mac));
+    Reply reply = call(request);
+
+    if(reply.status == REMOTE_ERROR) return retval;
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+    if(reply.status != REMOTE_VALID) {
+        cache.erase(key);
+        return retval;
+    }
+
+    if(!cached) {
+        if(reply.body.size() < sizeof(retval.mac.bytes) + 1) return retval;
+
+        size_t point_len = static_cast<uint8_t>(reply.body[sizeof(retval.mac.bytes)]);
+        std::string point = reply.body.substr(sizeof(retval.mac.bytes) + 1, point_len);
+        memcpy(retval.mac.bytes, reply.body.data(), sizeof(retval.mac.bytes));
+        retval.ecp.from_base64( reinterpret_cast<const uint8_t*>(point.c_str()) );
+    }
+    cache.insert( key, Cached{retval.ecp, retval.mac, reply.granted > 0 ? reply.granted - 1 : 0} );
+    retval.valid = true;
+    return retval;
+}
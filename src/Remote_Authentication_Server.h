@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include "authenticator.h"
+#include "Clock_Cache.h"
+#include "Remote_Protocol.h"
+
+
+struct RemoteOptions {
+    int lease = 1;                  // Counter units taken per round trip, the rest are used up locally
+    size_t cache_entries = 65536;   // Points kept locally, 0 disables the cache
+    int timeout_ms = 2000;          // Longest wait for an answer
+};
+
+
+/* Authentication server reached over the remote protocol, e.g. the RemoteServer of another au process.
+ *
+ * Calls from any number of threads are multiplexed onto one connection: each request is queued and a single
+ * I/O thread writes everything queued in one go and hands the answers back by id, so a query never waits
+ * for another one to finish. Points are kept in a read-through cache and only transferred on a miss.
+ * With a lease above 1 a query takes that many counter units at once and the following authentications
+ * of the supplicant are answered from the cache, units left over on exit are lost. A lost connection is
+ * reestablished by the I/O thread with exponential backoff, until then queries not answered from leased
+ * units fail. */
+class RemoteAuthenticationServer : public puf::AuthenticationServer {
+private:
+    struct Cached {
+        puf::ECP_Point point;
+        puf::MAC base_mac;
+        int leased;         // Counter units taken from the server and not used yet
+    };
+
+    struct Reply {
+        uint8_t status;
+        uint16_t granted;
+        std::string body;
+    };
+
+    using Cache = ClockCache<Cached, Metrics::REMOTE_HIT, Metrics::REMOTE_MISS, Metrics::REMOTE_EVICT>;
+
+    std::string address;
+    RemoteOptions options;
+    int fd;
+    int wake_fd;
+    std::thread io;
+    std::atomic<bool> stopping;
+
+    std::mutex lock;                // Guards everything shared with the I/O thread below
+    bool connected;
+    uint64_t next_id;
+    std::string output;
+    std::unordered_map<uint64_t, std::promise<Reply>> pending;
+
+    std::mutex cache_lock;
+    Cache cache;
+
+    Reply call(RemoteRequest request, const std::string& payload = std::string());
+    void run();
+    void serve();       // Exchanges requests and answers until the connection is lost or the client stops
+    void disconnect(const std::string& reason);
+
+public:
+    RemoteAuthenticationServer(const std::string& address_, const RemoteOptions& options_ = RemoteOptions());
+    ~RemoteAuthenticationServer();
+
+    /* Connects to the server */
+    void fetch() override;
+    void sync() override;
+    void store(const puf::MAC& base_mac, const puf::ECP_Point& A, puf::MAC& hashed_mac, int ctr) override;
+    puf::QueryResult query(const puf::MAC& hashed_mac, bool decrease_counter = true) override;
+
+    /* Makes the server reload its resource file */
+    void reload();
+};
@@ -0,0 +1,98 @@
+#include "Remote_Protocol.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+// Splits host:port, anything with a slash or without a port is a UNIX socket path
+static bool tcp_address(const std::string& address, std::string& host, std::string& port) {
+    if(address.compare(0, 5, "unix:") == 0 || address.find('/') != std::string::npos) return false;
+
+    size_t colon = address.rfind(':');
+    if(colon == std::string::npos) return false;
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+
+static int open_socket(const std::string& address, bool server) {
+    std::string host, port;
+    int fd = -1;
+
+    if( !tcp_address(address, host, port) ) {
+        std::string path = address.compare(0, 5, "unix:") == 0 ? address.substr(5) : address;
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        strcpy(addr.sun_path, path.c_str());
+
+        if(server) unlink(path.c_str());
+        if( (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+            (server ? bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0
+                    : connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) ) {
+            int error = errno;
+            if(fd >= 0) close(fd);
+            throw std::runtime_error( "Error opening " + address + ": " + strerror(error) );
+        }
+        return fd;
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Without a host a server listens on loopback only, listening on all interfaces has to be asked for
+    int rc = getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &result);
+    if(rc != 0) {
+        throw std::runtime_error( "Cannot resolve " + address + ": " + gai_strerror(rc) );
+    }
+
+    int error = 0;
+    for(auto *ai = result; ai; ai = ai->ai_next) {
+        int one = 1;
+        if( (fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0 ) {
+            error = errno;
+            continue;
+        }
+
+        // Queries are small and latency bound
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(server) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if( server ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0
+                   : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ) {
+            break;
+        }
+        error = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if(fd < 0) {
+        throw std::runtime_error( "Error opening " + address + ": " + strerror(error) );
+    }
+    return fd;
+}
+
+
+int remote_connect(const std::string& address) {
+    return open_socket(address, false);
+}
+
+
+int remote_listen(const std::string& address) {
+    return open_socket(address, true);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include "Authentication_Server.h"
+
+
+/* Binary protocol between RemoteAuthenticationServer and RemoteServer, little endian like the database file.
+ *
+ * Every message is a fixed header followed by length bytes of payload. Clients may send any number of requests
+ * without waiting, the server answers them in order and echoes the id, so one connection carries many queries
+ * in flight and a single write can carry many of them.
+ *   QUERY   take counter units (0 only looks up), the reply holds the base MAC and point if want_point is set
+ *   STORE   payload is the CompactEntry to insert
+ *   SYNC    persists the table
+ *   RELOAD  applies changes of the resource file */
+enum RemoteOp : uint8_t {
+    REMOTE_QUERY = 1,
+    REMOTE_STORE = 2,
+    REMOTE_SYNC = 3,
+    REMOTE_RELOAD = 4
+};
+
+
+enum RemoteStatus : uint8_t {
+    REMOTE_INVALID = 0,     // Unknown supplicant or counter exhausted
+    REMOTE_VALID = 1,       // Query granted the counter units in granted
+    REMOTE_OK = 2,
+    REMOTE_ERROR = 3
+};
+
+
+struct RemoteRequest {
+    uint32_t length;        // Payload bytes following the header
+    uint8_t op;
+    uint8_t want_point;
+    uint16_t take;
+    uint64_t id;
+    uint8_t hashed_mac[6];
+    uint8_t reserved[2];
+};
+
+
+struct RemoteReply {
+    uint32_t length;        // Payload bytes following the header: base MAC, point length and point
+    uint8_t status;
+    uint8_t reserved;
+    uint16_t granted;
+    uint64_t id;
+};
+
+
+static_assert(sizeof(RemoteRequest) == 24 && sizeof(RemoteReply) == 16, "Protocol headers must not be padded");
+
+
+constexpr size_t REMOTE_MAX_PAYLOAD = sizeof(CompactEntry);
+
+
+/* Address is a UNIX socket path, optionally prefixed with unix:, or host:port for TCP. A server given :port
+ * listens on the loopback address, other interfaces have to be named, e.g. 0.0.0.0:port. */
+int remote_connect(const std::string& address);
+int remote_listen(const std::string& address);
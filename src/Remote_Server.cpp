@@ -0,0 +1,221 @@
+#include "Remote_Server.h"
+
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/* ---------------------------------------- RemoteServer Implementation ---------------------------------------*/
+
+RemoteServer::RemoteServer(AuthenticationServerImpl& as_, const std::string& address_) :
+    as(as_),
+    address(address_),
+    listen_fd(-1),
+    stop_fd(-1)
+{}
+
+
+RemoteServer::~RemoteServer() {
+    stop();
+}
+
+
+bool RemoteServer::loopback_only() const {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if( getsockname(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0 ) return false;
+
+    switch(addr.ss_family) {
+        case AF_UNIX:
+            return true;
+        case AF_INET:
+            return (ntohl( reinterpret_cast<struct sockaddr_in*>(&addr)->sin_addr.s_addr ) >> 24) == IN_LOOPBACKNET;
+        case AF_INET6:
+            return IN6_IS_ADDR_LOOPBACK( &reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_addr );
+        default:
+            return false;
+    }
+}
+
+
+void RemoteServer::start() {
+    listen_fd = remote_listen(address);
+    if( (stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating eventfd: ") + strerror(errno) );
+    }
+
+    std::cout << "Serving " << address << std::endl;
+    if( !loopback_only() ) {
+        std::cerr << "Warning: " << address << " is reachable from other hosts and the remote protocol has no authentication,"
+                  << " any of them can take counters and store supplicants" << std::endl;
+    }
+    server = std::thread(&RemoteServer::run, this);
+}
+
+
+void RemoteServer::stop() {
+    if(server.joinable()) {
+        uint64_t one = 1;
+        if( write(stop_fd, &one, sizeof(one)) < 0 ) {
+            std::cerr << "Error stopping remote server: " << strerror(errno) << '\n';
+        }
+        server.join();
+    }
+
+    for(auto &[fd, client] : clients) close(fd);
+    clients.clear();
+    if(listen_fd >= 0) close(listen_fd);
+    if(stop_fd >= 0) close(stop_fd);
+    listen_fd = stop_fd = -1;
+}
+
+
+void RemoteServer::handle(const RemoteRequest& request, const char *payload, std::string& output) {
+    RemoteReply reply = {0, REMOTE_OK, 0, 0, request.id};
+    std::string body;
+
+    switch(request.op) {
+        case REMOTE_QUERY: {
+            puf::MAC hashed_mac;
+            memcpy(hashed_mac.bytes, request.hashed_mac, sizeof(request.hashed_mac));
+
+            // All units of the lease are taken in one step, so they cost a single journal record or file write
+            int granted;
+            puf::QueryResult result = as.take(hashed_mac, request.take, granted);
+            reply.status = result.valid ? REMOTE_VALID : REMOTE_INVALID;
+            if(result.valid) {
+                reply.granted = granted;
+
+                if(request.want_point) {
+                    std::string point = result.ecp.base64();
+                    body.append( reinterpret_cast<const char*>(result.mac.bytes), sizeof(result.mac.bytes) );
+                    body.push_back( static_cast<char>(point.size()) );
+                    body.append(point);
+                }
+            }
+            break;
+        }
+
+        case REMOTE_STORE: {
+            CompactEntry entry{};
+            puf::MAC base_mac, hashed_mac;
+            puf::ECP_Point A;
+
+            memcpy(&entry, payload, sizeof(entry));
+            if( entry.point_len >= POINT_CAPACITY || entry.point[entry.point_len] != '\0' ) {
+                throw std::invalid_argument("Malformed supplicant entry");
+            }
+            memcpy(base_mac.bytes, entry.base_mac, sizeof(entry.base_mac));
+            memcpy(hashed_mac.bytes, entry.hashed_mac, sizeof(entry.hashed_mac));
+            A.from_base64( reinterpret_cast<const uint8_t*>(entry.point) );
+            as.store(base_mac, A, hashed_mac, entry.ctr);
+            break;
+        }
+
+        case REMOTE_SYNC:
+            as.sync();
+            break;
+
+        case REMOTE_RELOAD:
+            as.reload();
+            break;
+
+        default:
+            reply.status = REMOTE_ERROR;
+    }
+
+    reply.length = body.size();
+    output.append( reinterpret_cast<const char*>(&reply), sizeof(reply) );
+    output.append(body);
+}
+
+
+bool RemoteServer::on_readable(int fd, Client& client) {
+    char buffer[65536];
+
+    while(true) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if(n == 0) return false;
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        client.input.append(buffer, n);
+    }
+
+    // Answer every complete request, a partial one waits for the next read
+    size_t pos = 0;
+    while(client.input.size() - pos >= sizeof(RemoteRequest)) {
+        RemoteRequest request;
+        memcpy(&request, client.input.data() + pos, sizeof(request));
+        if(request.length > REMOTE_MAX_PAYLOAD || (request.op == REMOTE_STORE && request.length != sizeof(CompactEntry))) {
+            std::cerr << "Malformed request, dropping client" << std::endl;
+            return false;
+        }
+        if(client.input.size() - pos < sizeof(request) + request.length) break;
+
+        try {
+            handle(request, client.input.data() + pos + sizeof(request), client.output);
+        } catch(const std::exception &e) {
+            std::cerr << "Error handling request: " << e.what() << std::endl;
+            RemoteReply reply = {0, REMOTE_ERROR, 0, 0, request.id};
+            client.output.append( reinterpret_cast<const char*>(&reply), sizeof(reply) );
+        }
+        pos += sizeof(request) + request.length;
+    }
+    client.input.erase(0, pos);
+    return true;
+}
+
+
+void RemoteServer::run() {
+    std::vector<struct pollfd> fds;
+
+    while(true) {
+        fds.clear();
+        fds.push_back( {stop_fd, POLLIN, 0} );
+        fds.push_back( {listen_fd, POLLIN, 0} );
+        for(auto &[fd, client] : clients) {
+            fds.push_back( {fd, static_cast<short>(POLLIN | (client.output.empty() ? 0 : POLLOUT)), 0} );
+        }
+
+        if( poll(fds.data(), fds.size(), -1) < 0 ) {
+            if(errno == EINTR) continue;
+            std::cerr << "Error serving " << address << ": " << strerror(errno) << '\n';
+            return;
+        }
+        if(fds[0].revents) return;
+
+        if(fds[1].revents & POLLIN) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if(fd >= 0) clients[fd];
+        }
+
+        for(size_t i=2; i<fds.size(); ++i) {
+            int fd = fds[i].fd;
+            Client &client = clients[fd];
+            bool alive = !(fds[i].revents & (POLLERR | POLLNVAL));
+
+            if( alive && (fds[i].revents & (POLLIN | POLLHUP)) ) alive = on_readable(fd, client);
+            if( alive && !client.output.empty() ) {
+                ssize_t n = send(fd, client.output.data(), client.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                if(n > 0) client.output.erase(0, n);
+                else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) alive = false;
+            }
+            if(!alive) {
+                close(fd);
+                clients.erase(fd);
+            }
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <thread>
+#include "Authentication_Server.h"
+#include "Remote_Protocol.h"
+
+
+/* Reference server of the remote protocol, serves an AuthenticationServerImpl to RemoteAuthenticationServer
+ * clients. A single thread answers all connections, requests of one connection in the order they arrive and
+ * all answers to one read in a single write.
+ *
+ * The protocol has no authentication: anyone able to connect can take counters and store supplicants.
+ * Serve on a UNIX socket or the loopback address, or only on a network where every host is trusted. */
+class RemoteServer {
+private:
+    struct Client {
+        std::string input;
+        std::string output;
+    };
+
+    AuthenticationServerImpl &as;
+    std::string address;
+    int listen_fd;
+    int stop_fd;
+    std::thread server;
+    std::map<int, Client> clients;
+
+    void run();
+    bool on_readable(int fd, Client& client);
+    void handle(const RemoteRequest& request, const char *payload, std::string& output);
+    bool loopback_only() const;
+
+public:
+    RemoteServer(AuthenticationServerImpl& as_, const std::string& address_);
+    ~RemoteServer();
+    void start();
+    void stop();
+};
@@ -0,0 +1,112 @@
+#include "Resource_Watcher.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+
+constexpr int SETTLE_MS = 100;      // Quiet time after the last event before the file is read
+
+
+ResourceWatcher::ResourceWatcher(const std::string& path, std::function<void()> on_change_) :
+    on_change(on_change_),
+    inotify_fd(-1),
+    stop_fd(-1)
+{
+    // Watch the directory, editors and the journal compaction replace the file instead of writing it in place
+    size_t slash = path.find_last_of('/');
+    dir = (slash == std::string::npos) ? "." : path.substr(0, slash ? slash : 1);
+    name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+
+ResourceWatcher::~ResourceWatcher() {
+    stop();
+}
+
+
+void ResourceWatcher::start() {
+    if( (inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0 ) {
+        throw std::runtime_error( std::string("Error creating inotify instance: ") + strerror(errno) );
+    }
+    if( inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ) {
+        int err = errno;
+        close(inotify_fd);
+        inotify_fd = -1;
+        throw std::runtime_error( "Error watching " + dir + ": " + strerror(err) );
+    }
+    if( (stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ) {
+        int err = errno;
+        close(inotify_fd);
+        inotify_fd = -1;
+        throw std::runtime_error( std::string("Error creating eventfd: ") + strerror(err) );
+    }
+
+    watcher = std::thread(&ResourceWatcher::run, this);
+}
+
+
+void ResourceWatcher::stop() {
+    if(watcher.joinable()) {
+        uint64_t one = 1;
+        if( write(stop_fd, &one, sizeof(one)) < 0 ) {
+            std::cerr << "Error stopping resource watcher: " << strerror(errno) << '\n';
+        }
+        watcher.join();
+    }
+    if(inotify_fd >= 0) close(inotify_fd);
+    if(stop_fd >= 0) close(stop_fd);
+    inotify_fd = stop_fd = -1;
+}
+
+
+/* Drains pending events, returns true if one of them concerns the watched file */
+bool ResourceWatcher::wait_for_change() {
+    alignas(struct inotify_event) char buf[4096];
+    bool retval = false;
+    ssize_t len;
+
+    while( (len = read(inotify_fd, buf, sizeof(buf))) > 0 ) {
+        for(char *p = buf; p < buf + len; ) {
+            auto *event = reinterpret_cast<struct inotify_event*>(p);
+            if(event->len && name == event->name) retval = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return retval;
+}
+
+
+void ResourceWatcher::run() {
+    struct pollfd fds[2] = {
+        { inotify_fd, POLLIN, 0 },
+        { stop_fd, POLLIN, 0 },
+    };
+    bool pending = false;
+
+    while(true) {
+        int ready = poll(fds, 2, pending ? SETTLE_MS : -1);
+        if(ready < 0) {
+            if(errno == EINTR) continue;
+            std::cerr << "Error watching resource file: " << strerror(errno) << '\n';
+            return;
+        }
+        if(fds[1].revents) return;
+
+        if(ready == 0) {
+            pending = false;
+            try {
+                on_change();
+            } catch(const std::exception &e) {
+                std::cerr << "Error reloading resource file: " << e.what() << '\n';
+            }
+        } else if( wait_for_change() ) {
+            pending = true;
+        }
+    }
+}
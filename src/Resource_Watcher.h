@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <functional>
+
+
+/* Watches a single file with inotify and calls on_change from a background thread once the file
+ * was rewritten (closed after writing or renamed into place). Bursts of events are coalesced. */
+class ResourceWatcher {
+private:
+    std::string dir;
+    std::string name;
+    std::function<void()> on_change;
+    int inotify_fd;
+    int stop_fd;
+    std::thread watcher;
+
+    bool wait_for_change();
+    void run();
+
+public:
+    ResourceWatcher(const std::string& path, std::function<void()> on_change_);
+    ~ResourceWatcher();
+    void start();
+    void stop();
+};
@@ -0,0 +1,129 @@
+#include "Serial_Fleet.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+
+
+SerialFleet::SerialFleet(const std::vector<std::string>& ports) {
+    for(const auto &port : ports) {
+        slaves.push_back( std::make_unique<SerialMaster>(port, true) );
+    }
+}
+
+
+/* Sends instruction to every slave, done gets the results in the order of the ports */
+void SerialFleet::all(void (SerialMaster::*instruction)(SerialMaster::Reply), Done done) {
+    auto results = std::make_shared<std::vector<Result>>( slaves.size() );
+    auto remaining = std::make_shared<size_t>( slaves.size() );
+
+    if( slaves.empty() ) {
+        done(*results);
+        return;
+    }
+
+    for(size_t i=0; i<slaves.size(); ++i) {
+        (*results)[i].port = slaves[i]->get_port();
+        ((*slaves[i]).*instruction)([results, remaining, done, i](bool ok, const std::string& reply) {
+            (*results)[i].ok = ok;
+            (*results)[i].reply = reply;
+            if(--*remaining == 0) done(*results);
+        });
+    }
+}
+
+
+void SerialFleet::connect_all(Done done) {
+    all(&SerialMaster::slave_connect, done);
+}
+
+
+void SerialFleet::sign_up_all(Done done) {
+    all(&SerialMaster::slave_sign_up, done);
+}
+
+
+void SerialFleet::status_all(Done done) {
+    all(&SerialMaster::slave_status, done);
+}
+
+
+void SerialFleet::speedtest_all(Done done) {
+    all(&SerialMaster::slave_speedtest_prepare, [this, done](const std::vector<Result>& prepared) {
+        auto results = std::make_shared<std::vector<Result>>(prepared);
+        auto remaining = std::make_shared<size_t>( std::count_if(prepared.begin(), prepared.end(), [](const Result& r) { return r.ok; }) );
+
+        if(*remaining == 0) {
+            done(*results);
+            return;
+        }
+
+        // Nothing but writing the parameters happens between the starts
+        for(size_t i=0; i<slaves.size(); ++i) {
+            if( !prepared[i].ok ) continue;
+            slaves[i]->slave_speedtest_start([results, remaining, done, i](bool ok, const std::string& reply) {
+                (*results)[i].ok = ok;
+                (*results)[i].reply = reply;
+                if(--*remaining == 0) done(*results);
+            });
+        }
+    });
+}
+
+
+void SerialFleet::add_pollfds(std::vector<struct pollfd>& fds) const {
+    for(const auto &slave : slaves) {
+        if(slave->fd() < 0) continue;
+        struct pollfd pfd = {0};
+        pfd.fd = slave->fd();
+        pfd.events = POLLIN | (slave->wants_write() ? POLLOUT : 0);
+        fds.push_back(pfd);
+    }
+}
+
+
+void SerialFleet::handle_pollfds(const std::vector<struct pollfd>& fds, size_t first) {
+    for(size_t i=first; i<fds.size(); ++i) {
+        if( !fds[i].revents ) continue;
+        for(auto &slave : slaves) {
+            if(slave->fd() != fds[i].fd) continue;
+            slave->handle_io(fds[i].revents & (POLLIN | POLLHUP | POLLERR), fds[i].revents & POLLOUT);
+            break;
+        }
+    }
+}
+
+
+int SerialFleet::timeout_ms() const {
+    int retval = -1;
+    for(const auto &slave : slaves) {
+        int timeout = slave->timeout_ms();
+        if(timeout >= 0 && (retval < 0 || timeout < retval)) retval = timeout;
+    }
+    return retval;
+}
+
+
+void SerialFleet::expire() {
+    for(auto &slave : slaves) {
+        slave->expire();
+    }
+}
+
+
+void SerialFleet::wait_for(const bool& done) {
+    std::vector<struct pollfd> fds;
+
+    while(!done) {
+        fds.clear();
+        add_pollfds(fds);
+
+        int n = poll(fds.data(), fds.size(), timeout_ms());
+        if(n < 0 && errno != EINTR) {
+            std::cerr << "Error polling serial ports\n";
+            return;
+        }
+        if(n > 0) handle_pollfds(fds, 0);
+        expire();
+    }
+}
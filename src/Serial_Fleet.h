@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <poll.h>
+#include "Serial_Master.h"
+
+
+/* Drives the slaves on several serial ports at once. Every instruction goes to all connected slaves
+ * concurrently and completes once each of them answered or timed out.
+ * Like SerialMaster, the fleet is driven through add_pollfds/handle_pollfds and expire. */
+class SerialFleet {
+public:
+    struct Result {
+        std::string port;
+        bool ok;
+        std::string reply;
+    };
+    using Done = std::function<void(const std::vector<Result>& results)>;
+
+private:
+    std::vector<std::unique_ptr<SerialMaster>> slaves;
+
+    void all(void (SerialMaster::*instruction)(SerialMaster::Reply), Done done);
+
+public:
+    SerialFleet(const std::vector<std::string>& ports);
+    size_t size() const { return slaves.size(); }
+
+    void connect_all(Done done);
+    void sign_up_all(Done done);
+    void status_all(Done done);
+
+    /* Synchronised start: the parameters that start the test go out back to back only after every slave
+     * confirmed it is ready. Slaves that are not ready fail and are left out. */
+    void speedtest_all(Done done);
+
+    /* Appends one entry per connected slave, handle_pollfds takes the polled entries from first on */
+    void add_pollfds(std::vector<struct pollfd>& fds) const;
+    void handle_pollfds(const std::vector<struct pollfd>& fds, size_t first);
+
+    /* Milliseconds until the first instruction times out, -1 if none is pending */
+    int timeout_ms() const;
+    void expire();
+
+    /* Blocks until done was called */
+    void wait_for(const bool& done);
+};
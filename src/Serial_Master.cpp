@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <cstring>
 #include <termios.h>
+#include <poll.h>
 #include <unistd.h>
 #include <thread>
 
@@ -60,7 +61,7 @@ UserDialog::UserDialog() {
 void UserDialog::draw_screen() {
     std::cout << "\nPlease choose your option:" << std::endl;
 
-    for(auto i=0; i<main_menu.size(); ++i) {
+    for(size_t i=0; i<main_menu.size(); ++i) {
         const auto& [description, default_val, _] = main_menu.at(i);
 
         // Draw line
@@ -173,12 +174,44 @@ int UserDialog::config_options() {
 /*-------------------------------------------------------------------------------------------------*/
 
 
-SerialMaster::SerialMaster(std::string port_) : connected(false) {
-    global_options.port = port_;
+constexpr size_t MAX_REPLY = 4096;      // Longer input without EOL is discarded
+
+
+static bool baud_constant(int baudrate, speed_t& speed) {
+    static const std::pair<int, speed_t> rates[] = {
+        {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600}, {115200, B115200},
+        {230400, B230400}, {460800, B460800}, {500000, B500000}, {576000, B576000}, {921600, B921600},
+        {1000000, B1000000}, {1152000, B1152000}, {1500000, B1500000}, {2000000, B2000000},
+        {2500000, B2500000}, {3000000, B3000000}, {3500000, B3500000}, {4000000, B4000000},
+    };
+
+    for(const auto &rate : rates) {
+        if(rate.first == baudrate) {
+            speed = rate.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+SerialMaster::SerialMaster(std::string port_, bool fixed_port_) :
+    port(port_),
+    fixed_port(fixed_port_),
+    serial_port(-1),
+    connected(false)
+{
+    if(!fixed_port) global_options.port = port_;
     setup();
 }
 
 
+SerialMaster::~SerialMaster() {
+    // Pending callbacks may refer to objects that are gone already, they are dropped silently
+    if(serial_port >= 0) close(serial_port);
+}
+
+
 void SerialMaster::reconnect() {
     setup();
 }
@@ -186,12 +219,28 @@ void SerialMaster::reconnect() {
 
 void SerialMaster::setup() {
     std::string devdir = "/dev/";
-    devdir += global_options.port;
+    if(!fixed_port) port = global_options.port;
+    devdir += port;
+
+    if(serial_port >= 0) {
+        close(serial_port);
+        serial_port = -1;
+        connected = false;
+        output.clear();
+        input.clear();
+        fail_all("Reconnected");
+    }
 
     std::cout << "Connecting to port " << devdir << std::endl;
 
+    speed_t speed;
+    if( !baud_constant(global_options.baudrate, speed) ) {
+        printf("Unsupported baudrate %d\n", global_options.baudrate);
+        return;
+    }
+
     /* Open port */
-    serial_port = open(devdir.c_str(), O_RDWR);
+    serial_port = open(devdir.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
     if(serial_port < 0) {
         printf("Error %d from open: %s\n", errno, std::strerror(errno));
         return;
@@ -203,27 +252,32 @@ void SerialMaster::setup() {
 
     if( tcgetattr(serial_port, &tty) != 0 ) {
         printf("Error %d from tcgetattr: %s\n", errno, std::strerror(errno));
+        close(serial_port);
+        serial_port = -1;
         return;
     }
 
-    cfsetospeed(&tty, (speed_t)B115200);
-    cfsetispeed(&tty, (speed_t)B115200);
+    cfmakeraw(&tty);
+    cfsetospeed(&tty, speed);
+    cfsetispeed(&tty, speed);
 
     tty.c_cflag &= ~PARENB;
     tty.c_cflag &= ~CSTOPB;
     tty.c_cflag &= ~CSIZE;
     tty.c_cflag |= CS8;
     tty.c_cflag &= ~CRTSCTS;
-    tty.c_cflag &= ~ICANON;
-    tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 50;
     tty.c_cflag |= CREAD | CLOCAL;
 
-    cfmakeraw(&tty);
+    // Reads return at once, waiting happens in poll
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+
     tcflush(serial_port, TCIFLUSH);
 
     if(tcsetattr(serial_port, TCSANOW, &tty) != 0) {
         printf("Error %d from tcsetattr: %s\n", errno, std::strerror(errno));
+        close(serial_port);
+        serial_port = -1;
         return;
     }
 
@@ -231,112 +285,241 @@ void SerialMaster::setup() {
 }
 
 
-int SerialMaster::serial_write(const char *cmd) {
-    size_t n = 0, n_written = 0;
-    size_t cmdLen = strlen(cmd);
+void SerialMaster::queue(const std::string& cmd, const std::string& expected, Reply done, int timeout_ms) {
+    if(!connected) {
+        done(false, "Not connected");
+        return;
+    }
 
-    do {
-        n = write(serial_port, (cmd+n_written), 1);
-        n_written += n;
-    } while(n>0 && n_written<cmdLen);
+    Pending request;
+    request.expected = expected;
+    request.done = done;
+    request.timeout = std::chrono::milliseconds(timeout_ms);
+    request.deadline = std::chrono::steady_clock::now() + request.timeout;
+    pending.push_back(request);
 
-    write(serial_port, &EOL, 1);
+    output += cmd;
+    output += EOL;
+    flush();
+}
 
-    return n_written;
+
+void SerialMaster::flush() {
+    while(connected && !output.empty()) {
+        ssize_t n = write(serial_port, output.data(), output.size());
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) return;
+            printf("Error %d from write: %s\n", errno, std::strerror(errno));
+            output.clear();
+            fail_all(std::strerror(errno));
+            return;
+        }
+        output.erase(0, n);
+    }
 }
 
 
-int SerialMaster::serial_read(char *cmd, size_t cmdLen) {
-    char buf = '\0';
-    size_t n = 0, n_written = 0;
+void SerialMaster::fill() {
+    char buf[256];
+    ssize_t n;
+
+    while( connected && (n = read(serial_port, buf, sizeof(buf))) != 0 ) {
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        input.append(buf, n);
+    }
 
-    do {
-        if( (n = read(serial_port, &buf, 1)) == 1 ) {
-            cmd[n_written++] = buf;
-            n_written %= cmdLen;    // Dirty little hack to prevent buffer overflows
+    size_t eol;
+    while( (eol = input.find(EOL)) != std::string::npos ) {
+        std::string reply = input.substr(0, eol);
+        input.erase(0, eol + 1);
+        while( !reply.empty() && (reply.back() == '\r' || reply.back() == '\n') ) reply.pop_back();
+
+        if( pending.empty() ) {
+            if(on_message) {
+                on_message(reply);
+            } else {
+                std::cout << "Slave: " << reply << std::endl;
+            }
+            continue;
         }
-    } while(n>0 && buf != EOL);
 
-    --n_written;
+        // Replies come in order, the next instruction is timed from now on
+        Pending request = pending.front();
+        pending.pop_front();
+        if( !pending.empty() ) {
+            pending.front().deadline = std::chrono::steady_clock::now() + pending.front().timeout;
+        }
+        bool ok = reply.compare(0, request.expected.size(), request.expected) == 0;
+        request.done(ok, reply);
+    }
 
-    cmd[n_written] = '\0';
-    return n_written;  // Returns no nullbyte but includes EOL
+    if(input.size() > MAX_REPLY) {
+        printf("Discarding %zu bytes from slave without EOL\n", input.size());
+        input.clear();
+    }
 }
 
 
-void SerialMaster::show_status() {
-    print_serial_options();
-    std::cout << std::setw(14) << std::left << "Connected:" << std::boolalpha << connected << std::endl;
+void SerialMaster::fail_all(const std::string& reason) {
+    std::deque<Pending> failed;
+    failed.swap(pending);
+    for(auto &request : failed) {
+        request.done(false, reason);
+    }
 }
 
 
-void SerialMaster::slave_connect() {
+void SerialMaster::handle_io(bool readable, bool writable) {
+    if(writable) flush();
+    if(readable) fill();
+}
 
-    const char cmd[] = "connect"; 
-    char rcv_buf[512];
-    memset(rcv_buf, 0, sizeof(rcv_buf));
 
-    serial_write(cmd);
-    serial_read(rcv_buf, sizeof(rcv_buf));
+int SerialMaster::timeout_ms() const {
+    using namespace std::chrono;
+    if( pending.empty() ) return -1;
+
+    auto left = duration_cast<milliseconds>(pending.front().deadline - steady_clock::now()).count();
+    return left > 0 ? static_cast<int>(left) : 0;
+}
 
-    if( strncmp(rcv_buf, "connect_ok\r", sizeof(rcv_buf)) != 0 ) {
-        printf("Error connecting: %s\n", rcv_buf);
-    }
 
-    puts("Received connect_ok");
+void SerialMaster::expire() {
+    // A late reply would be taken for the answer to the next instruction, so everything queued fails
+    if( !pending.empty() && pending.front().deadline <= std::chrono::steady_clock::now() ) {
+        output.clear();
+        fail_all("Timeout");
+    }
 }
 
 
-void SerialMaster::slave_status() {
-    const char cmd[] = "status"; 
-    char rcv_buf[512];
-    memset(rcv_buf, 0, sizeof(rcv_buf));
+void SerialMaster::service(int timeout_ms) {
+    if(!connected) return;
 
-    serial_write(cmd);
-    serial_read(rcv_buf, sizeof(rcv_buf));
+    struct pollfd pfd = {0};
+    pfd.fd = serial_port;
+    pfd.events = POLLIN | (wants_write() ? POLLOUT : 0);
 
-    puts(rcv_buf);
+    int n = poll(&pfd, 1, timeout_ms);
+    if(n < 0) {
+        if(errno != EINTR) fail_all(std::strerror(errno));
+        return;
+    }
+    if(n > 0) {
+        handle_io(pfd.revents & (POLLIN | POLLHUP | POLLERR), pfd.revents & POLLOUT);
+    }
+    expire();
 }
 
 
-void SerialMaster::slave_sign_up() {
-    const char cmd[] = "register"; 
-    char rcv_buf[512];
-    serial_write(cmd);
-    serial_read(rcv_buf, sizeof(rcv_buf));
-    puts(rcv_buf);
-
-    if( strncmp(rcv_buf, "register_ok", sizeof(rcv_buf)) != 0 ) {
-        puts("Error register");
+void SerialMaster::wait_for(const bool& done) {
+    while(!done && connected) {
+        service(timeout_ms());
     }
-    puts("Received register_ok");
 }
 
 
-void SerialMaster::slave_speedtest() {
-    char cmd[512] = "speedtest";
-    char rcv_buf[512];
+void SerialMaster::show_status() {
+    print_serial_options();
+    std::cout << std::setw(14) << std::left << "Connected:" << std::boolalpha << connected << std::endl;
+}
 
-    memset(rcv_buf, 0, sizeof(rcv_buf));
 
-    serial_write(cmd);
-    serial_read(rcv_buf, sizeof(rcv_buf));
+void SerialMaster::slave_connect(Reply done) {
+    queue("connect", "connect_ok", done);
+}
+
+
+void SerialMaster::slave_sign_up(Reply done) {
+    queue("register", "register_ok", done);
+}
 
-    if( strncmp(rcv_buf, "speedtest_ok", sizeof(rcv_buf)) != 0 ) {
-        printf("Wrong answer: %s\n", rcv_buf);
-        return;
-    }
 
-    memset(cmd, 0, sizeof(cmd));
-    memset(rcv_buf, 0, sizeof(rcv_buf));
+void SerialMaster::slave_status(Reply done) {
+    queue("status", "", done);
+}
+
+
+void SerialMaster::slave_speedtest_prepare(Reply done) {
+    queue("speedtest", "speedtest_ok", done);
+}
+
 
+void SerialMaster::slave_speedtest_start(Reply done) {
     /* Build command */
-    snprintf(cmd, sizeof(cmd), "%c%d%c%d%c%d", 
-        DELIM, global_options.speedtest_seconds, DELIM, 
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%c%d%c%d%c%d",
+        DELIM, global_options.speedtest_seconds, DELIM,
         global_options.delay_us, DELIM, global_options.frame_size);
 
-    serial_write(cmd);
-    serial_read(rcv_buf, sizeof(rcv_buf));
+    // The slave reports once its test is over
+    queue(cmd, "", done, REPLY_TIMEOUT_MS + global_options.speedtest_seconds * 1000);
+}
+
+
+void SerialMaster::slave_speedtest(Reply done) {
+    slave_speedtest_prepare([this, done](bool ok, const std::string& reply) {
+        if(!ok) {
+            done(false, reply);
+            return;
+        }
+        slave_speedtest_start(done);
+    });
+}
+
 
-    puts(rcv_buf);
-}
\ No newline at end of file
+void SerialMaster::slave_connect() {
+    bool done = false;
+    slave_connect([&](bool ok, const std::string& reply) {
+        if(ok) {
+            puts("Received connect_ok");
+        } else {
+            printf("Error connecting: %s\n", reply.c_str());
+        }
+        done = true;
+    });
+    wait_for(done);
+}
+
+
+void SerialMaster::slave_status() {
+    bool done = false;
+    slave_status([&](bool ok, const std::string& reply) {
+        if(ok) {
+            puts(reply.c_str());
+        } else {
+            printf("Error status: %s\n", reply.c_str());
+        }
+        done = true;
+    });
+    wait_for(done);
+}
+
+
+void SerialMaster::slave_sign_up() {
+    bool done = false;
+    slave_sign_up([&](bool ok, const std::string& reply) {
+        puts(reply.c_str());
+        puts(ok ? "Received register_ok" : "Error register");
+        done = true;
+    });
+    wait_for(done);
+}
+
+
+void SerialMaster::slave_speedtest() {
+    bool done = false;
+    slave_speedtest([&](bool ok, const std::string& reply) {
+        if(ok) {
+            puts(reply.c_str());
+        } else {
+            printf("Wrong answer: %s\n", reply.c_str());
+        }
+        done = true;
+    });
+    wait_for(done);
+}
@@ -3,6 +3,9 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <deque>
+#include <chrono>
+#include <functional>
 
 enum UserInput {
     STATUS,
@@ -31,20 +34,58 @@ public:
 };
 
 
+/* Line protocol to the ESP slave over a non-blocking serial port. Commands and replies are terminated by EOT.
+ *
+ * Instructions are queued and answered in order: the asynchronous versions return at once and call done
+ * with the reply once it arrived, or with ok=false if the slave answered wrongly or not in time. The caller
+ * drives the port by polling fd() for reading and, if wants_write(), for writing, passing the results to
+ * handle_io, and calling expire() after at most timeout_ms(). Callers without such a loop call service() from
+ * time to time instead. The blocking versions do this on their own. */
 class SerialMaster {
+public:
+    using Reply = std::function<void(bool ok, const std::string& reply)>;
+    using Message = std::function<void(const std::string& message)>;
+
 private:
+    static constexpr int REPLY_TIMEOUT_MS = 5000;
+
+    struct Pending {
+        std::string expected;       // Reply prefix meaning success, empty accepts any reply
+        Reply done;
+        std::chrono::milliseconds timeout;
+        std::chrono::steady_clock::time_point deadline;     // Counts from when the instruction is next in line
+    };
+
+    std::string port;
+    bool fixed_port;                // Otherwise the port follows the configured one on reconnect
     int serial_port;
     bool connected;
-
-    int serial_write(const char *cmd);
-    int serial_read(char *cmd, size_t cmdLen);
+    std::string output;             // Not yet written
+    std::string input;              // Received, not yet framed
+    std::deque<Pending> pending;
+    Message on_message;
 
     void setup();
+    void queue(const std::string& cmd, const std::string& expected, Reply done, int timeout_ms = REPLY_TIMEOUT_MS);
+    void flush();
+    void fill();
+    void fail_all(const std::string& reason);
 
 public:
-    SerialMaster(std::string port_);
+    SerialMaster(std::string port_, bool fixed_port_ = false);
+    ~SerialMaster();
+
+    /* Instructions sent to slave, asynchronous */
+    void slave_connect(Reply done);
+    void slave_sign_up(Reply done);
+    void slave_status(Reply done);
+    void slave_speedtest(Reply done);
+
+    /* The two halves of slave_speedtest: the slave gets ready, then starts sending as soon as the parameters arrive */
+    void slave_speedtest_prepare(Reply done);
+    void slave_speedtest_start(Reply done);
 
-    /* Instructions sent to slave */
+    /* Instructions sent to slave, blocking until answered */
     void slave_connect();
     void slave_sign_up();
     void slave_status();
@@ -52,4 +93,23 @@ public:
 
     void reconnect();
     void show_status();
-};
\ No newline at end of file
+
+    /* Port descriptor for poll/epoll, -1 if not connected. Changes on reconnect. */
+    int fd() const { return connected ? serial_port : -1; }
+    const std::string& get_port() const { return port; }
+    bool wants_write() const { return connected && !output.empty(); }
+    void handle_io(bool readable, bool writable);
+
+    /* Milliseconds until the oldest instruction times out, -1 if none is pending */
+    int timeout_ms() const;
+    void expire();
+
+    /* Handles what the port is ready for within timeout_ms, then expires overdue instructions */
+    void service(int timeout_ms);
+
+    /* Services the port until done is set or the connection is lost */
+    void wait_for(const bool& done);
+
+    /* Receives what the slave sends without being asked */
+    void set_message_handler(Message handler) { on_message = handler; }
+};
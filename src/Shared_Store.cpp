@@ -0,0 +1,482 @@
+#include "Shared_Store.h"
+
+#include <new>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+#include <iostream>
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+constexpr char SharedSupplicantStore::MAGIC[8];
+
+constexpr size_t MIN_CAPACITY = 4096;
+constexpr int ATTACH_TIMEOUT_MS = 30000;
+
+
+static uint64_t slot_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+
+static bool process_gone(int32_t pid) {
+    return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+
+
+/* ---------------------------------- SharedSupplicantStore Implementation -----------------------------------*/
+
+SharedSupplicantStore::SharedSupplicantStore(const std::string& name_) :
+    name(name_.empty() || name_[0] != '/' ? "/" + name_ : name_),
+    fd(-1),
+    header(nullptr),
+    slots(nullptr),
+    map_len(0),
+    owning(false),
+    journal(nullptr)
+{
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd >= 0) {
+        owning = true;      // Sized and filled by create()
+        return;
+    }
+    if(errno != EEXIST || (fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0)) < 0) {
+        throw std::runtime_error("Cannot open shared store " + name + ": " + strerror(errno));
+    }
+
+    // The owner may still be loading the resource file
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ATTACH_TIMEOUT_MS);
+    while(!ready()) {
+        struct stat st;
+        if(fstat(fd, &st) < 0) {
+            throw std::runtime_error("Cannot stat shared store " + name + ": " + strerror(errno));
+        }
+        if(!header && static_cast<size_t>(st.st_size) > sizeof(SharedStoreHeader)) map(st.st_size);
+
+        if( header && process_gone(header->owner.load()) && !ready() ) {
+            throw std::runtime_error("Shared store " + name + " was left incomplete by process "
+                                     + std::to_string(header->owner.load()) + ", remove /dev/shm" + name);
+        }
+        if(std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("Timed out waiting for shared store " + name + ", remove /dev/shm" + name + " if its owner is gone");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if( memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION ) {
+        throw std::runtime_error("Invalid or incompatible shared store " + name);
+    }
+
+    take_over();
+}
+
+
+SharedSupplicantStore::~SharedSupplicantStore() {
+    if(header) munmap(header, map_len);
+    if(fd >= 0) close(fd);
+}
+
+
+bool SharedSupplicantStore::take_over() {
+    int32_t pid = header->owner.load();
+    if( owning || !process_gone(pid) || !header->owner.compare_exchange_strong(pid, getpid()) ) return false;
+
+    std::cout << "Took over shared store " << name << " from process " << pid << std::endl;
+    owning = true;
+    return true;
+}
+
+
+bool SharedSupplicantStore::take_dirty() {
+    return header->dirty.exchange(0, std::memory_order_acq_rel) != 0;
+}
+
+
+// Journals a change if this process owns a journal, otherwise leaves it to the owner's next snapshot.
+// The flag is only written when it is clear, so changes between two snapshots leave its cache line shared.
+template<typename F> void SharedSupplicantStore::changed(F record) {
+    if( SupplicantJournal *j = journal.load(std::memory_order_acquire) ) {
+        record(*j);
+    } else if( !header->dirty.load(std::memory_order_relaxed) ) {
+        header->dirty.store(1, std::memory_order_release);
+    }
+}
+
+
+void SharedSupplicantStore::map(size_t len) {
+    void *mapped = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mapped == MAP_FAILED) {
+        throw std::runtime_error("Cannot map shared store " + name + ": " + strerror(errno));
+    }
+    header = static_cast<SharedStoreHeader*>(mapped);
+    slots = reinterpret_cast<SharedSlot*>( static_cast<uint8_t*>(mapped) + sizeof(SharedStoreHeader) );
+    map_len = len;
+}
+
+
+void SharedSupplicantStore::create(size_t entries) {
+    size_t capacity = MIN_CAPACITY;
+    while(capacity < 2 * entries) capacity <<= 1;
+
+    size_t len = sizeof(SharedStoreHeader) + capacity * sizeof(SharedSlot);
+    if(ftruncate(fd, len) < 0) {
+        throw std::runtime_error("Cannot size shared store " + name + ": " + strerror(errno));
+    }
+    map(len);
+
+    // Fresh pages are zero, i.e. every slot is empty at sequence 0
+    new (header) SharedStoreHeader;
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+    header->version = VERSION;
+    header->state.store(LOADING);
+    header->owner.store(getpid());
+    header->dirty.store(0);
+    header->capacity = capacity;
+    header->used.store(0);
+    header->live.store(0);
+    header->moving.store(0);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->writer, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+void SharedSupplicantStore::publish() {
+    header->state.store(READY, std::memory_order_release);
+}
+
+
+void SharedSupplicantStore::lock() {
+    if(pthread_mutex_lock(&header->writer) != EOWNERDEAD) return;
+
+    recover();
+    pthread_mutex_consistent(&header->writer);
+    std::cerr << "Recovered shared store " << name << " from a crashed writer" << std::endl;
+}
+
+
+/* Repairs what a writer left behind when it died holding the lock. Slots it left half written cannot be trusted.
+ * An entry it was moving is kept at its new slot if that was written completely, otherwise at its old one. */
+void SharedSupplicantStore::recover() {
+    for(size_t i=0; i<header->capacity; ++i) {
+        SharedSlot &slot = slots[i];
+        uint32_t seq = slot.seq.load();
+        if(seq & 1) {
+            slot.key.store(TOMBSTONE);
+            slot.seq.store(seq + 1, std::memory_order_release);
+        }
+    }
+
+    for(size_t i=0; i<header->capacity; ++i) {
+        SharedSlot &slot = slots[i];
+        uint64_t key = slot.key.load();
+        uint64_t word = slot.counter.load();
+        if( key == EMPTY || key == TOMBSTONE || (word >> 32) == slot.seq.load() ) continue;
+
+        // Moves go to an earlier slot on the probe sequence, so a complete copy is found first
+        if( find_slot(key) != &slot ) {
+            write_slot(slot, TOMBSTONE, nullptr);
+        } else {
+            slot.counter.store( static_cast<uint64_t>(slot.seq.load()) << 32 | (word & 0xffffffff), std::memory_order_release );
+        }
+    }
+
+    uint64_t used = 0, live = 0;
+    for(size_t i=0; i<header->capacity; ++i) {
+        uint64_t key = slots[i].key.load();
+        if(key != EMPTY) used++;
+        if(key != EMPTY && key != TOMBSTONE) live++;
+    }
+    header->used.store(used);
+    header->live.store(live);
+    if(header->moving.load() & 1) header->moving.fetch_add(1, std::memory_order_release);
+}
+
+
+void SharedSupplicantStore::unlock() {
+    pthread_mutex_unlock(&header->writer);
+}
+
+
+// Taking the writer lock waits for a writer in the middle of a slot or a compaction, or recovers from a dead one
+void SharedSupplicantStore::settle() {
+    lock();
+    unlock();
+}
+
+
+SharedSlot* SharedSupplicantStore::find_slot(uint64_t key) {
+    size_t mask = header->capacity - 1;
+    size_t i = slot_hash(key) & mask;
+
+    for(size_t probes=0; probes<header->capacity; ++probes, i = (i + 1) & mask) {
+        uint64_t current = slots[i].key.load(std::memory_order_acquire);
+        if(current == key) return &slots[i];
+        if(current == EMPTY) return nullptr;
+    }
+    return nullptr;
+}
+
+
+// Slot to insert key into: the first tombstone on its probe sequence, otherwise the empty slot ending it.
+// Null if the key is present or an empty slot would fill the table beyond its load limit.
+SharedSlot* SharedSupplicantStore::free_slot(uint64_t key, bool& present) {
+    size_t mask = header->capacity - 1;
+    size_t i = slot_hash(key) & mask;
+    SharedSlot *target = nullptr;
+
+    present = false;
+    for(size_t probes=0; probes<header->capacity; ++probes, i = (i + 1) & mask) {
+        uint64_t current = slots[i].key.load(std::memory_order_relaxed);
+        if(current == key) {
+            present = true;
+            return nullptr;
+        }
+        if(current == TOMBSTONE && !target) target = &slots[i];
+        if(current == EMPTY) {
+            if(!target) target = &slots[i];
+            break;
+        }
+    }
+
+    // Probe sequences only end at empty slots, keep enough of them
+    bool fresh = target && target->key.load(std::memory_order_relaxed) == EMPTY;
+    if( fresh && (header->used.load() + 1) * 4 > header->capacity * 3 ) return nullptr;
+    return target;
+}
+
+
+void SharedSupplicantStore::write_slot(SharedSlot& slot, uint64_t key, const CompactEntry* entry) {
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if(entry) {
+        memcpy(slot.base_mac, entry->base_mac, sizeof(slot.base_mac));
+        memcpy(slot.hashed_mac, entry->hashed_mac, sizeof(slot.hashed_mac));
+        slot.point_len = entry->point_len;
+        memcpy(slot.point, entry->point, sizeof(slot.point));
+        slot.counter.store( static_cast<uint64_t>(seq + 2) << 32 | static_cast<uint32_t>(entry->ctr), std::memory_order_relaxed );
+    } else {
+        slot.counter.store(0, std::memory_order_relaxed);
+    }
+    slot.key.store(key, std::memory_order_relaxed);
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+
+// Moves an entry to a slot earlier on its probe sequence. Decrements still hitting the old slot fail on its
+// cleared generation and look the entry up again, once it is erased there they find it at the new slot.
+void SharedSupplicantStore::move_slot(SharedSlot& from, SharedSlot& to) {
+    uint64_t word = from.counter.load(std::memory_order_relaxed);
+    while( !from.counter.compare_exchange_weak(word, word & 0xffffffff, std::memory_order_acq_rel) ) {}
+
+    CompactEntry entry;
+    entry.ctr = static_cast<int32_t>(word & 0xffffffff);
+    memcpy(entry.base_mac, from.base_mac, sizeof(entry.base_mac));
+    memcpy(entry.hashed_mac, from.hashed_mac, sizeof(entry.hashed_mac));
+    entry.point_len = from.point_len;
+    memcpy(entry.point, from.point, sizeof(entry.point));
+
+    write_slot(to, from.key.load(std::memory_order_relaxed), &entry);
+    write_slot(from, TOMBSTONE, nullptr);
+}
+
+
+/* Writer lock held: moves every entry to the first tombstone on its probe sequence, then empties all tombstones.
+ * Clusters are walked front to back starting behind an empty slot, so a tombstone left by a move only lies on the
+ * probe sequences of entries still to come, and afterwards no probe sequence crosses a tombstone. */
+void SharedSupplicantStore::compact() {
+    size_t mask = header->capacity - 1;
+    size_t start = 0;
+    while(slots[start].key.load(std::memory_order_relaxed) != EMPTY) start = (start + 1) & mask;
+
+    header->moving.fetch_add(1);
+    for(size_t n=1; n<=header->capacity; ++n) {
+        SharedSlot &slot = slots[(start + n) & mask];
+        uint64_t key = slot.key.load(std::memory_order_relaxed);
+        if(key == EMPTY || key == TOMBSTONE) continue;
+
+        for(size_t j = slot_hash(key) & mask; &slots[j] != &slot; j = (j + 1) & mask) {
+            if(slots[j].key.load(std::memory_order_relaxed) == TOMBSTONE) {
+                move_slot(slot, slots[j]);
+                break;
+            }
+        }
+    }
+
+    for(size_t i=0; i<header->capacity; ++i) {
+        if(slots[i].key.load(std::memory_order_relaxed) == TOMBSTONE) write_slot(slots[i], EMPTY, nullptr);
+    }
+    header->used.store( header->live.load() );
+    header->moving.fetch_add(1, std::memory_order_release);
+}
+
+
+bool SharedSupplicantStore::insert(uint64_t key, const CompactEntry& entry) {
+    bool present;
+
+    lock();
+    SharedSlot *target = free_slot(key, present);
+
+    // Tombstones count against the load limit, make room by compacting them before giving up
+    if( !target && !present && header->used.load() > header->live.load() ) {
+        compact();
+        target = free_slot(key, present);
+    }
+    if(!target) {
+        unlock();
+        if(present) return false;
+        throw std::runtime_error("Shared store " + name + " is full");
+    }
+
+    bool fresh = target->key.load(std::memory_order_relaxed) == EMPTY;
+    write_slot(*target, key, &entry);
+    if(fresh) header->used.fetch_add(1);
+    header->live.fetch_add(1);
+    changed([&entry](SupplicantJournal& j) { j.insert( entry.to_string() ); });
+    unlock();
+    return true;
+}
+
+
+int SharedSupplicantStore::take(uint64_t key, int units, CompactEntry& entry) {
+    uint32_t moving = header->moving.load(std::memory_order_acquire);
+    SharedSlot *slot = find_slot(key);
+    uint64_t word;
+    uint64_t taken;
+
+    for(int spins=0; ; ++spins) {
+        if(spins == SPIN_LIMIT) {
+            settle();
+            spins = 0;
+        }
+
+        if(!slot) {
+            // Only a miss outside of any compaction means the key is not present
+            uint32_t current = header->moving.load(std::memory_order_acquire);
+            if( current == moving && !(current & 1) ) return -1;
+            moving = current;
+            slot = find_slot(key);
+            continue;
+        }
+
+        uint32_t seq = slot->seq.load(std::memory_order_acquire);
+        if(seq & 1) continue;
+        if(slot->key.load(std::memory_order_acquire) != key) {
+            slot = find_slot(key);      // Erased or moved meanwhile
+            continue;
+        }
+        word = slot->counter.load(std::memory_order_acquire);
+        memcpy(entry.base_mac, slot->base_mac, sizeof(entry.base_mac));
+        memcpy(entry.hashed_mac, slot->hashed_mac, sizeof(entry.hashed_mac));
+        entry.point_len = slot->point_len;
+        memcpy(entry.point, slot->point, sizeof(entry.point));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if( slot->seq.load(std::memory_order_relaxed) != seq || (word >> 32) != seq ) continue;
+
+        if( (word & 0xffffffff) == 0 ) {
+            // Exhausted, erase it unless someone changed it meanwhile
+            lock();
+            if( slot->key.load(std::memory_order_relaxed) == key && slot->counter.load(std::memory_order_relaxed) == word ) {
+                write_slot(*slot, TOMBSTONE, nullptr);
+                header->live.fetch_sub(1);
+                changed([key](SupplicantJournal& j) { j.erase(key); });
+            }
+            unlock();
+            entry.point_len = 0;
+            return 0;
+        }
+        taken = std::min<uint64_t>(units, word & 0xffffffff);
+        if( taken > 0 && !slot->counter.compare_exchange_weak(word, word - taken, std::memory_order_acq_rel) ) {
+            continue;
+        }
+        break;
+    }
+
+    if(taken > 0) {
+        changed([key, word, taken](SupplicantJournal& j) { j.counter(key, static_cast<int>((word - taken) & 0xffffffff)); });
+    }
+    entry.ctr = static_cast<int32_t>( (word - taken) & 0xffffffff );
+    return static_cast<int>(taken);
+}
+
+
+void SharedSupplicantStore::set_counter(uint64_t key, int ctr) {
+    lock();
+    if( SharedSlot *slot = find_slot(key) ) {
+        uint64_t generation = slot->counter.load(std::memory_order_relaxed) >> 32;
+        slot->counter.store( generation << 32 | static_cast<uint32_t>(ctr), std::memory_order_release );
+        changed([key, ctr](SupplicantJournal& j) { j.counter(key, ctr); });
+    }
+    unlock();
+}
+
+
+void SharedSupplicantStore::erase(uint64_t key) {
+    lock();
+    if( SharedSlot *slot = find_slot(key) ) {
+        write_slot(*slot, TOMBSTONE, nullptr);
+        header->live.fetch_sub(1);
+        changed([key](SupplicantJournal& j) { j.erase(key); });
+    }
+    unlock();
+}
+
+
+// Value of moving to compare after a pass over all slots, waits for a compaction in progress
+uint32_t SharedSupplicantStore::begin_pass() {
+    uint32_t moving;
+    for(int spins=0; (moving = header->moving.load(std::memory_order_acquire)) & 1; ++spins) {
+        if(spins == SPIN_LIMIT) {
+            settle();
+            spins = 0;
+        }
+    }
+    return moving;
+}
+
+
+// Consistent copy of a slot, false if it holds no entry
+bool SharedSupplicantStore::read_slot(const SharedSlot& slot, uint64_t& key, CompactEntry& entry) {
+    uint32_t seq;
+
+    for(int spins=0; ; ++spins) {
+        if(spins == SPIN_LIMIT) {
+            settle();
+            spins = 0;
+        }
+
+        seq = slot.seq.load(std::memory_order_acquire);
+        if(seq & 1) continue;
+        key = slot.key.load(std::memory_order_acquire);
+        entry.ctr = static_cast<int32_t>( slot.counter.load(std::memory_order_relaxed) & 0xffffffff );
+        memcpy(entry.base_mac, slot.base_mac, sizeof(entry.base_mac));
+        memcpy(entry.hashed_mac, slot.hashed_mac, sizeof(entry.hashed_mac));
+        entry.point_len = slot.point_len;
+        memcpy(entry.point, slot.point, sizeof(entry.point));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if( slot.seq.load(std::memory_order_relaxed) == seq ) break;
+    }
+    return key != EMPTY && key != TOMBSTONE;
+}
+
+
+size_t SharedSupplicantStore::size() const {
+    return header->live.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include <sys/types.h>
+#include "Authentication_Server.h"
+
+
+/* Layout of the shared memory segment:
+ *   SharedStoreHeader
+ *   SharedSlot[capacity]         open addressing with linear probing, capacity is a power of two
+ * Everything is accessed in place by all attached processes, so only fixed width and lock free types are used. */
+struct SharedStoreHeader {
+    char magic[8];
+    uint32_t version;
+    std::atomic<uint32_t> state;        // LOADING until the owner filled in the table, READY afterwards
+    std::atomic<int32_t> owner;         // Process loading and persisting the table
+    std::atomic<uint32_t> dirty;        // Set by changes the owner has not journaled, cleared by the owner's snapshot
+    uint64_t capacity;
+    std::atomic<uint64_t> used;         // Slots holding an entry or a tombstone
+    std::atomic<uint64_t> live;         // Slots holding an entry
+    std::atomic<uint32_t> moving;       // Odd while a compaction moves entries, readers missing an entry meanwhile look again
+    pthread_mutex_t writer;             // Process shared and robust, serialises inserts, erases and compactions
+};
+
+
+/* Readers copy the entry between two equal even values of seq. counter holds the generation of the slot,
+ * i.e. seq at the time it was written, in its upper and the supplicant counter in its lower half, so a
+ * decrement with compare and swap never hits an entry that replaced the one the reader found. An entry being
+ * moved by a compaction has its generation cleared, decrements on it fail until it is found at its new slot. */
+struct SharedSlot {
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> counter;
+    uint8_t base_mac[6];
+    uint8_t hashed_mac[6];
+    uint8_t point_len;
+    char point[POINT_CAPACITY];
+};
+
+
+/* Supplicant table in a POSIX shared memory segment, so all authenticator processes on a host share one
+ * table with consistent counters. Queries and counter decrements are lock free, inserts and erases take
+ * the process shared writer lock. An insert finding no room compacts the tombstones left by erases first.
+ * Readers spinning on a slot for too long take the writer lock once, which waits for a slow writer or
+ * recovers the table from a dead one.
+ *
+ * The process creating the segment becomes its owner: it loads the resource file into it and is the only
+ * one persisting it. Its own changes go to its journal, changes of the other processes mark the segment
+ * dirty and are persisted by the owner's next snapshot. A process attaching to a ready segment whose owner
+ * is gone takes over, attached processes check that with take_over() from time to time. The segment
+ * outlives all processes, remove /dev/shm/<name> to start over from the resource file. */
+class SharedSupplicantStore {
+private:
+    static constexpr uint64_t EMPTY = 0;
+    static constexpr uint64_t TOMBSTONE = ~0ULL;
+    static constexpr int SPIN_LIMIT = 1 << 16;      // Retries of a reader before it waits on the writer lock
+
+    std::string name;
+    int fd;
+    SharedStoreHeader *header;
+    SharedSlot *slots;
+    size_t map_len;
+    std::atomic<bool> owning;
+    std::atomic<SupplicantJournal*> journal;    // Owner only, records the changes made by this process
+
+    void map(size_t len);
+    template<typename F> void changed(F record);      // record(SupplicantJournal&)
+    void lock();
+    void unlock();
+    void settle();
+    SharedSlot* find_slot(uint64_t key);
+    SharedSlot* free_slot(uint64_t key, bool& present);
+    void write_slot(SharedSlot& slot, uint64_t key, const CompactEntry* entry);
+    void move_slot(SharedSlot& from, SharedSlot& to);
+    void compact();
+    void recover();
+    uint32_t begin_pass();
+    bool read_slot(const SharedSlot& slot, uint64_t& key, CompactEntry& entry);
+
+public:
+    static constexpr char MAGIC[8] = {'P', 'U', 'F', 'A', 'C', 'S', 'S', 'H'};
+    static constexpr uint32_t VERSION = 3;
+    enum State : uint32_t { LOADING = 0, READY = 1 };
+
+    /* Creates the segment if it does not exist yet, otherwise waits until its owner made it ready */
+    SharedSupplicantStore(const std::string& name_);
+    ~SharedSupplicantStore();
+    SharedSupplicantStore(const SharedSupplicantStore&) = delete;
+    SharedSupplicantStore& operator=(const SharedSupplicantStore&) = delete;
+
+    /* True if this process loads and persists the table */
+    bool owner() const { return owning.load(); }
+    bool ready() const { return header && header->state.load(std::memory_order_acquire) == READY; }
+
+    /* Owner only: sizes the new segment for entries supplicants plus room for new ones, then fill it and publish it */
+    void create(size_t entries);
+    void publish();
+    void set_journal(SupplicantJournal *journal_) { journal.store(journal_); }
+
+    /* Becomes the owner if the current one is gone, true if it did */
+    bool take_over();
+
+    /* Owner only: true if other processes changed entries since the last call, which then have to be snapshotted */
+    bool take_dirty();
+
+    /* False if already present, throws std::runtime_error if the table is full even without tombstones */
+    bool insert(uint64_t key, const CompactEntry& entry);
+    int take(uint64_t key, int units, CompactEntry& entry);                    // Like SupplicantTable::take
+    void set_counter(uint64_t key, int ctr);
+    void erase(uint64_t key);
+    size_t size() const;
+
+    /* Visits a consistent copy of every entry as fn(key, entry) once, without blocking writers */
+    template<typename F> void for_each(F fn);
+};
+
+
+template<typename F> void SharedSupplicantStore::for_each(F fn) {
+    // A compaction may move entries past the pass in either direction. Once one started, visited keys are
+    // skipped and another pass follows to visit the entries moved behind it.
+    std::vector<uint64_t> visited;
+    std::unordered_set<uint64_t> seen;
+    uint32_t moving = begin_pass();
+    bool moved = false;
+
+    for(bool again = true; again; ) {
+        for(size_t i=0; i<header->capacity; ++i) {
+            uint64_t key;
+            CompactEntry entry{};
+            if( !read_slot(slots[i], key, entry) ) continue;
+
+            if( !moved && header->moving.load(std::memory_order_acquire) != moving ) {
+                moved = true;
+                seen.insert(visited.begin(), visited.end());
+            }
+            if(moved) {
+                if( !seen.insert(key).second ) continue;
+            } else {
+                visited.push_back(key);
+            }
+            fn(key, entry);
+        }
+
+        again = header->moving.load(std::memory_order_acquire) != moving;
+        if(again) {
+            if(!moved) seen.insert(visited.begin(), visited.end());
+            moved = true;
+            moving = begin_pass();
+        }
+    }
+}
@@ -0,0 +1,286 @@
+#include "Speedtest.h"
+#include "Admission_Control.h"
+#include "Metrics.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int64_t steady_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+SpeedtestWatch::SpeedtestWatch(SpeedtestPoll poll_) :
+    poll(std::move(poll_)),
+    last_frame_ms(steady_ms()),
+    next_poll(std::chrono::steady_clock::now()) {}
+
+
+void SpeedtestWatch::received() {
+    last_frame_ms.store(steady_ms(), std::memory_order_relaxed);
+}
+
+
+bool SpeedtestWatch::keep_going() {
+    auto now = std::chrono::steady_clock::now();
+    if(poll && now >= next_poll) {
+        next_poll = now + std::chrono::milliseconds(SPEEDTEST_TICK_MS);
+        if( !poll() ) return false;
+    }
+    if( steady_ms() - last_frame_ms.load(std::memory_order_relaxed) > SPEEDTEST_IDLE_MS ) {
+        throw puf::NetworkException("Speedtest idle, the last frame was lost");
+    }
+    return true;
+}
+
+
+bool SpeedtestWatch::wait(BatchNetwork& net) {
+    if(net.poll_fd() < 0 || net.buffered()) return true;
+
+    struct pollfd pfd = {0};
+    pfd.fd = net.poll_fd();
+    pfd.events = POLLIN;
+    int n = ::poll(&pfd, 1, SPEEDTEST_TICK_MS);
+    if(n < 0 && errno != EINTR) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+    return n > 0;
+}
+
+
+
+double SpeedtestStats::seconds() const {
+    if(!started || !finished) return 0;
+    if(kernel_timestamps && last_arrival_ns > first_arrival_ns) {
+        return (last_arrival_ns - first_arrival_ns) * 1e-9;
+    }
+    return std::chrono::duration<double>(end - start).count();
+}
+
+
+void SpeedtestStats::merge(const SpeedtestStats& other) {
+    received_bytes += other.received_bytes;
+    wire_bytes += other.wire_bytes;
+    frames += other.frames;
+    validated += other.validated;
+    rejected += other.rejected;
+    dropped += other.dropped;
+    kernel_drops += other.kernel_drops;
+    inter_arrival.merge(other.inter_arrival);
+    latency.merge(other.latency);
+
+    if(other.started || other.finished) {
+        kernel_timestamps = (started || finished) ? (kernel_timestamps && other.kernel_timestamps) : other.kernel_timestamps;
+    }
+    if(other.started) {
+        start = started ? std::min(start, other.start) : other.start;
+        first_arrival_ns = started ? std::min(first_arrival_ns, other.first_arrival_ns) : other.first_arrival_ns;
+        started = true;
+    }
+    if(other.finished) {
+        end = finished ? std::max(end, other.end) : other.end;
+        last_arrival_ns = std::max(last_arrival_ns, other.last_arrival_ns);
+        finished = true;
+    }
+}
+
+
+void SpeedtestStats::print() const {
+    double secs = seconds();
+    auto rate = [secs](double value) { return secs > 0 ? value / secs : 0.0; };
+    auto print_percentiles = [](const char *name, const Metrics::Histogram& hist) {
+        std::cout << name << "p50 " << hist.percentile(50) / 1000 << " us, p99 " << hist.percentile(99) / 1000
+                  << " us, p99.9 " << hist.percentile(99.9) / 1000 << " us" << std::endl;
+    };
+
+    if( !interface.empty() ) {
+        std::cout << "Interface\t" << interface << std::endl;
+    }
+    if( !source.empty() ) {
+        std::cout << "Source\t\t" << source << std::endl;
+    }
+    std::cout << "Received for\t" << secs << " s" << (kernel_timestamps ? " (kernel timestamps)" : "") << std::endl;
+    std::cout << "Received\t" << received_bytes << " bytes" << std::endl;
+    std::cout << "Frames\t\t" << frames << " (" << validated << " validated, " << rejected << " rejected, "
+              << dropped << " over budget, " << kernel_drops << " dropped by the kernel)" << std::endl;
+    std::cout << "Frame rate\t" << rate(frames) << " frames/s" << std::endl;
+    std::cout << "Goodput\t\t" << rate(received_bytes * 8.0) / 1e6 << " Mbit/s" << std::endl;
+    std::cout << "Wire rate\t" << rate(wire_bytes * 8.0) / 1e6 << " Mbit/s" << std::endl;
+    print_percentiles("Inter-arrival\t", inter_arrival);
+    print_percentiles("Latency\t\t", latency);
+}
+
+
+void SpeedtestStats::write_json(std::ostream& os) const {
+    double secs = seconds();
+    auto rate = [secs](double value) { return secs > 0 ? value / secs : 0.0; };
+    auto percentiles = [&os](const Metrics::Histogram& hist) {
+        os << "{\"p50\":" << hist.percentile(50) / 1000 << ",\"p90\":" << hist.percentile(90) / 1000
+           << ",\"p99\":" << hist.percentile(99) / 1000 << ",\"p999\":" << hist.percentile(99.9) / 1000 << '}';
+    };
+
+    os << "{\"time\":" << realtime_ns() / 1000000000ULL;
+    if( !interface.empty() ) {
+        os << ",\"interface\":\"" << interface << '"';
+    }
+    if( !source.empty() ) {
+        os << ",\"source\":\"" << source << '"';
+    }
+    os << ",\"duration_s\":" << secs
+       << ",\"kernel_timestamps\":" << (kernel_timestamps ? "true" : "false")
+       << ",\"frames\":" << frames
+       << ",\"validated\":" << validated
+       << ",\"rejected\":" << rejected
+       << ",\"dropped\":" << dropped
+       << ",\"kernel_drops\":" << kernel_drops
+       << ",\"received_bytes\":" << received_bytes
+       << ",\"wire_bytes\":" << wire_bytes
+       << ",\"frames_per_s\":" << rate(frames)
+       << ",\"goodput_mbit_s\":" << rate(received_bytes * 8.0) / 1e6
+       << ",\"wire_mbit_s\":" << rate(wire_bytes * 8.0) / 1e6
+       << ",\"inter_arrival_us\":";
+    percentiles(inter_arrival);
+    os << ",\"latency_us\":";
+    percentiles(latency);
+    os << "}\n";
+}
+
+
+bool speedtest_frame(uint8_t *frame, size_t frame_len, uint64_t timestamp_ns, puf::PUF_Performance& pp, puf::Authenticator& au, SpeedtestStats& stats) {
+    using namespace std::chrono;
+    using namespace puf;
+
+    PacketType type;
+    {
+        StageTimer timer(Metrics::DEDUCE_TYPE);
+        type = deduce_type(frame, frame_len);
+    }
+    if(type != PUF_PERFORMANCE_E) {
+        return false;
+    }
+
+    uint64_t arrival = timestamp_ns ? timestamp_ns : realtime_ns();
+    if(stats.prev_arrival_ns && arrival >= stats.prev_arrival_ns) {
+        stats.inter_arrival.add(arrival - stats.prev_arrival_ns);
+    }
+    stats.prev_arrival_ns = arrival;
+
+    // Only a test that starts and ends with kernel timestamps is timed by them
+    auto note_timestamp = [&]() {
+        bool has = (timestamp_ns != 0);
+        stats.kernel_timestamps = (stats.started || stats.finished) ? (stats.kernel_timestamps && has) : has;
+    };
+
+    stats.frames++;
+    stats.wire_bytes += frame_len;
+    {
+        StageTimer timer(Metrics::FROM_BINARY);
+        pp.from_binary(frame, frame_len);
+    }
+    switch( pp.get_data()[0] ) {
+        case 'F':
+            note_timestamp();
+            if(!stats.started) {
+                stats.start = steady_clock::now();
+                stats.first_arrival_ns = arrival;
+                stats.started = true;
+            }
+        case 'H': {
+            // Frames over the budget of their source are dropped before any crypto, the last frame always ends the test
+            if( !AdmissionControl::admit(frame, frame_len) ) {
+                stats.dropped++;
+                break;
+            }
+
+            bool valid;
+            {
+                StageTimer timer(Metrics::VALIDATE);
+                valid = au.validate(pp, true);
+            }
+            uint64_t done = realtime_ns();
+            stats.latency.add(done > arrival ? done - arrival : 0);
+            if(valid) {
+                stats.received_bytes += pp.header_len();
+                stats.validated++;
+            } else {
+                stats.rejected++;
+            }
+            break;
+        }
+
+        case 'L':
+            note_timestamp();
+            stats.end = steady_clock::now();
+            stats.last_arrival_ns = arrival;
+            stats.received_bytes += pp.header_len();
+            stats.finished = true;
+            return true;
+
+        default:
+            std::cerr << "Default statement reached\n";
+            ;
+    }
+
+    return false;
+}
+
+
+SpeedtestStats run_speedtest(BatchNetwork& net, puf::Authenticator& au, SpeedtestPoll poll) {
+    constexpr size_t BATCH_SIZE = 32;
+    std::vector<FrameSlot> slots(BATCH_SIZE);
+    SpeedtestStats stats;
+    puf::PUF_Performance pp;
+    SpeedtestWatch watch(poll);
+
+    net.kernel_drops();     // Only count drops of this test
+
+    while(!stats.finished) {
+        // Throws once nothing arrived for too long, false if the caller stopped the test
+        if( !watch.keep_going() ) break;
+        try {
+            if( !SpeedtestWatch::wait(net) ) continue;
+
+            // Frames are parsed in place if the backend supports it, otherwise a whole batch is read per syscall
+            if(net.in_place()) {
+                uint8_t *frame;
+                size_t n;
+                {
+                    StageTimer timer(Metrics::RECEIVE);
+                    n = net.receive_in_place(&frame);
+                }
+                watch.received();
+                speedtest_frame(frame, n, net.last_timestamp(), pp, au, stats);
+                continue;
+            }
+
+            size_t n;
+            {
+                StageTimer timer(Metrics::RECEIVE);
+                n = net.receive_batch(slots.data(), slots.size());
+            }
+            if(n > 0) watch.received();
+            for(size_t i=0; i<n && !stats.finished; ++i) {
+                speedtest_frame(slots[i].data, slots[i].len, slots[i].timestamp_ns, pp, au, stats);
+            }
+        } catch(const puf::NetworkException &e) {
+            continue;   // Nothing received, the deadline decides whether the test is over
+        }
+    }
+
+    stats.kernel_drops = net.kernel_drops();
+    return stats;
+}
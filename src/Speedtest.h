@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include "Batch_Network.h"
+#include "Metrics.h"
+#include "authenticator.h"
+#include "packets.h"
+
+
+/* Results of one speedtest. Arrival times are kernel receive timestamps (CLOCK_REALTIME) where the network provides
+ * them and the time the frame was picked up otherwise. Speedtest frames carry no sequence number, so loss is taken
+ * from the kernel drop counters of the receiving sockets. */
+struct SpeedtestStats {
+    std::string interface;          // Receiving interface, empty if not known
+    std::string source;             // Source MAC if the results are those of one supplicant
+    size_t received_bytes = 0;      // Payload of validated frames and the last frame
+    size_t wire_bytes = 0;          // Whole speedtest frames as received
+    size_t frames = 0;
+    size_t validated = 0;
+    size_t rejected = 0;
+    size_t dropped = 0;             // Over the admission budget of their source
+    uint64_t kernel_drops = 0;
+    bool started = false;
+    bool finished = false;
+    bool kernel_timestamps = false;                     // Duration taken from kernel timestamps instead of the steady clock
+    std::chrono::steady_clock::time_point start, end;
+    uint64_t first_arrival_ns = 0;
+    uint64_t last_arrival_ns = 0;
+    uint64_t prev_arrival_ns = 0;
+    Metrics::Histogram inter_arrival;                   // Between frames received by the same worker
+    Metrics::Histogram latency;                         // From arrival until validation finished
+
+    double seconds() const;
+    void merge(const SpeedtestStats& other);
+    void print() const;
+
+    /* Writes the results as a single line JSON object */
+    void write_json(std::ostream& os) const;
+};
+
+
+/* A speedtest that received nothing for this long is given up, the supplicant's last frame was lost */
+constexpr int SPEEDTEST_IDLE_MS = 10000;
+
+/* Longest a speedtest goes without checking whether it is over */
+constexpr int SPEEDTEST_TICK_MS = 100;
+
+
+/* Called by the thread running a speedtest about every SPEEDTEST_TICK_MS. Returning false ends the test early
+ * with what was received so far, so the caller can stop it or serve other descriptors meanwhile. */
+using SpeedtestPoll = std::function<bool()>;
+
+
+/* Idle deadline and poll hook of one speedtest. received may be called from any thread, the rest only from the
+ * thread running the test. */
+class SpeedtestWatch {
+private:
+    SpeedtestPoll poll;
+    std::atomic<int64_t> last_frame_ms;
+    std::chrono::steady_clock::time_point next_poll;
+
+public:
+    explicit SpeedtestWatch(SpeedtestPoll poll_);
+
+    /* Restarts the idle deadline */
+    void received();
+
+    /* Runs the poll hook when it is due, false if it ended the test. Throws puf::NetworkException once nothing
+     * was received for SPEEDTEST_IDLE_MS. */
+    bool keep_going();
+
+    /* Waits up to SPEEDTEST_TICK_MS for frames on net, false if none arrived. Networks that cannot be polled
+     * count as ready, their receive times out on its own. */
+    static bool wait(BatchNetwork& net);
+};
+
+
+/* Processes one received frame of a speedtest, timestamp_ns is its kernel receive time or 0.
+ * Returns true once the last frame ('L') was seen. */
+bool speedtest_frame(uint8_t *frame, size_t frame_len, uint64_t timestamp_ns, puf::PUF_Performance& pp, puf::Authenticator& au, SpeedtestStats& stats);
+
+/* Receives and validates frames until the supplicant sends its last frame, poll returned false or nothing
+ * arrived for SPEEDTEST_IDLE_MS */
+SpeedtestStats run_speedtest(BatchNetwork& net, puf::Authenticator& au, SpeedtestPoll poll = nullptr);
@@ -0,0 +1,171 @@
+#include "Speedtest_Pipeline.h"
+#include "Metrics.h"
+#include "errors.h"
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <pthread.h>
+#include <net/ethernet.h>
+
+
+SpeedtestPipeline::SpeedtestPipeline(BatchNetwork& net_, puf::AuthenticationServer& as, int n_workers) : net(net_) {
+    workers.resize(n_workers);
+    for(auto &worker : workers) {
+        worker.au = std::make_unique<puf::Authenticator>(net, as);
+        worker.ring = std::make_unique<SpscRing<FrameSlot>>(RING_SIZE);
+    }
+}
+
+
+void SpeedtestPipeline::init() {
+    for(auto &worker : workers) {
+        worker.au->init();
+    }
+}
+
+
+void SpeedtestPipeline::dispatch(const uint8_t *frame, size_t len, uint64_t timestamp_ns) {
+    size_t target = 0;
+
+    // Same source MAC, same worker, so counters of a supplicant are consumed in order
+    if(len >= 2*ETH_ALEN) {
+        uint64_t src = 0;
+        memcpy(&src, frame + ETH_ALEN, ETH_ALEN);
+        src *= 0x9e3779b97f4a7c15ULL;
+        target = (src >> 32) % workers.size();
+    }
+
+    auto &ring = *workers[target].ring;
+    FrameSlot *slot;
+    while( !(slot = ring.claim()) ) {
+        // Worker is behind, let it catch up instead of dropping frames out of order
+        if( failed.load(std::memory_order_relaxed) ) return;
+        std::this_thread::yield();
+    }
+
+    slot->len = std::min(len, FRAME_SLOT_SIZE);
+    slot->timestamp_ns = timestamp_ns;
+    memcpy(slot->data, frame, slot->len);
+    ring.publish();
+}
+
+
+SpeedtestStats SpeedtestPipeline::speedtest(int senders, SpeedtestPoll poll) {
+    constexpr size_t BATCH_SIZE = 32;
+    SpeedtestWatch watch(poll);
+    std::atomic<int> finished_senders(0);
+    std::atomic<bool> receiving(true);
+    std::exception_ptr error;
+    std::mutex error_lock;
+    std::vector<std::thread> threads;
+    failed.store(false);
+    unsigned int n_cpus = std::thread::hardware_concurrency();
+
+    for(size_t i=0; i<workers.size(); ++i) {
+        threads.emplace_back([&, i]() {
+            puf::PUF_Performance pp;
+            auto &worker = workers[i];
+
+            worker.stats = SpeedtestStats();
+            // An error ends the test on all threads and is rethrown to the caller, like FanoutWorkers does
+            try {
+                while(true) {
+                    FrameSlot *slot = worker.ring->front();
+                    if(!slot) {
+                        // Everything published before receiving was cleared is visible now, drain it first
+                        if( !receiving.load(std::memory_order_acquire) && !worker.ring->front() ) break;
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    if( speedtest_frame(slot->data, slot->len, slot->timestamp_ns, pp, *worker.au, worker.stats) ) {
+                        finished_senders.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    worker.ring->pop();
+                }
+            } catch(...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if(!error) error = std::current_exception();
+                failed.store(true, std::memory_order_relaxed);
+            }
+        });
+
+        if(n_cpus > 1) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(1 + i % (n_cpus-1), &cpuset);
+            if( pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpu_set_t), &cpuset) != 0 ) {
+                std::cerr << "Could not pin worker " << i << '\n';
+            }
+        }
+    }
+
+    // The receiving thread keeps the first core, pinned after the workers so they do not
+    // inherit it. Its previous affinity is restored afterwards
+    cpu_set_t previous;
+    bool pinned = false;
+    if(n_cpus > 1 && pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &previous) == 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(0, &cpuset);
+        pinned = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0;
+        if(!pinned) std::cerr << "Could not pin the receiving thread\n";
+    }
+
+    std::vector<FrameSlot> slots(BATCH_SIZE);
+    net.kernel_drops();     // Only count drops of this test
+    try {
+        while(finished_senders.load(std::memory_order_relaxed) < senders && !failed.load(std::memory_order_relaxed)) {
+            // Throws once nothing arrived for too long, false if the caller stopped the test. The workers drain what they got either way
+            if( !watch.keep_going() ) break;
+            try {
+                if( !SpeedtestWatch::wait(net) ) continue;
+                if(net.in_place()) {
+                    uint8_t *frame;
+                    size_t n;
+                    {
+                        StageTimer timer(Metrics::RECEIVE);
+                        n = net.receive_in_place(&frame);
+                    }
+                    watch.received();
+                    dispatch(frame, n, net.last_timestamp());
+                    continue;
+                }
+
+                size_t n;
+                {
+                    StageTimer timer(Metrics::RECEIVE);
+                    n = net.receive_batch(slots.data(), slots.size());
+                }
+                if(n > 0) watch.received();
+                for(size_t j=0; j<n; ++j) {
+                    dispatch(slots[j].data, slots[j].len, slots[j].timestamp_ns);
+                }
+            } catch(const puf::NetworkException &e) {
+                continue;   // Nothing received, the deadline decides whether the test is over
+            }
+        }
+    } catch(...) {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if(!error) error = std::current_exception();
+        failed.store(true, std::memory_order_relaxed);
+    }
+    receiving.store(false, std::memory_order_release);
+
+    SpeedtestStats retval;
+    retval.kernel_drops = net.kernel_drops();
+    for(size_t i=0; i<threads.size(); ++i) {
+        threads[i].join();
+        std::cout << "Worker " << i << ":\t" << workers[i].stats.frames << " frames" << std::endl;
+        retval.merge(workers[i].stats);
+    }
+    if(pinned) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &previous);
+
+    if(error) std::rethrow_exception(error);
+    return retval;
+}
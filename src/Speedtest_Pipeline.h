@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "Batch_Network.h"
+#include "Spsc_Ring.h"
+#include "Speedtest.h"
+#include "authenticator.h"
+
+
+/* Speedtest split into a receive stage and a pool of validation workers.
+ *
+ * The receive thread only drains the socket and routes every frame by its source MAC into the ring of one worker,
+ * so frames of a supplicant are validated by the same worker in the order they arrived. Each worker owns an
+ * Authenticator on the shared authentication server and its own statistics, which are merged at the end. */
+class SpeedtestPipeline {
+private:
+    static constexpr size_t RING_SIZE = 1024;   // Frames buffered per worker
+
+    struct Worker {
+        std::unique_ptr<puf::Authenticator> au;
+        std::unique_ptr<SpscRing<FrameSlot>> ring;
+        SpeedtestStats stats;
+    };
+
+    BatchNetwork &net;
+    std::vector<Worker> workers;
+    std::atomic<bool> failed{false};    // Set by the first thread that throws, ends the test
+
+    void dispatch(const uint8_t *frame, size_t len, uint64_t timestamp_ns);
+
+public:
+    SpeedtestPipeline(BatchNetwork& net_, puf::AuthenticationServer& as, int n_workers);
+    void init();
+
+    /* Runs a speedtest until `senders` supplicants sent their last frame, poll returned false or nothing
+     * arrived for SPEEDTEST_IDLE_MS */
+    SpeedtestStats speedtest(int senders = 1, SpeedtestPoll poll = nullptr);
+};
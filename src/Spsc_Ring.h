@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+
+/* Bounded lock-free queue between exactly one producer and one consumer thread.
+ *
+ * Elements are written and read in place: the producer claims the next free slot, fills it and publishes it,
+ * the consumer peeks at the front slot and pops it once done. Each side caches the other side's index and only
+ * reloads it when the ring looks full or empty, so the shared cache lines rarely move between cores. */
+template<typename T>
+class SpscRing {
+private:
+    std::vector<T> slots;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> head;   // Next slot to read, written by the consumer
+    size_t cached_tail;
+
+    alignas(64) std::atomic<size_t> tail;   // Next slot to write, written by the producer
+    size_t cached_head;
+
+public:
+    explicit SpscRing(size_t capacity) : head(0), cached_tail(0), tail(0), cached_head(0) {
+        size_t size = 1;
+        while(size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /* Producer: next free slot or nullptr if the ring is full */
+    T* claim() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t - cached_head == slots.size()) {
+            cached_head = head.load(std::memory_order_acquire);
+            if(t - cached_head == slots.size()) return nullptr;
+        }
+        return &slots[t & mask];
+    }
+
+    /* Producer: hands the claimed slot to the consumer */
+    void publish() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /* Consumer: oldest published slot or nullptr if the ring is empty */
+    T* front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if(h == cached_tail) return nullptr;
+        }
+        return &slots[h & mask];
+    }
+
+    /* Consumer: releases the front slot to the producer */
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
@@ -0,0 +1,100 @@
+#include "Supplicant_Database.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+SupplicantDatabase::SupplicantDatabase() :
+    map(nullptr),
+    map_len(0),
+    header(nullptr),
+    records(nullptr)
+{}
+
+
+SupplicantDatabase::~SupplicantDatabase() {
+    close();
+}
+
+
+bool SupplicantDatabase::is_database(const std::string& path) {
+    char magic[sizeof(MAGIC)] = {0};
+    std::ifstream ifs(path, std::ios::binary);
+    ifs.read(magic, sizeof(magic));
+    return ifs.gcount() == sizeof(magic) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+
+void SupplicantDatabase::write(std::ostream& os, const std::vector<DatabaseRecord>& records) {
+    DatabaseHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+    hdr.version = VERSION;
+    hdr.record_size = sizeof(DatabaseRecord);
+    hdr.record_count = records.size();
+
+    os.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    os.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(DatabaseRecord));
+}
+
+
+void SupplicantDatabase::open(const std::string& path) {
+    struct stat st;
+    int fd;
+
+    close();
+
+    if( (fd = ::open(path.c_str(), O_RDONLY)) < 0 ) {
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+    if( fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(DatabaseHeader) ) {
+        ::close(fd);
+        throw std::runtime_error("Truncated database " + path);
+    }
+
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+        throw std::runtime_error("Cannot map " + path + ": " + strerror(errno));
+    }
+
+    map = static_cast<const uint8_t*>(mapped);
+    map_len = st.st_size;
+    header = reinterpret_cast<const DatabaseHeader*>(map);
+
+    bool valid = memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                 header->version == VERSION &&
+                 header->record_size == sizeof(DatabaseRecord) &&
+                 header->record_count <= (map_len - sizeof(DatabaseHeader)) / sizeof(DatabaseRecord) &&
+                 sizeof(DatabaseHeader) + header->record_count * sizeof(DatabaseRecord) == map_len;
+    if(!valid) {
+        close();
+        throw std::runtime_error("Invalid or incompatible database " + path);
+    }
+
+    // Points are handed to from_base64 as C strings
+    records = reinterpret_cast<const DatabaseRecord*>(map + sizeof(DatabaseHeader));
+    for(size_t i=0; i<header->record_count; ++i) {
+        const CompactEntry &entry = records[i].entry;
+        if(entry.point_len >= POINT_CAPACITY || entry.point[entry.point_len] != '\0') {
+            close();
+            throw std::runtime_error("Corrupt record " + std::to_string(i) + " in database " + path);
+        }
+    }
+}
+
+
+void SupplicantDatabase::close() {
+    if(map) munmap(const_cast<uint8_t*>(map), map_len);
+    map = nullptr;
+    map_len = 0;
+    header = nullptr;
+    records = nullptr;
+}
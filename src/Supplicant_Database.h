@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include "Authentication_Server.h"
+
+
+/* Binary supplicant database, little endian:
+ *   DatabaseHeader
+ *   DatabaseRecord[record_count]     fixed width, points stored base64 encoded and NUL terminated
+ * Records hold entries exactly as the supplicant table and the shared store keep them, so the file is mapped
+ * read-only and its records are used in place: loading copies them without parsing or decoding anything.
+ * Version 1 files also carried a lookup index nothing used, convert them again with --convert. */
+struct DatabaseHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t record_count;
+};
+
+
+struct DatabaseRecord {
+    uint64_t key;
+    CompactEntry entry;
+};
+
+
+class SupplicantDatabase {
+private:
+    const uint8_t *map;
+    size_t map_len;
+    const DatabaseHeader *header;
+    const DatabaseRecord *records;
+
+public:
+    static constexpr char MAGIC[8] = {'P', 'U', 'F', 'A', 'C', 'S', 'D', 'B'};
+    static constexpr uint32_t VERSION = 2;
+
+    SupplicantDatabase();
+    ~SupplicantDatabase();
+    SupplicantDatabase(const SupplicantDatabase&) = delete;
+    SupplicantDatabase& operator=(const SupplicantDatabase&) = delete;
+
+    static bool is_database(const std::string& path);
+    static void write(std::ostream& os, const std::vector<DatabaseRecord>& records);
+
+    /* Maps path and checks every record, throws std::runtime_error if the file is not a valid database */
+    void open(const std::string& path);
+    void close();
+    size_t size() const { return header ? header->record_count : 0; }
+    const DatabaseRecord& at(size_t i) const { return records[i]; }
+
+    /* Records in place, valid until the database is closed */
+    const DatabaseRecord* begin() const { return records; }
+    const DatabaseRecord* end() const { return records + size(); }
+};
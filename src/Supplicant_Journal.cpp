@@ -0,0 +1,259 @@
+#include "Supplicant_Journal.h"
+
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cinttypes>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static void fsync_path(const std::string& file) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+
+static bool file_exists(const std::string& file) {
+    return access(file.c_str(), F_OK) == 0;
+}
+
+
+static void append_file(const std::string& src, const std::string& dst) {
+    std::ifstream ifs(src, std::ios::binary);
+    std::ofstream ofs(dst, std::ios::binary | std::ios::app);
+    ofs << ifs.rdbuf();
+    ofs.close();
+    fsync_path(dst);
+    unlink(src.c_str());
+}
+
+
+SupplicantJournal::SupplicantJournal(const std::string& path_, const JournalOptions& options_, Snapshot snapshot_) :
+    path(path_),
+    journal_path(path_ + ".journal"),
+    options(options_),
+    snapshot(snapshot_),
+    fd(-1),
+    running(false),
+    compact_requested(false),
+    compactions(0),
+    records_since_compaction(0)
+{}
+
+
+SupplicantJournal::~SupplicantJournal() {
+    stop();
+}
+
+
+void SupplicantJournal::open_journal(bool truncate) {
+    int flags = O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+    if( (fd = open(journal_path.c_str(), flags, 0644)) < 0 ) {
+        std::cerr << "Error opening journal: " << strerror(errno) << '\n';
+    }
+}
+
+
+void SupplicantJournal::replay_file(const std::string& file, const Apply& apply) {
+    std::ifstream ifs(file);
+    std::string record;
+
+    while( std::getline(ifs, record) ) {
+        try {
+            apply(record);
+        } catch(...) {
+            std::cerr << "Error replaying journal record: " << record << '\n';
+        }
+    }
+}
+
+
+void SupplicantJournal::start(const Apply& apply) {
+    std::string tmp_path = path + ".tmp";
+    std::string old_path = journal_path + ".old";
+
+    if( file_exists(tmp_path) ) {
+        // A compaction was interrupted before its snapshot replaced the resource file
+        replay_file(old_path, apply);
+        replay_file(journal_path, apply);
+        compact(false);
+        if(fd < 0) open_journal(false);
+    } else {
+        // Either no compaction was running or its snapshot already contains the old journal
+        unlink(old_path.c_str());
+        replay_file(journal_path, apply);
+        open_journal(false);
+    }
+
+    running = true;
+    writer = std::thread(&SupplicantJournal::run, this);
+}
+
+
+void SupplicantJournal::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!running) return;
+        running = false;
+    }
+    wakeup.notify_all();
+    writer.join();
+
+    if(fd >= 0) {
+        fdatasync(fd);
+        close(fd);
+        fd = -1;
+    }
+}
+
+
+void SupplicantJournal::counter(uint64_t key, int ctr) {
+    char record[48];
+    snprintf(record, sizeof(record), "C %016" PRIx64 " %d\n", key, ctr);
+
+    std::lock_guard<std::mutex> guard(lock);
+    pending += record;
+    records_since_compaction++;
+    wakeup.notify_one();
+}
+
+
+void SupplicantJournal::erase(uint64_t key) {
+    char record[32];
+    snprintf(record, sizeof(record), "E %016" PRIx64 "\n", key);
+
+    std::lock_guard<std::mutex> guard(lock);
+    pending += record;
+    records_since_compaction++;
+    wakeup.notify_one();
+}
+
+
+void SupplicantJournal::insert(const std::string& csv_row) {
+    std::lock_guard<std::mutex> guard(lock);
+    pending += "I ";
+    pending += csv_row;
+    if(csv_row.empty() || csv_row.back() != '\n') pending += '\n';
+    records_since_compaction++;
+    wakeup.notify_one();
+}
+
+
+void SupplicantJournal::compact_now() {
+    std::unique_lock<std::mutex> lk(lock);
+    if(!running) return;
+
+    uint64_t target = compactions + 1;
+    compact_requested = true;
+    wakeup.notify_one();
+    compacted.wait(lk, [&]() { return compactions >= target || !running; });
+}
+
+
+void SupplicantJournal::compact(bool rotate) {
+    std::string tmp_path = path + ".tmp";
+    std::string old_path = journal_path + ".old";
+
+    // The temporary file marks a compaction in progress, create it before touching the journal
+    {
+        std::ofstream marker(tmp_path, std::ios::trunc);
+    }
+
+    if(rotate) {
+        if(fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+        // Records of an earlier failed compaction are not in the resource file yet, keep them
+        if( file_exists(old_path) ) {
+            append_file(journal_path, old_path);
+        } else {
+            rename(journal_path.c_str(), old_path.c_str());
+        }
+        open_journal(false);
+    }
+
+    try {
+        std::ofstream ofs;
+        ofs.exceptions(std::ofstream::failbit);
+        ofs.open(tmp_path, std::ios::trunc);
+        bool complete = snapshot(ofs);
+        ofs.close();
+        if(!complete) return;
+    } catch(const std::ios_base::failure &e) {
+        std::cerr << "Error writing snapshot: " << e.what() << '\n';
+        return;
+    }
+
+    fsync_path(tmp_path);
+    if( rename(tmp_path.c_str(), path.c_str()) != 0 ) {
+        std::cerr << "Error replacing resource file: " << strerror(errno) << '\n';
+        return;
+    }
+    unlink(old_path.c_str());
+
+    // Recovery replays the current journal into the snapshot, so it starts out empty afterwards
+    if(!rotate) {
+        if(fd >= 0) close(fd);
+        open_journal(true);
+    }
+}
+
+
+void SupplicantJournal::run() {
+    std::unique_lock<std::mutex> lk(lock);
+    uint64_t commits = 0;
+
+    while(true) {
+        wakeup.wait(lk, [&]() { return !running || compact_requested || !pending.empty(); });
+
+        // Give concurrent authentications the chance to join this group commit
+        if(running && !compact_requested) {
+            wakeup.wait_for(lk, std::chrono::milliseconds(options.flush_interval_ms), [&]() {
+                return !running || compact_requested;
+            });
+        }
+
+        std::string batch;
+        batch.swap(pending);
+        bool do_compact = compact_requested || (options.compact_every && records_since_compaction >= options.compact_every);
+        bool stopping = !running;
+        if(do_compact) records_since_compaction = 0;
+        lk.unlock();
+
+        size_t written = 0;
+        while(fd >= 0 && written < batch.size()) {
+            ssize_t n = write(fd, batch.data() + written, batch.size() - written);
+            if(n < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "Error writing journal: " << strerror(errno) << '\n';
+                break;
+            }
+            written += n;
+        }
+
+        if( !batch.empty() && options.fsync_batch > 0 && (++commits % options.fsync_batch) == 0 ) {
+            fdatasync(fd);
+        }
+
+        if(do_compact) {
+            compact(true);
+        }
+
+        lk.lock();
+        if(do_compact) {
+            compact_requested = false;
+            compactions++;
+            compacted.notify_all();
+        }
+        if(stopping && pending.empty()) break;
+    }
+
+    compacted.notify_all();
+}
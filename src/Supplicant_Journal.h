@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+
+struct JournalOptions {
+    int flush_interval_ms = 5;          // Longest time a record waits for its group commit
+    int fsync_batch = 1;                // fsync after this many group commits, 0 leaves it to the OS
+    size_t compact_every = 100000;      // Rewrite the snapshot after this many records, 0 disables
+};
+
+
+/* Write-ahead journal of supplicant table changes next to the resource file.
+ *
+ * Records are queued by the authentication threads and written by a background thread in group commits.
+ * Records carry absolute values (counter set, erase, insert), so replaying them twice is harmless.
+ *
+ * Compaction writes a fresh snapshot of the table to <file>.tmp, then renames it over <file>:
+ *  1. <file>.tmp is created
+ *  2. <file>.journal is moved to <file>.journal.old (appended if a failed compaction left one) and a new journal is started
+ *  3. the snapshot is written, synced and renamed over <file>
+ *  4. <file>.journal.old is removed
+ * If <file>.tmp exists on startup, step 3 never completed and both journals must be replayed on top of <file>.
+ * The snapshot callback can veto step 3 by returning false, the compaction is then retried later like a failed one. */
+class SupplicantJournal {
+public:
+    using Snapshot = std::function<bool(std::ostream&)>;
+    using Apply = std::function<void(const std::string&)>;
+
+private:
+    std::string path;
+    std::string journal_path;
+    JournalOptions options;
+    Snapshot snapshot;
+    int fd;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::condition_variable compacted;
+    std::string pending;
+    bool running;
+    bool compact_requested;
+    uint64_t compactions;
+    size_t records_since_compaction;
+
+    void run();
+    void open_journal(bool truncate);
+    void compact(bool rotate);
+    static void replay_file(const std::string& file, const Apply& apply);
+
+public:
+    SupplicantJournal(const std::string& path_, const JournalOptions& options_, Snapshot snapshot_);
+    ~SupplicantJournal();
+
+    /* Replays leftover journals on top of the freshly loaded snapshot and starts the writer */
+    void start(const Apply& apply);
+    void stop();
+
+    void counter(uint64_t key, int ctr);
+    void erase(uint64_t key);
+    void insert(const std::string& csv_row);
+
+    /* Writes a new snapshot and waits until it is in place */
+    void compact_now();
+};
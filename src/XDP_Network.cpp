@@ -0,0 +1,431 @@
+#include "XDP_Network.h"
+#include "errors.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+
+static int bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+static struct bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    struct bpf_insn retval;
+    memset(&retval, 0, sizeof(retval));
+    retval.code = code;
+    retval.dst_reg = dst;
+    retval.src_reg = src;
+    retval.off = off;
+    retval.imm = imm;
+    return retval;
+}
+
+
+XdpNetwork::XdpNetwork(const char* iface_name, const XdpOptions& options_) :
+    xsk(-1),
+    map_fd(-1),
+    prog_fd(-1),
+    link_fd(-1),
+    ifindex(0),
+    options(options_),
+    initialised(false),
+    umem(nullptr),
+    umem_size(0),
+    fill{0},
+    completion{0},
+    rx{0},
+    tx{0},
+    in_place_addr(0),
+    in_place_pending(false),
+    reported_drops(0)
+{
+    strncpy(ifName, iface_name, sizeof(ifName));
+}
+
+
+XdpNetwork::~XdpNetwork() {
+    // Closing the link detaches the program from the interface
+    if(link_fd >= 0) close(link_fd);
+    if(prog_fd >= 0) close(prog_fd);
+    if(map_fd >= 0) close(map_fd);
+
+    for(auto *ring : {&fill, &completion, &rx, &tx}) {
+        if(ring->map) munmap(ring->map, ring->map_len);
+    }
+    if(xsk >= 0) close(xsk);
+    if(umem) munmap(umem, umem_size);
+}
+
+
+void XdpNetwork::setup_umem() {
+    umem_size = static_cast<size_t>(options.frame_count) * options.frame_size;
+    void *mapped = mmap(nullptr, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(mapped == MAP_FAILED) {
+        umem_size = 0;
+        throw puf::NetworkException( strerror(errno) );
+    }
+    umem = static_cast<uint8_t*>(mapped);
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = reinterpret_cast<uint64_t>(umem);
+    reg.len = umem_size;
+    reg.chunk_size = options.frame_size;
+    reg.headroom = 0;
+
+    if( setsockopt(xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+}
+
+
+void XdpNetwork::map_ring(XdpRing& ring, const struct xdp_ring_offset& off, uint64_t pgoff, uint32_t size, size_t desc_size) {
+    ring.map_len = off.desc + size * desc_size;
+    ring.map = mmap(nullptr, ring.map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk, pgoff);
+    if(ring.map == MAP_FAILED) {
+        ring.map = nullptr;
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    auto *base = static_cast<uint8_t*>(ring.map);
+    ring.producer = reinterpret_cast<uint32_t*>(base + off.producer);
+    ring.consumer = reinterpret_cast<uint32_t*>(base + off.consumer);
+    ring.flags = reinterpret_cast<uint32_t*>(base + off.flags);
+    ring.descs = base + off.desc;
+    ring.size = size;
+    ring.mask = size - 1;
+}
+
+
+void XdpNetwork::setup_rings() {
+    uint32_t size = options.ring_size;
+
+    if( setsockopt(xsk, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 )
+    {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if( getsockopt(xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    map_ring(fill, off.fr, XDP_UMEM_PGOFF_FILL_RING, size, sizeof(uint64_t));
+    map_ring(completion, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, size, sizeof(uint64_t));
+    map_ring(rx, off.rx, XDP_PGOFF_RX_RING, size, sizeof(struct xdp_desc));
+    map_ring(tx, off.tx, XDP_PGOFF_TX_RING, size, sizeof(struct xdp_desc));
+
+    // First half of the UMEM is handed to the kernel for receiving, second half is kept for sending
+    unsigned int rx_frames = std::min(options.frame_count / 2, size);
+    for(unsigned int i=0; i<rx_frames; ++i) {
+        refill( static_cast<uint64_t>(i) * options.frame_size );
+    }
+    for(unsigned int i=rx_frames; i<options.frame_count; ++i) {
+        tx_free.push_back( static_cast<uint64_t>(i) * options.frame_size );
+    }
+}
+
+
+void XdpNetwork::load_program() {
+    union bpf_attr attr;
+
+    /* XSKMAP holding our socket at the index of the bound queue */
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = options.queue_id + 1;
+    if( (map_fd = bpf(BPF_MAP_CREATE, &attr)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    uint32_t key = options.queue_id;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = reinterpret_cast<uint64_t>(&key);
+    attr.value = reinterpret_cast<uint64_t>(&xsk);
+    if( bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    /* Program: optionally match the EtherType and source MAC, then bpf_redirect_map(&xskmap, rx_queue_index, XDP_PASS).
+     * Layout: [bounds check][ldh type][jeq type]*E [pass] ([ldh src_hi][jne][ldw src_lo][jeq]*M [pass]) [redirect]
+     * Packet loads are in host order, so the MAC constants are taken from memory the same way. */
+    std::vector<struct bpf_insn> prog;
+    size_t n_types = options.ethertypes.size();
+    size_t n_macs = options.source_macs.size();
+
+    if(n_macs && !n_types) {
+        throw puf::NetworkException("Invalid frame filter");
+    }
+
+    if(n_types) {
+        int16_t pass = static_cast<int16_t>(6 + n_types);       // Index of the XDP_PASS return
+        int16_t mac_start = pass + 2;                           // Index of the MAC checks
+        int16_t redirect = mac_start + (n_macs ? 4*n_macs + 2 : 0);
+        int16_t matched = n_macs ? mac_start : redirect;
+
+        prog.push_back( insn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, data), 0) );
+        prog.push_back( insn(BPF_LDX | BPF_MEM | BPF_W, 3, 1, offsetof(struct xdp_md, data_end), 0) );
+        prog.push_back( insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0) );
+        prog.push_back( insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14) );
+        prog.push_back( insn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, pass - 5, 0) );
+        prog.push_back( insn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0) );
+        for(size_t i=0; i<n_types; ++i) {
+            int16_t pc = static_cast<int16_t>(prog.size());
+            prog.push_back( insn(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, matched - (pc+1), htons(options.ethertypes[i])) );
+        }
+        prog.push_back( insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS) );
+        prog.push_back( insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0) );
+
+        for(const auto &mac : options.source_macs) {
+            uint16_t hi;
+            uint32_t lo;
+            memcpy(&hi, &mac[0], sizeof(hi));
+            memcpy(&lo, &mac[2], sizeof(lo));
+
+            int16_t pc = static_cast<int16_t>(prog.size());
+            prog.push_back( insn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 6, 0) );
+            prog.push_back( insn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 2, hi) );
+            prog.push_back( insn(BPF_LDX | BPF_MEM | BPF_W, 4, 2, 8, 0) );
+            prog.push_back( insn(BPF_JMP32 | BPF_JEQ | BPF_K, 4, 0, redirect - (pc+4), static_cast<int32_t>(lo)) );
+        }
+        if(n_macs) {
+            prog.push_back( insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS) );
+            prog.push_back( insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0) );
+        }
+    }
+
+    prog.push_back( insn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, rx_queue_index), 0) );
+    prog.push_back( insn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd) );
+    prog.push_back( insn(0, 0, 0, 0, 0) );
+    prog.push_back( insn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS) );
+    prog.push_back( insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map) );
+    prog.push_back( insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0) );
+
+    static const char license[] = "GPL";
+    char log[4096] = {0};
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(prog.data());
+    attr.insn_cnt = prog.size();
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_buf = reinterpret_cast<uint64_t>(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    if( (prog_fd = bpf(BPF_PROG_LOAD, &attr)) < 0 ) {
+        int err = errno;
+        fprintf(stderr, "%s\n", log);
+        throw puf::NetworkException( strerror(err) );
+    }
+
+    /* Attach in generic mode, the link is released together with the socket */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    if( (link_fd = bpf(BPF_LINK_CREATE, &attr)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+}
+
+
+void XdpNetwork::init() {
+    if(initialised) return;
+
+    if( (ifindex = if_nametoindex(ifName)) == 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    if( (xsk = socket(AF_XDP, SOCK_RAW, 0)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    setup_umem();
+    setup_rings();
+
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = options.queue_id;
+    addr.sxdp_flags = XDP_COPY;
+    if( bind(xsk, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    load_program();
+
+    printf("Bound AF_XDP socket to interface %s queue %u\n", ifName, options.queue_id);
+    initialised = true;
+}
+
+
+void XdpNetwork::refill(uint64_t addr) {
+    uint32_t prod = *fill.producer;
+    static_cast<uint64_t*>(fill.descs)[prod & fill.mask] = addr;
+    __atomic_store_n(fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+
+void XdpNetwork::reap_completions() {
+    uint32_t cons = *completion.consumer;
+    uint32_t prod = __atomic_load_n(completion.producer, __ATOMIC_ACQUIRE);
+
+    for(; cons != prod; ++cons) {
+        tx_free.push_back( static_cast<uint64_t*>(completion.descs)[cons & completion.mask] );
+    }
+    __atomic_store_n(completion.consumer, cons, __ATOMIC_RELEASE);
+}
+
+
+void XdpNetwork::kick() {
+    if( sendto(xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+}
+
+
+void XdpNetwork::wait_rx() {
+    while( __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE) == *rx.consumer ) {
+        struct pollfd pfd = {0};
+        pfd.fd = xsk;
+        pfd.events = POLLIN;
+        if( poll(&pfd, 1, NETWORK_TIMEOUT_MS) <= 0 ) {
+            throw puf::NetworkException("Timeout");
+        }
+    }
+}
+
+
+int XdpNetwork::receive_batch(FrameSlot *slots, size_t count) {
+    if(count == 0) return 0;
+
+    if(in_place_pending) {
+        refill(in_place_addr);
+        in_place_pending = false;
+    }
+
+    wait_rx();
+
+    uint32_t cons = *rx.consumer;
+    uint32_t prod = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    for(; cons != prod && n < count; ++cons, ++n) {
+        const auto &desc = static_cast<struct xdp_desc*>(rx.descs)[cons & rx.mask];
+        slots[n].len = (desc.len < sizeof(slots[n].data)) ? desc.len : sizeof(slots[n].data);
+        slots[n].timestamp_ns = 0;     // AF_XDP descriptors carry no timestamp
+        memcpy(slots[n].data, umem + desc.addr, slots[n].len);
+        refill( desc.addr - (desc.addr % options.frame_size) );
+    }
+    __atomic_store_n(rx.consumer, cons, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+
+int XdpNetwork::receive_in_place(uint8_t **frame) {
+    if(in_place_pending) {
+        refill(in_place_addr);
+        in_place_pending = false;
+    }
+
+    wait_rx();
+
+    uint32_t cons = *rx.consumer;
+    const auto &desc = static_cast<struct xdp_desc*>(rx.descs)[cons & rx.mask];
+    uint64_t addr = desc.addr;
+    uint32_t len = desc.len;
+    __atomic_store_n(rx.consumer, cons + 1, __ATOMIC_RELEASE);
+
+    // The frame belongs to us until the next call
+    in_place_addr = addr - (addr % options.frame_size);
+    in_place_pending = true;
+
+    *frame = umem + addr;
+    return len;
+}
+
+
+uint64_t XdpNetwork::kernel_drops() {
+    struct xdp_statistics stats;
+    socklen_t len = sizeof(stats);
+
+    // Counters are cumulative, unlike PACKET_STATISTICS
+    if( getsockopt(xsk, SOL_XDP, XDP_STATISTICS, &stats, &len) < 0 ) {
+        throw puf::NetworkException( strerror(errno) );
+    }
+
+    uint64_t total = stats.rx_dropped + stats.rx_ring_full + stats.rx_fill_ring_empty_descs;
+    uint64_t retval = total - reported_drops;
+    reported_drops = total;
+    return retval;
+}
+
+
+int XdpNetwork::receive(uint8_t *buf, size_t bufSize) {
+    uint8_t *frame;
+    size_t n = receive_in_place(&frame);
+
+    n = (n < bufSize) ? n : bufSize-1;
+    memcpy(buf, frame, n);
+    buf[n] = 0;
+    return n;
+}
+
+
+int XdpNetwork::send_batch(FrameSlot *slots, size_t count) {
+    reap_completions();
+    if(tx_free.size() < count) {
+        kick();
+        reap_completions();
+    }
+
+    uint32_t prod = *tx.producer;
+    uint32_t free_descs = tx.size - (prod - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE));
+    size_t n = 0;
+
+    for(; n < count && n < free_descs && !tx_free.empty(); ++n, ++prod) {
+        uint64_t addr = tx_free.back();
+        tx_free.pop_back();
+
+        size_t len = (slots[n].len < options.frame_size) ? slots[n].len : options.frame_size;
+        memcpy(umem + addr, slots[n].data, len);
+
+        auto &desc = static_cast<struct xdp_desc*>(tx.descs)[prod & tx.mask];
+        desc.addr = addr;
+        desc.len = len;
+        desc.options = 0;
+    }
+    __atomic_store_n(tx.producer, prod, __ATOMIC_RELEASE);
+
+    if(n == 0 && count > 0) {
+        throw puf::NetworkException("No free transmit frames");
+    }
+
+    kick();
+    return n;
+}
+
+
+void XdpNetwork::send(uint8_t *buf, size_t bufSize) {
+    FrameSlot slot;
+    slot.len = (bufSize < sizeof(slot.data)) ? bufSize : sizeof(slot.data);
+    memcpy(slot.data, buf, slot.len);
+    send_batch(&slot, 1);
+}
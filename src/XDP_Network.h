@@ -0,0 +1,77 @@
+#pragma once
+
+#include "platform.h"
+#include "Batch_Network.h"
+
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <vector>
+#include <array>
+
+
+struct XdpOptions {
+    unsigned int queue_id = 0;          // NIC queue the socket is bound to
+    unsigned int frame_count = 4096;    // UMEM frames, half for receiving and half for sending
+    unsigned int frame_size = 2048;     // Size of a single UMEM frame
+    unsigned int ring_size = 2048;      // Descriptors per ring, power of two
+    std::vector<uint16_t> ethertypes;   // Only redirect these EtherTypes, empty redirects everything
+    std::vector<std::array<uint8_t, 6>> source_macs;   // Additionally only redirect these senders, requires ethertypes
+};
+
+
+/* Single producer/consumer view on one of the rings shared with the kernel */
+struct XdpRing {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t mask;
+    uint32_t size;
+    void *map;
+    size_t map_len;
+};
+
+
+/* AF_XDP socket in copy (generic/SKB) mode. Works with any driver, e.g. on a veth pair.
+ * A small XDP program redirecting the bound queue into the socket is loaded and attached at init. */
+class XdpNetwork : public BatchNetwork {
+private:
+    int xsk;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    char ifName[IFNAMSIZ];
+    unsigned int ifindex;
+    XdpOptions options;
+    bool initialised;
+
+    uint8_t *umem;
+    size_t umem_size;
+    XdpRing fill, completion, rx, tx;
+    std::vector<uint64_t> tx_free;      // UMEM addresses available for sending
+    uint64_t in_place_addr;             // Frame handed out by receive_in_place, recycled on the next call
+    bool in_place_pending;
+    uint64_t reported_drops;            // Drops already returned by kernel_drops
+
+    void setup_umem();
+    void setup_rings();
+    void map_ring(XdpRing& ring, const struct xdp_ring_offset& off, uint64_t pgoff, uint32_t size, size_t desc_size);
+    void load_program();
+    void refill(uint64_t addr);
+    void reap_completions();
+    void wait_rx();
+    void kick();
+
+public:
+    XdpNetwork(const char* iface_name, const XdpOptions& options_ = XdpOptions());
+    ~XdpNetwork();
+    void init() override;
+    void send(uint8_t *buf, size_t bufSize) override;
+    int receive(uint8_t *buf, size_t bufSize) override;
+    int receive_batch(FrameSlot *slots, size_t count) override;
+    int send_batch(FrameSlot *slots, size_t count) override;
+    int receive_in_place(uint8_t **frame) override;
+    bool in_place() const override { return true; }
+    uint64_t kernel_drops() override;
+    int poll_fd() const override { return xsk; }
+};
@@ -0,0 +1,67 @@
+#include <benchmark/benchmark.h>
+
+#include "Authentication_Server.h"
+#include "Csv_Loader.h"
+#include "Synthetic_Data.h"
+
+
+/* Allocation free row parser used by the loader */
+static void BM_ParseCsvRow(benchmark::State& state) {
+    std::string row = synthetic_row(42);
+    CompactEntry entry;
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize( parse_csv_row(row.data(), row.data() + row.size(), entry) );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ParseCsvRow);
+
+
+/* SupplicantEntry from a CSV row, including decoding the point */
+static void BM_SupplicantEntryParse(benchmark::State& state) {
+    std::string row = synthetic_row(42);
+
+    for(auto _ : state) {
+        SupplicantEntry entry(row);
+        benchmark::DoNotOptimize(entry);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SupplicantEntryParse);
+
+
+/* SupplicantEntry back to a CSV row, including encoding the point */
+static void BM_SupplicantEntryToString(benchmark::State& state) {
+    SupplicantEntry entry(synthetic_row(42));
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize( entry.to_string() );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SupplicantEntryToString);
+
+
+/* Compact entry to a CSV row as written to the journal, the point is already encoded */
+static void BM_CompactEntryToString(benchmark::State& state) {
+    CompactEntry entry = SupplicantEntry(synthetic_row(42)).compact();
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize( entry.to_string() );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompactEntryToString);
+
+
+/* Table entry to a CSV row as written by sync and compaction, including encoding the point */
+static void BM_TableEntryToString(benchmark::State& state) {
+    TableEntry entry( SupplicantEntry(synthetic_row(42)).compact() );
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize( entry.compact().to_string() );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TableEntryToString);
@@ -0,0 +1,139 @@
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "Authentication_Server.h"
+#include "Loopback_Network.h"
+#include "Pcap_Replay.h"
+#include "packets.h"
+
+
+/* Per frame hot path on a recorded capture. Frames cannot be synthesised without the supplicant's PUF, so the
+ * capture comes from the environment: PUF_ACS_BENCH_PCAP holds a connection request followed by speedtest
+ * frames, PUF_ACS_BENCH_FILE the resource file with the recorded supplicant. Skipped if they are not set.
+ * The numbers depend on that capture (frame sizes, curve, share of frames that validate) and are only
+ * comparable between runs on the same one, so every result is labelled with the capture it was taken on. */
+namespace {
+
+struct FrameFixture {
+    PcapFile pcap;
+    LoopbackNetwork net;
+    std::unique_ptr<AuthenticationServerImpl> as;
+    std::unique_ptr<puf::Authenticator> au;
+    std::vector<PcapFrame> frames;      // Speedtest frames of the capture
+    std::string capture;                // Label of the results
+    std::string error;
+
+    FrameFixture() {
+        using namespace puf;
+        const char *pcap_path = getenv("PUF_ACS_BENCH_PCAP");
+        const char *resource_path = getenv("PUF_ACS_BENCH_FILE");
+
+        if(!pcap_path || !resource_path) {
+            error = "Set PUF_ACS_BENCH_PCAP and PUF_ACS_BENCH_FILE to run the frame benchmarks";
+            return;
+        }
+
+        capture = std::string("capture ") + pcap_path;
+        try {
+            pcap.open(pcap_path);
+        } catch(const std::runtime_error &e) {
+            error = e.what();
+            return;
+        }
+
+        as = std::make_unique<AuthenticationServerImpl>(resource_path);
+        au = std::make_unique<Authenticator>(net, *as);
+        au->init();
+
+        for(const auto &frame : pcap.get_frames()) {
+            auto *data = const_cast<uint8_t*>(frame.data);
+            PacketType type = deduce_type(data, frame.len);
+            if(type == PUF_CON_E && frames.empty()) {
+                au->accept(data, frame.len);
+            } else if(type == PUF_PERFORMANCE_E) {
+                frames.push_back(frame);
+            }
+        }
+        if(frames.empty()) error = "Capture contains no speedtest frames";
+    }
+};
+
+
+FrameFixture& fixture() {
+    static FrameFixture retval;
+    return retval;
+}
+
+}
+
+
+static void BM_DeduceType(benchmark::State& state) {
+    auto &fx = fixture();
+    if( !fx.error.empty() ) {
+        state.SkipWithError(fx.error.c_str());
+        return;
+    }
+
+    size_t i = 0;
+    for(auto _ : state) {
+        const auto &frame = fx.frames[i++ % fx.frames.size()];
+        benchmark::DoNotOptimize( puf::deduce_type(frame.data, frame.len) );
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(fx.capture);
+}
+BENCHMARK(BM_DeduceType);
+
+
+static void BM_FromBinary(benchmark::State& state) {
+    auto &fx = fixture();
+    if( !fx.error.empty() ) {
+        state.SkipWithError(fx.error.c_str());
+        return;
+    }
+
+    puf::PUF_Performance pp;
+    size_t i = 0;
+    for(auto _ : state) {
+        const auto &frame = fx.frames[i++ % fx.frames.size()];
+        pp.from_binary(frame.data, frame.len);
+        benchmark::DoNotOptimize(pp);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(fx.capture);
+}
+BENCHMARK(BM_FromBinary);
+
+
+/* deduce_type, from_binary and validate, i.e. everything the speedtest does per frame after receiving it */
+static void BM_FramePath(benchmark::State& state) {
+    using namespace puf;
+    auto &fx = fixture();
+    if( !fx.error.empty() ) {
+        state.SkipWithError(fx.error.c_str());
+        return;
+    }
+
+    PUF_Performance pp;
+    size_t i = 0, bytes = 0, valid = 0;
+    for(auto _ : state) {
+        const auto &frame = fx.frames[i++ % fx.frames.size()];
+        if(deduce_type(frame.data, frame.len) != PUF_PERFORMANCE_E) continue;
+        pp.from_binary(frame.data, frame.len);
+        if( fx.au->validate(pp, true) ) valid++;
+        bytes += frame.len;
+    }
+
+    // Rejected frames take a shorter path, timing only those would measure the wrong thing
+    if(valid == 0) {
+        state.SkipWithError("No frame of the capture validated, PUF_ACS_BENCH_FILE has to hold its supplicant");
+        return;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(bytes);
+    state.counters["valid"] = benchmark::Counter(static_cast<double>(valid) / state.iterations());
+    state.SetLabel(fx.capture);
+}
+BENCHMARK(BM_FramePath);
@@ -0,0 +1,23 @@
+#include <benchmark/benchmark.h>
+#include <memory>
+
+#include "Csv_Loader.h"
+#include "Synthetic_Data.h"
+
+
+/* Loading a CSV resource file, single threaded (threads=1) and on all cores (threads=0) */
+static void BM_LoadCsv(benchmark::State& state) {
+    std::string path = synthetic_csv(state.range(0));
+    unsigned int threads = state.range(1);
+
+    for(auto _ : state) {
+        auto table = std::make_unique<SupplicantTable>();
+        benchmark::DoNotOptimize( load_csv(path, *table, threads) );
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_LoadCsv)
+    ->ArgNames({"rows", "threads"})
+    ->ArgsProduct({{1000000, 10000000}, {1, 0}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
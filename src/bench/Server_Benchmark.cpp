@@ -0,0 +1,109 @@
+#include <benchmark/benchmark.h>
+#include <map>
+#include <memory>
+
+#include "Authentication_Server.h"
+#include "Synthetic_Data.h"
+
+
+/* One fetched server per size, shared by the query and store benchmarks */
+static AuthenticationServerImpl& fetched_server(size_t rows) {
+    static std::map<size_t, std::unique_ptr<AuthenticationServerImpl>> servers;
+    auto &server = servers[rows];
+
+    if(!server) {
+        server = std::make_unique<AuthenticationServerImpl>( synthetic_csv(rows) );
+        server->fetch();
+    }
+    return *server;
+}
+
+
+/* Loading the resource file into a fresh server */
+static void BM_Fetch(benchmark::State& state) {
+    std::string path = synthetic_csv(state.range(0));
+
+    for(auto _ : state) {
+        AuthenticationServerImpl as(path);
+        as.fetch();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Fetch)
+    ->ArgName("rows")
+    ->Arg(1000)->Arg(1000000)->Arg(10000000)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+
+/* Looking up supplicants in random order without touching their counters */
+static void BM_Query(benchmark::State& state) {
+    size_t rows = state.range(0);
+    auto &as = fetched_server(rows);
+    uint64_t step = 0;
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize( as.query(synthetic_mac( synthetic_index(step++, rows) ), false) );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Query)
+    ->ArgName("rows")
+    ->Arg(1000)->Arg(1000000)->Arg(10000000);
+
+
+/* Authenticating supplicants in random order, every query consumes one counter value. The small table
+ * is left out, its 1000 counters per supplicant would run out within one run. */
+static void BM_QueryDecrement(benchmark::State& state) {
+    size_t rows = state.range(0);
+    auto &as = fetched_server(rows);
+    static uint64_t step = 0;   // Continue where the previous run stopped instead of draining the same supplicants
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize( as.query(synthetic_mac( synthetic_index(step++, rows) ), true) );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryDecrement)
+    ->ArgName("rows")
+    ->Arg(1000000)->Arg(10000000);
+
+
+/* Registering new supplicants in a table of the given size */
+static void BM_Store(benchmark::State& state) {
+    size_t rows = state.range(0);
+    auto &as = fetched_server(rows);
+    static uint64_t next = 1ULL << 40;     // Far beyond the rows of any synthetic file
+    puf::ECP_Point A;
+    MuteStdout mute;
+
+    A.from_base64( reinterpret_cast<const uint8_t*>(SupplicantEntry(synthetic_row(0)).compact().point) );
+    for(auto _ : state) {
+        puf::MAC base_mac = synthetic_mac(next);
+        puf::MAC hashed_mac = synthetic_mac(next + 1);
+        next += 2;
+        as.store(base_mac, A, hashed_mac, 1000);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Store)
+    ->ArgName("rows")
+    ->Arg(1000)->Arg(1000000)->Arg(10000000);
+
+
+/* Rewriting the whole resource file, as done on every edit without a journal. 10M rows (about 1.3 GB per
+ * iteration) are left out to keep the suite short. */
+static void BM_Sync(benchmark::State& state) {
+    AuthenticationServerImpl as( synthetic_csv_copy(state.range(0), "sync") );
+    as.fetch();
+
+    for(auto _ : state) {
+        as.sync();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Sync)
+    ->ArgName("rows")
+    ->Arg(1000)->Arg(1000000)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
@@ -0,0 +1,78 @@
+#include "Synthetic_Data.h"
+
+#include <fstream>
+#include <cstdio>
+#include <unistd.h>
+
+
+// Uncompressed secp256r1 generator, stands in for the public point of every synthetic supplicant
+static const char POINT[] = "BGsX0fLhLEJH+Lzm5WOkQPJ3A32BLeszoPShOUXYmMKWT+NC4v4af5uO5+tKfA+eFivOM1drMV7Oy7ZAaDe/UfU=";
+
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+
+std::string synthetic_row(uint64_t i) {
+    char row[256];
+    uint64_t base = splitmix64(2*i);
+    uint64_t hashed = splitmix64(2*i + 1) | 1;     // Never the all zero MAC
+
+    snprintf(row, sizeof(row), "%d;%x:%x:%x:%x:%x:%x;%s;%x:%x:%x:%x:%x:%x;\n",
+        1000,
+        (unsigned)(base >> 40) & 0xff, (unsigned)(base >> 32) & 0xff, (unsigned)(base >> 24) & 0xff,
+        (unsigned)(base >> 16) & 0xff, (unsigned)(base >> 8) & 0xff, (unsigned)base & 0xff,
+        POINT,
+        (unsigned)(hashed >> 40) & 0xff, (unsigned)(hashed >> 32) & 0xff, (unsigned)(hashed >> 24) & 0xff,
+        (unsigned)(hashed >> 16) & 0xff, (unsigned)(hashed >> 8) & 0xff, (unsigned)hashed & 0xff);
+    return row;
+}
+
+
+puf::MAC synthetic_mac(uint64_t i) {
+    puf::MAC retval;
+    uint64_t hashed = splitmix64(2*i + 1) | 1;
+
+    for(int j=0; j<6; ++j) {
+        retval.bytes[j] = (hashed >> (40 - 8*j)) & 0xff;
+    }
+    return retval;
+}
+
+
+uint64_t synthetic_index(uint64_t step, size_t n) {
+    return splitmix64(step) % n;
+}
+
+
+std::string synthetic_csv(size_t rows) {
+    std::string path = "/tmp/puf-acs-bench-" + std::to_string(rows) + ".csv";
+
+    if( access(path.c_str(), R_OK) == 0 ) {
+        return path;
+    }
+
+    std::string tmp = path + ".part";
+    {
+        std::ofstream ofs(tmp, std::ios::trunc);
+        for(size_t i=0; i<rows; ++i) {
+            ofs << synthetic_row(i);
+        }
+    }
+    rename(tmp.c_str(), path.c_str());
+    return path;
+}
+
+
+std::string synthetic_csv_copy(size_t rows, const std::string& tag) {
+    std::string path = "/tmp/puf-acs-bench-" + tag + "-" + std::to_string(rows) + ".csv";
+    std::ifstream ifs(synthetic_csv(rows), std::ios::binary);
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+
+    ofs << ifs.rdbuf();
+    return path;
+}
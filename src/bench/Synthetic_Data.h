@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include "authenticator.h"
+
+
+/* Deterministic supplicant rows, identical on every machine and run */
+std::string synthetic_row(uint64_t i);
+
+/* Hashed MAC of synthetic row i, the key it is stored under */
+puf::MAC synthetic_mac(uint64_t i);
+
+/* Path of a CSV resource file with `rows` synthetic rows, generated in the temp directory on first use */
+std::string synthetic_csv(size_t rows);
+
+/* Private copy of synthetic_csv(rows) for benchmarks that write the resource file */
+std::string synthetic_csv_copy(size_t rows, const std::string& tag);
+
+/* Pseudo random but fixed visiting order of n rows */
+uint64_t synthetic_index(uint64_t step, size_t n);
+
+
+/* Silences std::cout while in scope, e.g. the "Inserted new mac" message of every store */
+class MuteStdout {
+private:
+    std::streambuf *saved;
+public:
+    MuteStdout() : saved(std::cout.rdbuf(nullptr)) {}
+    ~MuteStdout() { std::cout.rdbuf(saved); }
+};
@@ -2,10 +2,27 @@
 #include <signal.h>
 #include <iostream>
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <fstream>
+#include <functional>
 
 
 #include "Berkeley_Network.h"
+#include "XDP_Network.h"
+#include "Fanout_Workers.h"
+#include "Speedtest_Pipeline.h"
+#include "Daemon.h"
+#include "Load_Test.h"
+#include "Fake_Slave.h"
+#include "Pcap_Replay.h"
+#include "Speedtest.h"
+#include "Metrics.h"
+#include "Admission_Control.h"
 #include "Authentication_Server.h"
+#include "Remote_Authentication_Server.h"
+#include "Remote_Server.h"
 #include "Serial_Master.h"
 #include "Options.h"
 
@@ -32,62 +49,237 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
     }
 
+    AdmissionControl::configure(opts.rate_limit, opts.rate_burst, opts.rate_sources);
+
+    // The daemon and the server take signals synchronously, they must be blocked before any thread starts
+    if( opts.daemon || !opts.serve.empty() ) {
+        Daemon::block_signals();
+    }
+
+    JournalOptions journal_opts;
+    journal_opts.flush_interval_ms = opts.flush_interval_ms;
+    journal_opts.fsync_batch = opts.fsync_batch;
+    journal_opts.compact_every = opts.compact_every;
+
+    // Offline conversion between the CSV and the binary resource format
+    if( !opts.convert_to.empty() ) {
+        AuthenticationServerImpl as( opts.resource_file );
+        as.fetch();
+        as.export_to( opts.convert_to );
+        return 0;
+    }
+
+    // Authentication server for --remote clients, SIGHUP reloads the resource file
+    if( !opts.serve.empty() ) {
+        try {
+            AuthenticationServerImpl as( opts.resource_file, opts.save_on_edit, journal_opts, opts.watch );
+            if( !opts.shared_store.empty() ) as.set_shared_store(opts.shared_store);
+            as.set_session_cache(opts.session_cache);
+            as.fetch();
+
+            RemoteServer server(as, opts.serve);
+            server.start();
+
+            sigset_t mask;
+            int signum;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGINT);
+            sigaddset(&mask, SIGTERM);
+            sigaddset(&mask, SIGHUP);
+            while( sigwait(&mask, &signum) == 0 && signum == SIGHUP ) {
+                as.reload();
+            }
+            server.stop();
+            Metrics::print(std::cout);
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+        puts("Feddisch");
+        return 0;
+    }
+
+    // Hardware free run: a recorded capture is fed through an in-process network
+    if( !opts.replay_file.empty() ) {
+        try {
+            LoopbackNetwork net;
+            AuthenticationServerImpl as( opts.resource_file, opts.save_on_edit );
+            as.set_session_cache(opts.session_cache);
+            Authenticator au(net, as);
+            PcapReplay replay( opts.replay_file );
+
+            au.init();
+            replay.start(net, opts.replay_timing == "original", opts.replay_speed);
+            SpeedtestStats stats = process_replay(net, au);
+            replay.wait();
+
+            stats.print();
+            Metrics::print(std::cout);
+            if( !opts.results_file.empty() ) {
+                std::ofstream results(opts.results_file, std::ios::app);
+                stats.write_json(results);
+            }
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        } catch(const Exception &e) {
+            puts(e.what());
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+
 
     try {
 
-    BerkeleyNetwork net( opts.iface_name.c_str() ); 
-    AuthenticationServerImpl as( opts.resource_file.c_str(), opts.save_on_edit ); 
-    Authenticator au(net, as);
+    BerkeleyOptions net_opts;
+    net_opts.rx_ring = opts.rx_ring;
+    net_opts.ring_block_count = opts.ring_blocks;
+    net_opts.ethertypes = opts.ethertypes;
+    net_opts.source_macs = opts.allowed_macs;
+    net_opts.timestamps = opts.timestamps;
+
+    // One socket per interface, the menu only uses the first
+    std::vector<std::unique_ptr<BatchNetwork>> nets;
+    for(const auto &iface_name : opts.interfaces) {
+        if(opts.backend == "xdp") {
+            XdpOptions xdp_opts;
+            xdp_opts.queue_id = opts.xdp_queue;
+            xdp_opts.ethertypes = opts.ethertypes;
+            xdp_opts.source_macs = opts.allowed_macs;
+            nets.push_back( std::make_unique<XdpNetwork>( iface_name.c_str(), xdp_opts ) );
+        } else {
+            nets.push_back( std::make_unique<BerkeleyNetwork>( iface_name.c_str(), net_opts ) );
+        }
+    }
+
+    BatchNetwork &net = *nets.front();
+
+    // Entries come from the resource file or from a remote server
+    std::unique_ptr<AuthenticationServer> server;
+    std::function<void()> reload;
+    if( !opts.remote.empty() ) {
+        RemoteOptions remote_opts;
+        remote_opts.lease = opts.remote_lease;
+        remote_opts.cache_entries = opts.session_cache;
+        auto remote = std::make_unique<RemoteAuthenticationServer>(opts.remote, remote_opts);
+        reload = [remote = remote.get()]() { remote->reload(); };
+        server = std::move(remote);
+    } else {
+        auto local = std::make_unique<AuthenticationServerImpl>( opts.resource_file.c_str(), opts.save_on_edit, journal_opts, opts.watch );
+        if( !opts.shared_store.empty() ) local->set_shared_store(opts.shared_store);
+        local->set_session_cache(opts.session_cache);
+        reload = [local = local.get()]() { local->reload(); };
+        server = std::move(local);
+    }
+    AuthenticationServer &as = *server;
+
+    // Authenticator contexts per interface sharing the authentication server
+    std::vector<std::unique_ptr<Authenticator>> authenticators;
+    for(auto &iface_net : nets) {
+        authenticators.push_back( std::make_unique<Authenticator>(*iface_net, as) );
+    }
+    Authenticator &au = *authenticators.front();
 
     SerialMaster serial_master("ttyUSB0");
     UserDialog user_dialog;
 
-    au.init();
+    for(auto &authenticator : authenticators) {
+        authenticator->init();
+    }
 
-    uint8_t buffer[1522];
+    constexpr size_t BATCH_SIZE = 32;
+    std::vector<FrameSlot> slots(BATCH_SIZE);
     size_t n;
-    size_t received_bytes = 0;
 
+    // Optional metrics endpoint
+    std::unique_ptr<MetricsServer> metrics;
+    if( !opts.metrics_socket.empty() || opts.metrics_port > 0 ) {
+        metrics = std::make_unique<MetricsServer>(opts.metrics_socket, opts.metrics_port);
+        try {
+            metrics->start();
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            metrics.reset();
+        }
+    }
+
+    // Parallel load test with a fleet of slaves
+    if( !opts.slaves.empty() || opts.fake_slaves > 0 ) {
+        LoadTestOptions load_opts;
+        load_opts.sign_up = opts.sign_up_slaves;
+        load_opts.results_file = opts.results_file;
+
+        try {
+            std::vector<std::unique_ptr<FakeSlave>> fakes;
+            std::vector<std::string> ports = opts.slaves;
+            for(int i=0; i<opts.fake_slaves; ++i) {
+                fakes.push_back( std::make_unique<FakeSlave>("fake" + std::to_string(i)) );
+                fakes.back()->start();
+                ports.push_back( fakes.back()->get_port() );
+            }
 
-    auto speedtest = [&]() {
-        using namespace std::chrono;
-        bool speedtesting = true;
+            SerialFleet fleet(ports);
+            run_load_test(net, au, fleet, load_opts);
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
 
-        high_resolution_clock::time_point start, end;
-        PUF_Performance pp;
+    // Headless mode, the menu actions are taken from the control socket
+    if(opts.daemon) {
+        DaemonOptions daemon_opts;
+        daemon_opts.control_socket = opts.control_socket;
+        daemon_opts.results_file = opts.results_file;
 
-        while(speedtesting) {
-            n = net.receive(buffer, sizeof(buffer));
-            if(deduce_type(buffer, sizeof(buffer)) != PUF_PERFORMANCE_E) {
-                continue;
+        try {
+            Daemon daemon(as, reload, serial_master, daemon_opts);
+            for(size_t i=0; i<nets.size(); ++i) {
+                daemon.add_interface(opts.interfaces[i], *nets[i], *authenticators[i]);
             }
-            
-            pp.from_binary(buffer, n);
-            switch( pp.get_data()[0] ) {
-                case 'F':
-                    start = high_resolution_clock::now();
-                case 'H':
-                    if( au.validate(pp, true) ) {
-                        received_bytes += pp.header_len();
-                    }
-                    break;
+            daemon.run();
+        } catch(const std::runtime_error &e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+        puts("Feddisch");
+        return 0;
+    }
 
-                case 'L':
-                    end = high_resolution_clock::now();
-                    received_bytes += pp.header_len();
-                    speedtesting = false;
-                    break;
+    // Optional fanout workers sharing the authentication server
+    std::unique_ptr<FanoutWorkers> workers;
+    if(opts.workers > 1) {
+        workers = std::make_unique<FanoutWorkers>(opts.interfaces.front(), net_opts, as, opts.workers);
+        workers->init();
+    }
 
-                default:
-                    std::cerr << "Default statement reached\n";
-                    ;
-            }
+
+    // Optional validation pipeline behind the main socket
+    std::unique_ptr<SpeedtestPipeline> pipeline;
+    if(!workers && opts.validators > 0) {
+        pipeline = std::make_unique<SpeedtestPipeline>(net, as, opts.validators);
+        pipeline->init();
+    }
+
+
+    // Ctrl-C ends a running speedtest with what was received so far. The slave is still being instructed
+    // while the test waits for its frames.
+    SpeedtestPoll keep_going = [&]() {
+        serial_master.service(0);
+        return keepGoing != 0;
+    };
+
+    auto speedtest = [&]() {
+        SpeedtestStats stats = workers ? workers->speedtest(1, keep_going) : pipeline ? pipeline->speedtest(1, keep_going) : run_speedtest(net, au, keep_going);
+        stats.interface = opts.interfaces.front();
+        stats.print();
+
+        if( !opts.results_file.empty() ) {
+            std::ofstream results(opts.results_file, std::ios::app);
+            stats.write_json(results);
         }
-        auto duration = end-start;
-        double to_mbit_s = 8.0 / 1024;
-        std::cout << "Received for\t" << duration.count() << " ms" << std::endl;
-        std::cout << "Received\t" << received_bytes << " bytes" << std::endl;
-        std::cout << "Average speed:\t" << ((double)received_bytes/(double)duration.count()) * to_mbit_s << " mbit/s" << std::endl;
     };
 
 
@@ -95,6 +287,7 @@ int main(int argc, char** argv) {
         switch(user_dialog.get_user_input()) {
             case STATUS:
                 serial_master.show_status();
+                Metrics::print(std::cout);
                 break;
 
             case CONFIG:
@@ -102,28 +295,62 @@ int main(int argc, char** argv) {
                 break;
 
             case CONNECT:
+            {
+                // The fanout workers receive the speedtests, the menu socket only queued stale copies meanwhile
+                if(workers) net.discard_pending();
                 serial_master.slave_connect();
-                n = net.receive(buffer, sizeof(buffer));
-                if( deduce_type(buffer, sizeof(buffer)) != PUF_CON_E ) {
+                {
+                    StageTimer timer(Metrics::RECEIVE);
+                    n = net.receive_batch(slots.data(), slots.size());
+                }
+
+                // Accept the first connection request of the batch
+                auto con = std::find_if(slots.begin(), slots.begin()+n, [](FrameSlot &slot) {
+                    return deduce_type(slot.data, slot.len) == PUF_CON_E && AdmissionControl::admit(slot.data, slot.len);
+                });
+                if( con == slots.begin()+n ) {
                     break;
                 }
 
-                if(au.accept(buffer, n) != 0) {
+                int rejected;
+                {
+                    StageTimer timer(Metrics::ACCEPT);
+                    rejected = au.accept(con->data, con->len);
+                }
+                if(rejected != 0) {
                     std::cout << "Rejected" << std::endl;
                 } else {
                     std::cout << "Accepted" << std::endl;
                 }
                 break;
+            }
 
             case UserInput::REGISTER:
+                if(workers) net.discard_pending();
                 serial_master.slave_sign_up();
-                au.sign_up();
+                try {
+                    au.sign_up();
+                } catch(const std::runtime_error &e) {
+                    std::cerr << "Error signing up: " << e.what() << '\n';
+                }
                 break;
 
             case SPEEDTEST:
-                serial_master.slave_speedtest();
-                speedtest();                
+            {
+                // Receiving starts right away, the first frames may arrive before the slave's answer
+                bool slave_done = false;
+                serial_master.slave_speedtest([&](bool ok, const std::string& reply) {
+                    if(ok) {
+                        puts(reply.c_str());
+                    } else {
+                        printf("Wrong answer: %s\n", reply.c_str());
+                    }
+                    slave_done = true;
+                });
+                speedtest();
+                serial_master.wait_for(slave_done);
                 break;
+            }
 
             case RECONNECT:
                 serial_master.reconnect();
@@ -148,6 +375,9 @@ int main(int argc, char** argv) {
 
     } catch(const Exception &e) {
         puts(e.what());
+    } catch(const std::runtime_error &e) {
+        std::cerr << e.what() << '\n';
+        return EXIT_FAILURE;
     }
 
     puts("Feddisch");